@@ -0,0 +1,490 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Settings for one benchmark run, filled in from the command line
+struct BenchConfig {
+    std::string codesnip;                                   // Path to the codesnip binary under test
+    std::string work_dir = "codesnip_bench_data";           // Where corpora are generated
+    std::string output;                                     // JSON output file; stdout if empty
+    std::string label;                                      // Free-form label, e.g. a commit hash
+    std::vector<uint64_t> template_counts = {1, 1000, 100000};
+    std::vector<uint64_t> target_sizes = {1 << 10, 1 << 20, 64 << 20};
+    uint64_t body_lines = 12;                               // Average body length; actual lengths vary 1..2x
+    int iterations = 20;
+    bool generate_only = false;
+    uint64_t seed = 42;
+};
+
+// Timing and memory usage of one command invocation
+struct Sample {
+    double seconds = 0;
+    long peak_rss_kb = 0;
+    int exit_code = 0;
+    bool wrote_errors = false;  // The command printed to standard error
+};
+
+// Files codesnip keeps next to a library: index, search index, name table, line checkpoints, writer lock
+const char* const SIDECAR_SUFFIXES[] = {".idx", ".tri", ".names", ".lines", ".lock"};
+
+// Aggregated results of one operation under one cache state
+struct OperationResult {
+    std::string operation;
+    std::string cache;
+    uint64_t templates = 0;
+    uint64_t library_bytes = 0;
+    uint64_t target_bytes = 0;
+    std::vector<Sample> samples;
+};
+
+// Returns the size of a file, or 0 if it does not exist
+uint64_t file_size(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+// Copies a file byte for byte
+bool copy_file(const std::string& from, const std::string& to) {
+    std::ifstream input(from, std::ios::binary);
+    std::ofstream output(to, std::ios::binary | std::ios::trunc);
+    output << input.rdbuf();
+    return input.good() && output.good();
+}
+
+// Removes a library's sidecar files, so the next command starts without any
+void remove_sidecars(const std::string& library) {
+    for (const char* suffix : SIDECAR_SUFFIXES) {
+        std::remove((library + suffix).c_str());
+    }
+}
+
+// Asks the kernel to drop a file from the page cache; best effort, and a no-op where unsupported
+void evict_from_cache(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+#ifdef POSIX_FADV_DONTNEED
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#elif defined(F_NOCACHE)
+    fcntl(fd, F_NOCACHE, 1);
+#endif
+    close(fd);
+}
+
+/**
+ * @brief Writes a synthetic snippet library.
+ *
+ * Templates are named t0, t1, ... and have bodies of 1 to 2x the configured average line count, with
+ * indented, code-like lines of varying width, separated by empty lines as extract writes them.
+ *
+ * @param path File to write.
+ * @param templates Number of templates.
+ * @param body_lines Average number of body lines.
+ * @param rng Random source, so corpora are reproducible for a given seed.
+ */
+
+void generate_library(const std::string& path, uint64_t templates, uint64_t body_lines, std::mt19937_64& rng) {
+    std::ofstream output(path, std::ios::binary | std::ios::trunc);
+    std::uniform_int_distribution<uint64_t> line_count(1, std::max<uint64_t>(1, body_lines * 2));
+    std::uniform_int_distribution<int> width(8, 90);
+    std::uniform_int_distribution<int> depth(0, 3);
+    std::string buffer;
+
+    for (uint64_t i = 0; i < templates; ++i) {
+        buffer += "#-- name: t" + std::to_string(i) + "\n";
+        uint64_t lines = line_count(rng);
+        for (uint64_t line = 0; line < lines; ++line) {
+            buffer.append(depth(rng) * 4, ' ');
+            buffer += "value_" + std::to_string(line) + " = compute(";
+            buffer.append(width(rng), (char)('a' + rng() % 26));
+            buffer += ");\n";
+        }
+        buffer += "#-- end\n\n";
+
+        if (buffer.size() >= (1 << 20)) {
+            output.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+    output.write(buffer.data(), buffer.size());
+}
+
+// Writes a synthetic source file of roughly the given size; returns its line count
+uint64_t generate_target(const std::string& path, uint64_t size, std::mt19937_64& rng) {
+    std::ofstream output(path, std::ios::binary | std::ios::trunc);
+    std::uniform_int_distribution<int> width(0, 100);
+    std::uniform_int_distribution<int> depth(0, 4);
+    std::string buffer;
+    uint64_t written = 0;
+    uint64_t lines = 0;
+
+    while (written < size) {
+        buffer.append(depth(rng) * 4, ' ');
+        buffer += "call_" + std::to_string(lines) + "(";
+        buffer.append(width(rng), 'x');
+        buffer += ");\n";
+        lines++;
+
+        if (buffer.size() >= (1 << 20) || written + buffer.size() >= size) {
+            output.write(buffer.data(), buffer.size());
+            written += buffer.size();
+            buffer.clear();
+        }
+    }
+    return lines;
+}
+
+/**
+ * @brief Runs the codesnip binary once and measures it.
+ *
+ * The child's output is discarded, but whether it wrote to standard error is noted, since a failed
+ * command can still exit with status 0. Wall time is measured around fork/wait, and the peak resident
+ * set size comes from the child's resource usage.
+ *
+ * @param config Benchmark settings.
+ * @param args Arguments after the binary name.
+ * @return The measurements.
+ */
+
+Sample run_codesnip(const BenchConfig& config, const std::vector<std::string>& args) {
+    std::vector<char*> argv;
+    argv.push_back((char*)config.codesnip.c_str());
+    for (const std::string& arg : args) {
+        argv.push_back((char*)arg.c_str());
+    }
+    argv.push_back(nullptr);
+
+    Sample sample;
+    std::string errors_file = config.work_dir + "/stderr.txt";
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        int errors_fd = open(errors_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(errors_fd >= 0 ? errors_fd : null_fd, STDERR_FILENO);
+        setenv("CODESNIP_NO_DAEMON", "1", 1);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    int status = 0;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    sample.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+#ifdef __APPLE__
+    sample.peak_rss_kb = usage.ru_maxrss / 1024; // Reported in bytes on macOS
+#else
+    sample.peak_rss_kb = usage.ru_maxrss;
+#endif
+    sample.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    sample.wrote_errors = file_size(errors_file) > 0;
+    return sample;
+}
+
+// Returns the given percentile of a sorted list of values
+double percentile(const std::vector<double>& sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t position = (size_t)(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(position, sorted.size() - 1)];
+}
+
+// Escapes a string for a JSON string literal
+std::string json_string(const std::string& value) {
+    std::string escaped = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if ((unsigned char)c < 0x20) {
+            char code[8];
+            std::snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped + "\"";
+}
+
+// Formats one operation's results as a JSON object
+std::string result_json(const OperationResult& result) {
+    std::vector<double> latencies;
+    long peak_rss_kb = 0;
+    int failures = 0;
+    for (const Sample& sample : result.samples) {
+        latencies.push_back(sample.seconds * 1000.0);
+        peak_rss_kb = std::max(peak_rss_kb, sample.peak_rss_kb);
+        failures += sample.exit_code != 0 || sample.wrote_errors ? 1 : 0;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    double mean = 0;
+    for (double latency : latencies) {
+        mean += latency;
+    }
+    mean = latencies.empty() ? 0 : mean / latencies.size();
+
+    // Throughput counts the bytes the operation has to consider: the library, plus the target if any
+    double bytes = (double)(result.library_bytes + result.target_bytes);
+    double throughput = mean > 0 ? bytes / (1024.0 * 1024.0) / (mean / 1000.0) : 0;
+
+    std::ostringstream json;
+    json << "{\"operation\": " << json_string(result.operation)
+         << ", \"cache\": " << json_string(result.cache)
+         << ", \"templates\": " << result.templates
+         << ", \"library_bytes\": " << result.library_bytes
+         << ", \"target_bytes\": " << result.target_bytes
+         << ", \"iterations\": " << result.samples.size()
+         << ", \"failures\": " << failures
+         << ", \"latency_ms\": {\"mean\": " << mean
+         << ", \"p50\": " << percentile(latencies, 0.50)
+         << ", \"p90\": " << percentile(latencies, 0.90)
+         << ", \"p99\": " << percentile(latencies, 0.99)
+         << ", \"max\": " << (latencies.empty() ? 0 : latencies.back()) << "}"
+         << ", \"throughput_mib_per_s\": " << throughput
+         << ", \"peak_rss_kb\": " << peak_rss_kb << "}";
+    return json.str();
+}
+
+/**
+ * @brief Benchmarks every command against one library size and one target size.
+ *
+ * Each operation starts from a fresh copy of the generated library and target. Warm runs follow one
+ * untimed warm-up run, which also builds any sidecar indexes; cold runs evict the files from the page
+ * cache before every iteration.
+ *
+ * @param config Benchmark settings.
+ * @param templates Number of templates in the library.
+ * @param target_size Approximate size of the target file in bytes.
+ * @param results Receives one entry per operation and cache state.
+ */
+
+void bench_configuration(const BenchConfig& config, uint64_t templates, uint64_t target_size,
+std::vector<OperationResult>& results) {
+    std::mt19937_64 rng(config.seed ^ (templates * 1000003ULL) ^ target_size);
+    std::string prefix = config.work_dir + "/lib" + std::to_string(templates) + "_tgt" + std::to_string(target_size);
+    std::string library_master = prefix + "_library.txt";
+    std::string target_master = prefix + "_target.txt";
+
+    if (file_size(library_master) == 0) {
+        generate_library(library_master, templates, config.body_lines, rng);
+    }
+    uint64_t target_lines = 0;
+    if (file_size(target_master) == 0) {
+        target_lines = generate_target(target_master, target_size, rng);
+    } else {
+        std::ifstream input(target_master, std::ios::binary);
+        target_lines = std::count(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>(), '\n');
+    }
+    if (config.generate_only) {
+        return;
+    }
+
+    std::string library = prefix + "_work_library.txt";
+    std::string target = prefix + "_work_target.txt";
+    const char* operations[] = {"list", "show", "insert", "extract", "delete", "rename"};
+    const char* caches[] = {"warm", "cold"};
+
+    for (const char* operation : operations) {
+        for (const char* cache : caches) {
+            copy_file(library_master, library);
+            copy_file(target_master, target);
+            remove_sidecars(library);
+
+            OperationResult result;
+            result.operation = operation;
+            result.cache = cache;
+            result.templates = templates;
+            result.library_bytes = file_size(library);
+            bool uses_target = std::strcmp(operation, "insert") == 0 || std::strcmp(operation, "extract") == 0;
+            result.target_bytes = uses_target ? file_size(target) : 0;
+
+            // Arguments for iteration i; names are chosen so that every iteration succeeds
+            auto arguments = [&](int i) {
+                std::string name = "t" + std::to_string((templates - 1 - (uint64_t)i % templates));
+                std::string line = std::to_string(1 + (target_lines * (i + 1)) / (config.iterations + 2));
+                std::string op = operation;
+                if (op == "list") {
+                    return std::vector<std::string>{"list", library};
+                } else if (op == "show") {
+                    return std::vector<std::string>{"show", name, library};
+                } else if (op == "insert") {
+                    return std::vector<std::string>{"insert", name, target, line, library};
+                } else if (op == "extract") {
+                    return std::vector<std::string>{"extract", target, line, line, "bench_" + std::to_string(i), library};
+                } else if (op == "delete") {
+                    return std::vector<std::string>{"delete", "t" + std::to_string(i % templates), library};
+                }
+                return std::vector<std::string>{"rename", "t" + std::to_string(i % templates),
+                                                "renamed_" + std::to_string(i), library};
+            };
+
+            // The warm-up must leave every timed run able to succeed: it extracts under a name of its own,
+            // and does not delete or rename anything
+            bool mutates = std::strcmp(operation, "delete") == 0 || std::strcmp(operation, "rename") == 0;
+            if (std::strcmp(cache, "warm") == 0) {
+                std::vector<std::string> warm_up = arguments(0);
+                if (mutates) {
+                    warm_up = {"show", "t0", library};
+                } else if (std::strcmp(operation, "extract") == 0) {
+                    warm_up[4] = "bench_warm_up";
+                }
+                run_codesnip(config, warm_up);
+            }
+
+            for (int i = 0; i < config.iterations; ++i) {
+                if ((uint64_t)i >= templates && mutates) {
+                    break; // Nothing left to delete or rename
+                }
+                if (std::strcmp(cache, "cold") == 0) {
+                    evict_from_cache(library);
+                    for (const char* suffix : SIDECAR_SUFFIXES) {
+                        evict_from_cache(library + suffix);
+                    }
+                    evict_from_cache(target);
+                }
+                result.samples.push_back(run_codesnip(config, arguments(i)));
+            }
+
+            std::cerr << "  " << operation << " (" << cache << "): " << result.samples.size() << " runs" << std::endl;
+            results.push_back(result);
+        }
+    }
+
+    std::remove(library.c_str());
+    remove_sidecars(library);
+    std::remove(target.c_str());
+    std::remove((config.work_dir + "/stderr.txt").c_str());
+}
+
+// Parses a comma-separated list of sizes; accepts K, M and G suffixes
+std::vector<uint64_t> parse_sizes(const std::string& text) {
+    std::vector<uint64_t> sizes;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        char* end = nullptr;
+        uint64_t value = std::strtoull(item.c_str(), &end, 10);
+        switch (end && *end ? std::toupper(*end) : 0) {
+            case 'K': value <<= 10; break;
+            case 'M': value <<= 20; break;
+            case 'G': value <<= 30; break;
+            default: break;
+        }
+        if (value > 0) {
+            sizes.push_back(value);
+        }
+    }
+    return sizes;
+}
+
+void show_usage(const char* program) {
+    std::cerr << "Usage: " << program << " <codesnip_binary> [options]\n"
+              << "Options:\n"
+              << "  --templates N[,N...]     Library sizes in templates (default 1,1000,100000)\n"
+              << "  --target-size S[,S...]   Target file sizes, with K/M/G suffixes (default 1K,1M,64M)\n"
+              << "  --body-lines N           Average template body length in lines (default 12)\n"
+              << "  --iterations N           Timed runs per operation and cache state (default 20)\n"
+              << "  --work-dir DIR           Directory for generated corpora (default codesnip_bench_data)\n"
+              << "  --output FILE            Write the JSON report to FILE instead of stdout\n"
+              << "  --label TEXT             Label stored in the report, e.g. a commit hash\n"
+              << "  --seed N                 Seed for the corpus generator (default 42)\n"
+              << "  --generate-only          Only generate the corpora\n";
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        show_usage(argv[0]);
+        return 1;
+    }
+
+    BenchConfig config;
+    config.codesnip = argv[1];
+    for (int i = 2; i < argc; ++i) {
+        std::string option = argv[i];
+        bool has_value = i + 1 < argc;
+        if (option == "--templates" && has_value) {
+            config.template_counts = parse_sizes(argv[++i]);
+        } else if (option == "--target-size" && has_value) {
+            config.target_sizes = parse_sizes(argv[++i]);
+        } else if (option == "--body-lines" && has_value) {
+            config.body_lines = std::strtoull(argv[++i], nullptr, 10);
+        } else if (option == "--iterations" && has_value) {
+            config.iterations = std::max(1, std::atoi(argv[++i]));
+        } else if (option == "--work-dir" && has_value) {
+            config.work_dir = argv[++i];
+        } else if (option == "--output" && has_value) {
+            config.output = argv[++i];
+        } else if (option == "--label" && has_value) {
+            config.label = argv[++i];
+        } else if (option == "--seed" && has_value) {
+            config.seed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (option == "--generate-only") {
+            config.generate_only = true;
+        } else {
+            show_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!config.generate_only && access(config.codesnip.c_str(), X_OK) != 0) {
+        std::cerr << "Cannot execute codesnip binary: " << config.codesnip << std::endl;
+        return 1;
+    }
+    mkdir(config.work_dir.c_str(), 0755);
+
+    // Run every combination of library size and target size
+    std::vector<OperationResult> results;
+    for (uint64_t templates : config.template_counts) {
+        for (uint64_t target_size : config.target_sizes) {
+            std::cerr << templates << " templates, " << target_size << " byte target" << std::endl;
+            bench_configuration(config, templates, target_size, results);
+        }
+    }
+    if (config.generate_only) {
+        return 0;
+    }
+
+    std::ostringstream report;
+    report << "{\n  \"label\": " << json_string(config.label)
+           << ",\n  \"binary\": " << json_string(config.codesnip)
+           << ",\n  \"iterations\": " << config.iterations
+           << ",\n  \"seed\": " << config.seed
+           << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        report << "    " << result_json(results[i]) << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    report << "  ]\n}\n";
+
+    if (config.output.empty()) {
+        std::cout << report.str();
+    } else {
+        std::ofstream output(config.output, std::ios::trunc);
+        output << report.str();
+        if (!output) {
+            std::cerr << "Error writing report: " << config.output << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
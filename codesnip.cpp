@@ -1,437 +1,8314 @@
+#include "codesnip.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <regex>
+#include <set>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
-/**
- * @brief Overwrites a specific line in a target file with a given set of lines.
- *
- * Reads the target file into memory, pads it with empty lines if needed, and replaces the line at the
- * specified position with the given lines. The inserted lines are automatically indented to match the
- * indentation of the original line being replaced. The modified content is then written back to the file.
- *
- * @param target_file The path to the file to modify.
- * @param lines A vector of strings to insert into the file.
- * @param line_number The 1-based line number where the insertion should occur.
- * @param is_delete_or_rename If true, the function will overwrite the entire file with the provided lines,
- *                            effectively deleting the original content. If false, it will insert the lines
- *                            at the specified line number, preserving the rest of the file's content.
- */
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <glob.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
-void file_overwrite(std::string& target_file, std::vector<std::string>& lines, int line_number, 
-bool is_delete_or_rename = false) {
-    // Open the target file for reading
-    std::ifstream target_input(target_file);
-    std::vector<std::string> target_lines;
-    std::string line;
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/xattr.h>
+#endif
 
-    // Check if the file opened successfully
-    if (!target_input.is_open()) {
-        std::cerr << "Error opening target file: " << target_file << std::endl;
-        return;
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+using codesnip::InsertAnchor;
+using codesnip::SnippetStore;
+using codesnip::StoreResult;
+using codesnip::StoreStatus;
+using codesnip::StoredTemplate;
+using codesnip::TemplateVariables;
+
+// Everything but the SnippetStore implementation and main() has internal linkage, so a program that
+// links the library sees only the codesnip namespace
+namespace {
+
+// Without main(), the command entry points below go unused
+#ifdef CODESNIP_NO_MAIN
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+
+// Phases that --stats reports wall time for
+enum StatsPhase { PHASE_OPEN, PHASE_LOOKUP, PHASE_READ, PHASE_SPLICE, PHASE_WRITE, PHASE_FSYNC, PHASE_COUNT };
+
+const char* const PHASE_NAMES[PHASE_COUNT] = {"open", "lookup", "read", "splice", "write", "fsync"};
+
+// Counters collected for --stats; they are only updated while collection is enabled
+struct RunStats {
+    bool enabled = false;
+    std::string command;
+    std::string json_file;  // Report destination; stderr if empty
+    std::chrono::steady_clock::time_point start;
+    std::atomic<uint64_t> phase_ns[PHASE_COUNT] = {};
+    std::atomic<uint64_t> bytes_read{0};     // Bytes read with read() or streams
+    std::atomic<uint64_t> bytes_mapped{0};   // Bytes of files mapped into memory
+    std::atomic<uint64_t> bytes_written{0};
+    std::atomic<uint64_t> bytes_decompressed{0};   // Bytes of compressed pack blocks decoded
+    std::atomic<uint64_t> lines_scanned{0};
+};
+
+RunStats run_stats;
+
+// Every heap allocation made through operator new, counted whether or not --stats is enabled
+std::atomic<uint64_t> heap_allocations{0};
+
+// Adds to a --stats counter
+inline void stats_add(std::atomic<uint64_t>& counter, uint64_t amount) {
+    if (run_stats.enabled) {
+        counter.fetch_add(amount, std::memory_order_relaxed);
     }
+}
 
-    if (!is_delete_or_rename) {
-        // Read each line from the target file into a vector
-        while (std::getline(target_input, line)) {
-            target_lines.push_back(line);
-        }
-        target_input.close();
+/**
+ * @brief Attributes the wall time of a scope to a --stats phase.
+ *
+ * Timers nest per thread: while an inner timer runs, the enclosing one is paused, so each phase only
+ * counts its own time. Time spent on worker threads is summed across the threads.
+ */
 
-        // If the file is shorter than the desired line number, pad it with empty lines
-        while ((int)target_lines.size() < line_number) {
-            target_lines.push_back("");
+class PhaseTimer {
+public:
+    explicit PhaseTimer(StatsPhase phase) : phase_(phase) {
+        if (!run_stats.enabled) {
+            return;
         }
-
-        // Determine the indentation of the line to be overwritten
-        std::string indent = "";
-        if (!target_lines[line_number - 1].empty()) {
-            std::string& target_line = target_lines[line_number - 1];
-            for (int i = 0; i < (int)target_line.size(); ++i) {
-                if (target_line[i] == ' ' || target_line[i] == '\t') {
-                    indent += target_line[i];
-                } else {
-                    break;
-                }
-            }
+        start_ = std::chrono::steady_clock::now();
+        parent_ = current_;
+        if (parent_) {
+            parent_->pause(start_);
         }
+        current_ = this;
+    }
 
-        // Apply the same indentation to all new lines to maintain visual consistency
-        for (int i = 0; i < (int)lines.size(); ++i) {
-            lines[i] = indent + lines[i];
-        }
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
 
-        // Remove the original line and insert the new lines in its place
-        target_lines.erase(target_lines.begin() + (line_number - 1));
-        for (int i = 0; i < (int)lines.size(); ++i) {
-            target_lines.insert(target_lines.begin() + (line_number - 1 + i), lines[i]);
+    ~PhaseTimer() {
+        if (!run_stats.enabled || current_ != this) {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        pause(now);
+        current_ = parent_;
+        if (parent_) {
+            parent_->start_ = now;
         }
     }
 
-    else {
-        target_lines = lines;
+private:
+    void pause(std::chrono::steady_clock::time_point now) {
+        uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - start_).count();
+        run_stats.phase_ns[phase_].fetch_add(elapsed, std::memory_order_relaxed);
     }
 
-    // Open the target file again, this time for writing the updated content
-    std::ofstream target_output(target_file);
-    if (!target_output.is_open()) {
-        std::cerr << "Error writing to target file: " << target_file << std::endl;
+    StatsPhase phase_;
+    std::chrono::steady_clock::time_point start_;
+    PhaseTimer* parent_ = nullptr;
+    static thread_local PhaseTimer* current_;
+};
+
+thread_local PhaseTimer* PhaseTimer::current_ = nullptr;
+
+#ifndef CODESNIP_NO_MAIN
+// Writes the collected --stats to stderr or to the JSON file
+void report_stats() {
+    if (!run_stats.enabled) {
         return;
     }
+    double wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - run_stats.start).count();
 
-    // Write all modified lines back into the file
-    for (int i = 0; i < (int)target_lines.size(); ++i) {
-        target_output << target_lines[i] << '\n';
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    long peak_rss_kb = usage.ru_maxrss / 1024; // Reported in bytes on macOS
+#else
+    long peak_rss_kb = usage.ru_maxrss;
+#endif
+
+    std::ostringstream report;
+    if (run_stats.json_file.empty()) {
+        report << "codesnip stats for '" << run_stats.command << "':\n"
+               << "  wall time:          " << wall_ms << " ms\n";
+        for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+            std::string label = std::string(PHASE_NAMES[phase]) + ":";
+            label.resize(20, ' ');
+            report << "  " << label << run_stats.phase_ns[phase] / 1e6 << " ms\n";
+        }
+        report << "  bytes read:         " << run_stats.bytes_read << "\n"
+               << "  bytes mapped:       " << run_stats.bytes_mapped << "\n"
+               << "  bytes written:      " << run_stats.bytes_written << "\n"
+               << "  bytes decompressed: " << run_stats.bytes_decompressed << "\n"
+               << "  lines scanned:      " << run_stats.lines_scanned << "\n"
+               << "  heap allocations:   " << heap_allocations << "\n"
+               << "  peak RSS:           " << peak_rss_kb << " KB\n";
+        std::cerr << report.str();
+        return;
     }
 
-    target_output.close();
+    report << "{\"command\": \"" << run_stats.command << "\", \"wall_ms\": " << wall_ms << ", \"phases_ms\": {";
+    for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+        report << (phase ? ", " : "") << "\"" << PHASE_NAMES[phase] << "\": " << run_stats.phase_ns[phase] / 1e6;
+    }
+    report << "}, \"bytes_read\": " << run_stats.bytes_read
+           << ", \"bytes_mapped\": " << run_stats.bytes_mapped
+           << ", \"bytes_written\": " << run_stats.bytes_written
+           << ", \"bytes_decompressed\": " << run_stats.bytes_decompressed
+           << ", \"lines_scanned\": " << run_stats.lines_scanned
+           << ", \"heap_allocations\": " << heap_allocations
+           << ", \"peak_rss_kb\": " << peak_rss_kb << "}\n";
+
+    std::ofstream stats_output(run_stats.json_file, std::ios::trunc);
+    stats_output << report.str();
+    if (!stats_output) {
+        std::cerr << "Error writing stats file: " << run_stats.json_file << std::endl;
+    }
 }
 
 /**
- * @brief Inserts a named code snippet into a target file at a specified line number.
- *
- * This function reads a code snippet from the given snippet file using a defined template format,
- * then inserts the snippet into the target file at the specified line number. If the target file
- * has fewer lines than the insertion point, it is padded with empty lines. The inserted snippet
- * is automatically indented to match the target line's existing indentation.
- *
- * Snippets in the snippet file must be enclosed between:
- *   #-- name: <template_name>
- *   ... (snippet content) ...
- *   #-- end
+ * @brief Enables --stats collection; the report is written when the program exits.
  *
- * @param snippet_file The file path containing named code snippets.
- * @param target_file The file path to insert the snippet into.
- * @param template_name The name of the snippet template to insert.
- * @param line_number The line number in the target file to insert the snippet (1-based index).
- *
- * @note
- * - If the template is not found or contains no content, the function exits with an error message.
- * - If the target file doesn't exist or is empty, it will be created or padded accordingly.
- * - The original line at the insertion point is overwritten by the snippet.
+ * @param command The command being measured.
+ * @param destination "", "1" or "-" to report on stderr, otherwise the path of a JSON file to write.
  */
 
-void insert(std::string& snippet_file, std::string& target_file,
-std::string& template_name, int line_number) {
-    // Open the snippet file for reading
-    std::ifstream snippet_input(snippet_file);
-    if (!snippet_input.is_open()) {
-        std::cerr << "Error opening snippet file: " << snippet_file << std::endl;
-        return;
+void enable_stats(const std::string& command, const std::string& destination) {
+    run_stats.enabled = true;
+    run_stats.command = command;
+    run_stats.json_file = destination == "1" || destination == "-" ? "" : destination;
+    run_stats.start = std::chrono::steady_clock::now();
+    std::atexit(report_stats);
+}
+#endif
+
+// Size of the blocks used when streaming a file through a rewrite
+const size_t COPY_BLOCK_SIZE = 1 << 20;
+
+// Size of the input and output buffers of file_splice(), which bound its memory use
+const size_t STREAM_BUFFER_SIZE = 64 << 10;
+
+// Writes the whole buffer to a file descriptor, retrying on short writes
+bool write_all(int fd, const char* data, size_t size) {
+    PhaseTimer timer(PHASE_WRITE);
+    stats_add(run_stats.bytes_written, size);
+    while (size > 0) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0) {
+            return false;
+        }
+        data += written;
+        size -= (size_t)written;
     }
+    return true;
+}
 
-    std::vector<std::string> snippet_lines;
-    std::string line;
-    bool found = false;
+// Counts newlines one byte at a time
+size_t count_newlines_scalar(const char* data, size_t size) {
+    size_t count = 0;
+    for (size_t i = 0; i < size; ++i) {
+        count += data[i] == '\n';
+    }
+    return count;
+}
 
-    // Search for the template by name and extract its lines
-    while (std::getline(snippet_input, line)) {
-        if (line == "#-- name: " + template_name) {
-            found = true;
-            continue;
+#if defined(__x86_64__)
+// Counts newlines 16 bytes at a time; byte-wide match counters are summed every 255 blocks before they overflow
+size_t count_newlines_sse2(const char* data, size_t size) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+    while (size - i >= 16) {
+        __m128i matches = _mm_setzero_si128();
+        size_t run_end = i + std::min<size_t>((size - i) / 16, 255) * 16;
+        for (; i < run_end; i += 16) {
+            __m128i bytes = _mm_loadu_si128((const __m128i*)(data + i));
+            matches = _mm_sub_epi8(matches, _mm_cmpeq_epi8(bytes, newline));
         }
+        __m128i sums = _mm_sad_epu8(matches, _mm_setzero_si128());
+        count += _mm_cvtsi128_si64(sums) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+    }
+    return count + count_newlines_scalar(data + i, size - i);
+}
 
-        if (found) {
-            if (line == "#-- end") {
-                break;
-            }
-            snippet_lines.push_back(line);
+// Counts newlines 32 bytes at a time; only called when the CPU supports AVX2
+__attribute__((target("avx2"))) size_t count_newlines_avx2(const char* data, size_t size) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+    while (size - i >= 32) {
+        __m256i matches = _mm256_setzero_si256();
+        size_t run_end = i + std::min<size_t>((size - i) / 32, 255) * 32;
+        for (; i < run_end; i += 32) {
+            __m256i bytes = _mm256_loadu_si256((const __m256i*)(data + i));
+            matches = _mm256_sub_epi8(matches, _mm256_cmpeq_epi8(bytes, newline));
+        }
+        __m256i sums = _mm256_sad_epu8(matches, _mm256_setzero_si256());
+        count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+                 _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+    }
+    return count + count_newlines_scalar(data + i, size - i);
+}
+#elif defined(__aarch64__)
+// Counts newlines 16 bytes at a time with NEON, which every AArch64 CPU has
+size_t count_newlines_neon(const char* data, size_t size) {
+    const uint8x16_t newline = vdupq_n_u8('\n');
+    size_t count = 0;
+    size_t i = 0;
+    while (size - i >= 16) {
+        uint8x16_t matches = vdupq_n_u8(0);
+        size_t run_end = i + std::min<size_t>((size - i) / 16, 255) * 16;
+        for (; i < run_end; i += 16) {
+            matches = vsubq_u8(matches, vceqq_u8(vld1q_u8((const uint8_t*)(data + i)), newline));
         }
+        count += vaddlvq_u8(matches);
     }
+    return count + count_newlines_scalar(data + i, size - i);
+}
+#endif
 
-    snippet_input.close();
+using NewlineCounter = size_t (*)(const char*, size_t);
 
-    // If the template wasn't found or was empty, exit
-    if (!found) {
-        std::cerr << "Template '" << template_name << "' not found in snippet file." << std::endl;
-        return;
+/**
+ * @brief Picks the fastest newline counter the CPU supports.
+ *
+ * CODESNIP_SIMD may be set to "scalar", "sse2" or "avx2" to force a narrower implementation, for
+ * example to compare them; a choice the CPU does not support falls back to the best available one.
+ *
+ * @return The selected counter.
+ */
+
+NewlineCounter select_newline_counter() {
+    const char* forced = std::getenv("CODESNIP_SIMD");
+    std::string choice = forced ? forced : "";
+    if (choice == "scalar") {
+        return count_newlines_scalar;
     }
+#if defined(__x86_64__)
+    if (choice != "sse2" && __builtin_cpu_supports("avx2")) {
+        return count_newlines_avx2;
+    }
+    return count_newlines_sse2;
+#elif defined(__aarch64__)
+    return count_newlines_neon;
+#else
+    return count_newlines_scalar;
+#endif
+}
 
-    if (snippet_lines.empty()) {
-        std::cerr << "No lines found for template '" << template_name << "'." << std::endl;
-        return;
+// Counts the newlines in a buffer with the implementation chosen for this CPU
+size_t count_newlines(const char* data, size_t size) {
+    static const NewlineCounter counter = select_newline_counter();
+    return counter(data, size);
+}
+
+/**
+ * @brief Skips a number of lines in a buffer, counting newlines a chunk at a time.
+ *
+ * @param data Start of the buffer.
+ * @param size Size of the buffer.
+ * @param count Number of newlines to pass; reduced by the number actually passed.
+ * @return Pointer just past the count-th newline, or null if the buffer holds fewer.
+ */
+
+const char* skip_lines(const char* data, size_t size, uint64_t& count) {
+    const size_t chunk = 256;
+    const char* cursor = data;
+    const char* end = data + size;
+
+    // Skip whole chunks until the chunk holding the target newline
+    while (count > 0 && (size_t)(end - cursor) >= chunk) {
+        size_t found = count_newlines(cursor, chunk);
+        if (found >= count) {
+            break;
+        }
+        count -= found;
+        cursor += chunk;
     }
 
-    // Overwrite the target file with the snippet at the specified line
-    file_overwrite(target_file, snippet_lines, line_number);
-    
-    // Output a success message
-    std::cout << "Inserted snippet '" << template_name << "' into "
-              << target_file << " at line " << line_number << "." << std::endl;
+    // Find the remaining newlines one at a time
+    while (count > 0) {
+        const char* newline = (const char*)std::memchr(cursor, '\n', end - cursor);
+        if (!newline) {
+            return nullptr;
+        }
+        cursor = newline + 1;
+        count--;
+    }
+    return cursor;
 }
 
 /**
- * @brief Extracts a range of lines from a source file and saves them as a new named template
- *        in a snippet file, using a standard format with header and end markers.
+ * @brief Finds the first occurrence of a needle in a buffer.
  *
- * The function checks for errors such as missing files, invalid ranges, or duplicate template names.
- * It appends the extracted content to the end of the snippet file, formatted with `#-- name:` and `#-- end` markers.
+ * Candidate positions are found 16 at a time by comparing the needle's first and last bytes against
+ * two overlapping loads, and only those candidates are compared in full, so long runs of text that
+ * cannot match are passed at vector speed.
  *
- * @param source_file Path to the source file to extract lines from.
- * @param start_line First line of the range to extract (1-based index).
- * @param end_line Last line of the range to extract (inclusive).
- * @param new_template_name Name of the new snippet template.
- * @param snippet_file Path to the snippet file where the template will be stored.
+ * @param data Start of the buffer.
+ * @param size Size of the buffer.
+ * @param needle The bytes to find; must not be empty.
+ * @return Pointer to the first occurrence, or null if there is none.
  */
 
-void extract(std::string& source_file, int start_line,
-int end_line, std::string& new_template_name, std::string& snippet_file) {
-    int line_number = 0;
+const char* find_substring(const char* data, size_t size, std::string_view needle) {
+    const size_t length = needle.size();
+    if (length == 0 || length > size) {
+        return nullptr;
+    }
+    const size_t candidates = size - length + 1;
+    size_t i = 0;
 
-    // Opening and validating the source file for reading
-    std::ifstream source_input(source_file);
-    if (!source_input.is_open()) {
-        std::cerr << "Error opening source file: " << source_file << std::endl;
-        return;
+#if defined(__x86_64__)
+    const __m128i first = _mm_set1_epi8(needle.front());
+    const __m128i last = _mm_set1_epi8(needle.back());
+    for (; i + 16 <= candidates; i += 16) {
+        __m128i starts = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i)), first);
+        __m128i ends = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i + length - 1)), last);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(starts, ends));
+        while (mask != 0) {
+            size_t candidate = i + __builtin_ctz(mask);
+            if (std::memcmp(data + candidate, needle.data(), length) == 0) {
+                return data + candidate;
+            }
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__aarch64__)
+    const uint8x16_t first = vdupq_n_u8((uint8_t)needle.front());
+    const uint8x16_t last = vdupq_n_u8((uint8_t)needle.back());
+    for (; i + 16 <= candidates; i += 16) {
+        uint8x16_t starts = vceqq_u8(vld1q_u8((const uint8_t*)(data + i)), first);
+        uint8x16_t ends = vceqq_u8(vld1q_u8((const uint8_t*)(data + i + length - 1)), last);
+        // Narrow each byte of the match vector to four bits of a 64-bit mask
+        uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(vandq_u8(starts, ends)), 4);
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+        while (mask != 0) {
+            size_t candidate = i + __builtin_ctzll(mask) / 4;
+            if (std::memcmp(data + candidate, needle.data(), length) == 0) {
+                return data + candidate;
+            }
+            mask &= ~(0xfULL << (__builtin_ctzll(mask) & ~3));
+        }
     }
+#endif
 
-    std::vector<std::string> extracted_lines;
-    std::string line;
+    // Check the remaining candidates one first byte at a time
+    while (i < candidates) {
+        const char* start = (const char*)std::memchr(data + i, needle.front(), candidates - i);
+        if (!start) {
+            return nullptr;
+        }
+        if (std::memcmp(start, needle.data(), length) == 0) {
+            return start;
+        }
+        i = (size_t)(start - data) + 1;
+    }
+    return nullptr;
+}
+
+// Reads the size and modification time (in nanoseconds) of a file; returns false if it does not exist.
+// The time is mixed with the inode number: files are replaced by renaming a new one over them, and
+// the clock may not advance between two replacements, but the inode always changes.
+bool file_stamp(const std::string& path, uint64_t& size, int64_t& mtime_ns) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+
+    size = (uint64_t)st.st_size;
+#ifdef __APPLE__
+    mtime_ns = (int64_t)st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+    mtime_ns ^= (int64_t)((uint64_t)st.st_ino * 0x9E3779B97F4A7C15ULL);
+    return true;
+}
+
+// Where errors of the core operations are reported; a task splicing many files in parallel, or a
+// SnippetStore call that returns its errors, points its own thread elsewhere
+thread_local std::ostream* command_error_output = nullptr;
+
+// Returns the stream errors of the current thread go to, standard error by default
+std::ostream& command_errors() {
+    return command_error_output ? *command_error_output : std::cerr;
+}
+
+// Returns a path next to a file for writing a new version of it, unique to this process and call, so
+// concurrent writers never share a temporary file
+std::string temp_path(const std::string& path) {
+    static std::atomic<uint64_t> counter(0);
+    return path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(counter++);
+}
 
-    // Adding header line
-    extracted_lines.push_back("#-- name: " + new_template_name);
+// Resolves the symlinks in a path, so a new version of a file replaces the file a link points at rather
+// than the link; a path that cannot be resolved, such as one that does not exist yet, is returned as is
+std::string resolve_target(const std::string& path) {
+    char* resolved = realpath(path.c_str(), nullptr);
+    if (resolved == nullptr) {
+        return path;
+    }
+    std::string result(resolved);
+    std::free(resolved);
+    return result;
+}
 
-    // Adding lines within the specified range
-    while (std::getline(source_input, line)) {
-        line_number++;
-        if (line_number >= start_line && line_number <= end_line) {
-            extracted_lines.push_back(line);
+// Copies a finished temporary file over a target without replacing the target's inode, under an
+// exclusive lock so readers never map it half written; target_changed is set once the target has been
+// truncated, after which a failure leaves it incomplete
+bool copy_into_place(const std::string& temp_file, const std::string& target_file, bool durable,
+                     bool& target_changed) {
+    int input_fd = ::open(temp_file.c_str(), O_RDONLY);
+    if (input_fd < 0) {
+        return false;
+    }
+    int output_fd = ::open(target_file.c_str(), O_WRONLY | O_CLOEXEC);
+    if (output_fd >= 0) {
+        flock(output_fd, LOCK_EX);
+    }
+    bool ok = output_fd >= 0 && ftruncate(output_fd, 0) == 0;
+    target_changed = ok;
+    std::vector<char> buffer(COPY_BLOCK_SIZE);
+    while (ok) {
+        ssize_t got = ::read(input_fd, buffer.data(), buffer.size());
+        if (got <= 0) {
+            ok = got == 0;
+            break;
         }
+        ok = write_all(output_fd, buffer.data(), (size_t)got);
+    }
+    if (output_fd >= 0) {
+        flock(output_fd, LOCK_UN);
     }
 
-    // Add the end line to the extracted lines
-    extracted_lines.push_back("#-- end");
+    // Flush after unlocking, so readers do not wait for the disk
+    if (ok && durable) {
+        PhaseTimer timer(PHASE_FSYNC);
+        ok = fsync(output_fd) == 0;
+    }
+    if (output_fd >= 0 && ::close(output_fd) != 0) {
+        ok = false;
+    }
+    ::close(input_fd);
+    return ok;
+}
 
-    // Check if any lines were extracted
-    if (extracted_lines.size() == 2) { // Only the header and end lines
-        std::cerr << "No lines extracted from " << source_file
-                  << " for the specified range." << std::endl;
-        source_input.close();
-        return;
+/**
+ * @brief Moves a finished temporary file into place as the new version of a target file.
+ *
+ * The target is resolved first, so a symlink keeps pointing at the file it linked to, which receives
+ * the new contents; the temporary file must be in the resolved target's directory. It takes the
+ * target's owner, group and mode before it is renamed over the target. If the target has other hard
+ * links, carries an access control list, or its owner cannot be kept, the contents are instead copied
+ * into the target in place under an exclusive lock, which keeps every link and all metadata; readers
+ * that open the target then still see either version whole, but a mapping made before the copy sees
+ * it change, and a crash during the copy leaves the target incomplete. If the copy fails after the
+ * target was truncated, the temporary file is kept, since it is then the only complete copy, and its
+ * path is reported to command_errors().
+ *
+ * @param temp_file Path of the temporary file.
+ * @param temp_fd Open descriptor of the temporary file.
+ * @param target_file Path of the file to replace.
+ * @param durable Whether an in-place copy is flushed to disk before returning.
+ * @return True if the target holds the new contents. The temporary file is gone either way, unless it
+ *         was kept after a failed in-place copy.
+ */
+
+bool move_into_place(const std::string& temp_file, int temp_fd, const std::string& target_file, bool durable) {
+    std::string target = resolve_target(target_file);
+    struct stat target_st, temp_st;
+    bool in_place = false;
+    if (stat(target.c_str(), &target_st) == 0) {
+        if (fstat(temp_fd, &temp_st) != 0) {
+            std::remove(temp_file.c_str());
+            return false;
+        }
+        // Change the owner first: fchown() may clear the set-user-ID and set-group-ID bits
+        if ((temp_st.st_uid != target_st.st_uid || temp_st.st_gid != target_st.st_gid) &&
+            fchown(temp_fd, target_st.st_uid, target_st.st_gid) != 0) {
+            in_place = true;
+        }
+        if (!in_place && fchmod(temp_fd, target_st.st_mode & 07777) != 0) {
+            in_place = true;
+        }
+        in_place = in_place || target_st.st_nlink > 1;
+#ifdef __linux__
+        in_place = in_place || getxattr(target.c_str(), "system.posix_acl_access", nullptr, 0) > 0;
+#endif
     }
 
-    // If the number of extracted lines does not match the expected range, report an error
-    if ((int)extracted_lines.size() != (end_line - start_line + 3)) { // +3 for header and end lines
-        std::cerr << "Extracted lines do not match the specified range." << std::endl;
-        return;
+    if (!in_place) {
+        bool ok = std::rename(temp_file.c_str(), target.c_str()) == 0;
+        if (!ok) {
+            std::remove(temp_file.c_str());
+        }
+        return ok;
     }
 
-    source_input.close();
+    bool target_changed = false;
+    bool ok = copy_into_place(temp_file, target, durable, target_changed);
+    if (ok || !target_changed) {
+        std::remove(temp_file.c_str());
+    } else {
+        command_errors() << "Error rewriting " << target_file << " in place; its new contents are kept in "
+                         << temp_file << std::endl;
+    }
+    return ok;
+}
 
-    line_number = 0;
-    std::ifstream snippet_input(snippet_file);
-    if (!snippet_input.is_open()) {
-        std::cerr << "Error opening snippet file: " << snippet_file << std::endl;
-        return;
+// Flushes a complete temporary file to disk and moves it into place with move_into_place(); readers that
+// open the target see either the previous file or the whole new one, and so does the file system after
+// a crash unless the target had to be rewritten in place. The temporary file must come from
+// temp_path(resolve_target(target_file)) and is removed on failure, unless move_into_place() kept it
+bool replace_with_temp_file(const std::string& temp_file, const std::string& target_file) {
+    int fd = -1;
+    bool synced = false;
+    {
+        PhaseTimer timer(PHASE_FSYNC);
+        fd = ::open(temp_file.c_str(), O_RDONLY);
+        synced = fd >= 0 && fsync(fd) == 0;
     }
-    
-    // Check if the template already exists in the snippet file
-    while (std::getline(snippet_input, line)) {
-        line_number++;
-        if (line == "#-- name: " + new_template_name) {
-            std::cerr << "Template '" << new_template_name << "' already exists in snippet file." << std::endl;
-            snippet_input.close();
-            return;
-        }
+    bool ok = synced && move_into_place(temp_file, fd, target_file, true);
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    if (!synced) {
+        std::remove(temp_file.c_str());
     }
+    return ok;
+}
 
-    snippet_input.close();
+// On-disk layout of the line checkpoint file "<file>.lines": a header, then the byte offset at which
+// line k * interval + 1 starts, for k = 1 .. count
+static const char LINES_MAGIC[8] = {'C', 'S', 'L', 'I', 'N', '0', '0', '1'};
+const uint64_t LINE_CHECKPOINT_INTERVAL = 1 << 16;
 
-    // Write the extracted lines to the snippet file, starting at the end of the file
-    // +1 to account for first line being the header
-    // +2 to account for the header and end lines
-    file_overwrite(snippet_file, extracted_lines, 
-    (line_number == 0) ? line_number + 1 : line_number + 2);
+struct LineCheckpointHeader {
+    char magic[8];
+    uint64_t file_size;
+    int64_t mtime_ns;
+    uint64_t interval;
+    uint64_t count;
+};
 
-    // Output a success message
-    std::cout << "Extracted lines from " << source_file
-              << " and saved as template '" << new_template_name
-              << "' in snippet file " << snippet_file << "." << std::endl;
+// Whether files without a line checkpoint file should get one when they are read or rewritten
+bool line_checkpoints_enabled() {
+    const char* setting = std::getenv("CODESNIP_LINE_CHECKPOINTS");
+    return setting && *setting && std::strcmp(setting, "0") != 0;
 }
 
 /**
- * @brief Lists all template names stored in the given snippet file.
- *
- * Searches for lines starting with "#-- name: " and prints the name of each template.
- * If no templates are found, prints a message indicating so.
+ * @brief Collects line checkpoints while a file's content streams past, and saves them next to it.
  *
- * @param snippet_file Path to the snippet file to read from.
+ * Content is passed to add() in order, in chunks of any size; the checkpoints are found by counting
+ * newlines, so collecting them costs no more than one extra pass over data already in cache.
  */
 
- void list_templates(std::string& snippet_file) {
-    // Open the snippet file for reading
-    std::ifstream snippet_input(snippet_file);
-    if (!snippet_input.is_open()) {
-        std::cerr << "Error opening snippet file: " << snippet_file << std::endl;
-        return;
+class LineCheckpointBuilder {
+public:
+    // Accounts for the next chunk of the file
+    void add(const char* data, size_t size) {
+        const char* cursor = data;
+        const char* end = data + size;
+        while (cursor < end) {
+            uint64_t remaining = LINE_CHECKPOINT_INTERVAL - lines_;
+            uint64_t count = remaining;
+            const char* next = skip_lines(cursor, end - cursor, count);
+            if (!next) {
+                lines_ += remaining - count;
+                break;
+            }
+            offsets_.push_back(position_ + (uint64_t)(next - data));
+            lines_ = 0;
+            cursor = next;
+        }
+        position_ += size;
     }
 
-    std::string line;
-    bool found = false;
+    const std::vector<uint64_t>& offsets() const { return offsets_; }
 
-    // Read the file line by line
-    while (std::getline(snippet_input, line)) {
-        // Look for lines that define a template name
-        if (line.find("#-- name: ") == 0) {
-            found = true;
-            // Print just the template name (omit the "#-- name: " prefix)
-            std::cout << line.substr(10) << std::endl;
+    // Writes the checkpoints for the file at the given path, stamped with its current size and time
+    bool save(const std::string& path) const {
+        LineCheckpointHeader header;
+        std::memcpy(header.magic, LINES_MAGIC, sizeof(header.magic));
+        header.interval = LINE_CHECKPOINT_INTERVAL;
+        header.count = offsets_.size();
+        if (!file_stamp(path, header.file_size, header.mtime_ns) || header.file_size != position_) {
+            return false;
         }
-    }
 
-    // If no template markers were found, print a message
-    if (!found) {
-        std::cout << "No templates found in " << snippet_file << "." << std::endl;
+        std::string checkpoint_file = path + ".lines";
+        std::string temp_file = temp_path(checkpoint_file);
+        std::ofstream output(temp_file, std::ios::binary | std::ios::trunc);
+        if (!output.is_open()) {
+            return false;
+        }
+        output.write((const char*)&header, sizeof(header));
+        output.write((const char*)offsets_.data(), offsets_.size() * sizeof(uint64_t));
+        output.close();
+
+        if (!output || std::rename(temp_file.c_str(), checkpoint_file.c_str()) != 0) {
+            std::remove(temp_file.c_str());
+            return false;
+        }
+        return true;
     }
 
-    // Close the file
-    snippet_input.close();
-}
+private:
+    std::vector<uint64_t> offsets_;
+    uint64_t position_ = 0;
+    uint64_t lines_ = 0;
+};
+
+// Lines to splice into a file, keyed by the 1-based line number each group replaces
+using LineInsertions = std::map<int, std::vector<std::string>>;
 
 /**
- * @brief Displays the contents of a specific template from a snippet file.
+ * @brief Replaces several lines of a target file with groups of new lines in a single pass.
  *
- * Searches for the specified template name in the snippet file and prints its
- * entire content, including the `#-- name:` header and all lines up to (but not including)
- * the `#-- end` marker. If the template does not exist, an error message is shown.
+ * Streams the target file into a temporary file through fixed-size buffers: runs of lines without an
+ * insertion are located by counting newlines and copied through unchanged, and each line that has an
+ * insertion is replaced with its group of lines. Inserted lines are automatically indented to match
+ * the indentation of the original line being replaced; only that leading whitespace is kept, the rest
+ * of the line is skipped as it streams past. If the file is shorter than an insertion point, it is
+ * padded with empty lines. The temporary file is then renamed over the target, so memory use does not
+ * depend on the size of the target file or the length of its lines.
  *
- * @param template_name The name of the template to display.
- * @param snippet_file Path to the snippet file containing the templates.
+ * @param target_file The path to the file to modify.
+ * @param insertions Groups of lines keyed by the line number (in the unmodified file) they replace.
+ * @return True if the target file was rewritten.
  */
 
-void show(std::string& template_name, std::string& snippet_file) {
-    // Open the snippet file for reading
-    std::ifstream snippet_input(snippet_file);
-    if (!snippet_input.is_open()) {
-        std::cerr << "Error opening snippet file: " << snippet_file << std::endl;
-        return;
+bool file_splice(const std::string& target_file, const LineInsertions& insertions) {
+    PhaseTimer timer(PHASE_SPLICE);
+    if (!insertions.empty() && insertions.begin()->first < 1) {
+        command_errors() << "Invalid line number: " << insertions.begin()->first << std::endl;
+        return false;
     }
 
-    std::string line;
-    bool found = false;
+    // Open the target file for reading
+    int input_fd = ::open(target_file.c_str(), O_RDONLY);
+    if (input_fd < 0) {
+        command_errors() << "Error opening target file: " << target_file << std::endl;
+        return false;
+    }
 
-    // Search for the template by name and print its lines
-    while (std::getline(snippet_input, line)) {
-        if (line == "#-- name: " + template_name) {
-            found = true;
-            std::cout << line << std::endl; // Print the header line
-            continue;
+    // Open a temporary file next to the file the target resolves to, with the same permissions
+    struct stat st;
+    std::string temp_file = temp_path(resolve_target(target_file));
+    int output_fd = -1;
+    if (fstat(input_fd, &st) == 0) {
+        output_fd = ::open(temp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+    }
+    if (output_fd < 0) {
+        command_errors() << "Error writing to target file: " << target_file << std::endl;
+        ::close(input_fd);
+        return false;
+    }
+
+    std::vector<char> input(STREAM_BUFFER_SIZE);
+    std::vector<char> output(STREAM_BUFFER_SIZE);
+    size_t pending = 0;
+    std::string indent;
+    bool in_indent = true;
+    LineInsertions::const_iterator next = insertions.begin();
+    uint64_t current_line = 1;
+    char last_written = '\n';
+    bool ok = true;
+    enum { PREFIX, REPLACED, SUFFIX } phase = next == insertions.end() ? SUFFIX : PREFIX;
+
+    // Keep the line checkpoints of targets that have them, in output coordinates
+    LineCheckpointBuilder checkpoints;
+    bool track_checkpoints = line_checkpoints_enabled() || access((target_file + ".lines").c_str(), F_OK) == 0;
+
+    // Writes bytes to the temporary file, noting where checkpointed lines start
+    auto write_out = [&](const char* data, size_t size) {
+        if (track_checkpoints) {
+            checkpoints.add(data, size);
+        }
+        ok = ok && write_all(output_fd, data, size);
+    };
+
+    // Writes out the buffered output
+    auto flush = [&]() {
+        if (pending > 0) {
+            write_out(output.data(), pending);
+        }
+        pending = 0;
+    };
+
+    // Buffers bytes for the temporary file; runs larger than the buffer are written directly
+    auto emit = [&](const char* data, size_t size) {
+        if (size == 0) {
+            return;
+        }
+        last_written = data[size - 1];
+        if (pending + size > output.size()) {
+            flush();
+            if (size >= output.size()) {
+                write_out(data, size);
+                return;
+            }
+        }
+        std::memcpy(output.data() + pending, data, size);
+        pending += size;
+    };
+
+    // Buffers a run of empty lines without materializing them
+    auto emit_newlines = [&](uint64_t count) {
+        while (count > 0) {
+            if (pending == output.size()) {
+                flush();
+            }
+            size_t run = (size_t)std::min<uint64_t>(count, output.size() - pending);
+            std::memset(output.data() + pending, '\n', run);
+            pending += run;
+            count -= run;
+            last_written = '\n';
+        }
+    };
+
+    // Writes the next group of lines, indented like the line they replace, and moves to the following group
+    auto emit_insertion = [&]() {
+        for (const std::string& line : next->second) {
+            emit(indent.data(), indent.size());
+            emit(line.data(), line.size());
+            emit("\n", 1);
         }
+        indent.clear();
+        in_indent = true;
+        current_line++;
+        ++next;
+    };
 
-        if (found) {
-            if (line == "#-- end") {
-                break; // Stop reading when we reach the end marker
+    // Reads the next block of the target file
+    auto read_block = [&]() {
+        PhaseTimer read_timer(PHASE_READ);
+        ssize_t count = ::read(input_fd, input.data(), input.size());
+        stats_add(run_stats.bytes_read, count > 0 ? count : 0);
+        return count;
+    };
+
+    // Stream the target file block by block
+    ssize_t bytes_read = 0;
+    while (ok && (bytes_read = read_block()) > 0) {
+        const char* cursor = input.data();
+        const char* end = input.data() + bytes_read;
+
+        while (cursor < end) {
+            if (phase == SUFFIX) {
+                emit(cursor, end - cursor);
+                break;
+            }
+
+            if (phase == PREFIX) {
+                // Copy the lines before the next insertion point through in one run
+                uint64_t lines = (uint64_t)next->first - current_line;
+                if (lines == 0) {
+                    phase = REPLACED;
+                    continue;
+                }
+                uint64_t remaining = lines;
+                const char* stop = skip_lines(cursor, end - cursor, remaining);
+                const char* until = stop ? stop : end;
+                emit(cursor, until - cursor);
+                current_line += lines - remaining;
+                cursor = until;
+            } else {
+                // Keep the indentation of the line being replaced and skip the rest of it
+                if (in_indent) {
+                    const char* indent_end = cursor;
+                    while (indent_end < end && (*indent_end == ' ' || *indent_end == '\t')) {
+                        indent_end++;
+                    }
+                    indent.append(cursor, indent_end - cursor);
+                    in_indent = indent_end == end;
+                    cursor = indent_end;
+                    if (cursor == end) {
+                        break;
+                    }
+                }
+                const char* newline = (const char*)std::memchr(cursor, '\n', end - cursor);
+                if (!newline) {
+                    break;
+                }
+                cursor = newline + 1;
+                emit_insertion();
+                phase = next == insertions.end() ? SUFFIX : PREFIX;
             }
-            std::cout << line << std::endl; // Print the content of the template
         }
     }
+    if (bytes_read < 0) {
+        ok = false;
+    }
+    ::close(input_fd);
 
-    snippet_input.close();
+    // Handle a replaced last line without a newline, then insertion points past the end of the file
+    if (phase == REPLACED) {
+        emit_insertion();
+    }
+    if (next != insertions.end() && last_written != '\n') {
+        emit("\n", 1);
+        current_line++;
+    }
+    while (ok && next != insertions.end()) {
+        if ((uint64_t)next->first > current_line) {
+            emit_newlines(next->first - current_line);
+            current_line = next->first;
+        }
+        emit_insertion();
+    }
+    if (last_written != '\n') {
+        emit("\n", 1);
+    }
+    flush();
+    stats_add(run_stats.lines_scanned, current_line - 1);
 
-    // If the template wasn't found, print an error message
-    if (!found) {
-        std::cerr << "Template '" << template_name << "' not found in snippet file." << std::endl;
+    // Replace the target file with the rewritten copy
+    bool moved = ok && move_into_place(temp_file, output_fd, target_file, false);
+    if (::close(output_fd) != 0 || !moved) {
+        command_errors() << "Error writing to target file: " << target_file << std::endl;
+        if (!ok) {
+            std::remove(temp_file.c_str());
+        }
+        return false;
+    }
+    if (track_checkpoints) {
+        checkpoints.save(target_file);
     }
+    return true;
 }
 
 /**
- * @brief Deletes a specified template from a snippet file.
+ * @brief Overwrites a specific line in a target file with a given set of lines.
  *
- * Scans the snippet file for a template with the given name and removes its entire content,
- * including the `#-- name:` header and `#-- end` marker. All other lines are preserved.
- * If the template is not found, an error message is displayed. The file is then overwritten
- * with the remaining content.
+ * The inserted lines are indented to match the line they replace, and the file is padded with empty
+ * lines if it is shorter than the desired line number. See file_splice() for details.
+ *
+ * @param target_file The path to the file to modify.
+ * @param lines A vector of strings to insert into the file.
+ * @param line_number The 1-based line number where the insertion should occur.
+ * @return True if the target file was rewritten.
+ */
+
+bool file_overwrite(const std::string& target_file, const std::vector<std::string>& lines, int line_number) {
+    LineInsertions insertions;
+    insertions[line_number] = lines;
+    return file_splice(target_file, insertions);
+}
+
+/**
+ * @brief Read-only memory mapping of a whole file.
+ *
+ * The mapping is released when the object goes out of scope. An empty file is represented by a
+ * valid object with a null data pointer and a size of zero.
+ */
+
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    // Maps the file at the given path; returns false if it cannot be opened or mapped
+    bool open(const std::string& path) {
+        PhaseTimer timer(PHASE_OPEN);
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        // Hold a shared lock while sizing and mapping, so an append in progress is never mapped half done
+        flock(fd, LOCK_SH);
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+
+        size_ = (size_t)st.st_size;
+        if (size_ > 0) {
+            void* addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED) {
+                ::close(fd);
+                size_ = 0;
+                return false;
+            }
+            data_ = (const char*)addr;
+        }
+
+        // The mapping keeps the open file alive, so the lock must be released explicitly
+        flock(fd, LOCK_UN);
+        ::close(fd);
+        stats_add(run_stats.bytes_mapped, size_);
+        is_open_ = true;
+        return true;
+    }
+
+    void close() {
+        if (data_ != nullptr) {
+            munmap((void*)data_, size_);
+        }
+        data_ = nullptr;
+        size_ = 0;
+        is_open_ = false;
+        decoded_.clear();
+    }
+
+    bool is_open() const { return is_open_; }
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+    std::string_view view() const { return std::string_view(data_, size_); }
+
+    // Returns bytes decoded from the file under a key, such as a decompressed pack block, or nullptr
+    const std::string* decoded(uint64_t key) const {
+        auto found = decoded_.find(key);
+        return found != decoded_.end() ? &found->second : nullptr;
+    }
+
+    // Keeps decoded bytes under a key until the file is closed, so views into them stay valid as long
+    // as views into the mapping do
+    const std::string& keep_decoded(uint64_t key, std::string bytes) const {
+        return decoded_[key] = std::move(bytes);
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    bool is_open_ = false;
+    mutable std::unordered_map<uint64_t, std::string> decoded_;
+};
+
+const std::string NAME_PREFIX = "#-- name: ";
+const std::string END_MARKER = "#-- end";
+const std::string DELETE_PREFIX = "#-- delete: ";
+const std::string RENAME_PREFIX = "#-- rename: ";
+const std::string RENAME_TO_PREFIX = "#-- to: ";
+const std::string ALIAS_PREFIX = "#-- alias: ";
+const std::string ALIAS_BODY_PREFIX = "#-- body: ";
+
+// Computes a 64-bit FNV-1a hash, optionally continuing from a previous value
+uint64_t fnv1a(const char* data, size_t size, uint64_t hash = 1469598103934665603ULL) {
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Computes the 64-bit XXH64 hash (seed 0) of a template body; it consumes eight bytes per step, so long
+// bodies hash several times faster than with fnv1a()
+uint64_t hash_body(const char* data, size_t size) {
+    const uint64_t P1 = 11400714785074694791ULL, P2 = 14029467366897019727ULL, P3 = 1609587929392839161ULL;
+    const uint64_t P4 = 9650029242287828579ULL, P5 = 2870177450012600261ULL;
+    auto rotl = [](uint64_t value, int bits) { return (value << bits) | (value >> (64 - bits)); };
+    auto read64 = [](const char* p) { uint64_t value; std::memcpy(&value, p, sizeof(value)); return value; };
+    auto round = [&](uint64_t acc, uint64_t input) { return rotl(acc + input * P2, 31) * P1; };
+    auto merge = [&](uint64_t acc, uint64_t lane) { return (acc ^ round(0, lane)) * P1 + P4; };
+
+    // Four independent lanes over 32-byte stripes, then merged into one value
+    const char* p = data;
+    const char* end = data + size;
+    uint64_t hash;
+    if (size >= 32) {
+        uint64_t v1 = P1 + P2, v2 = P2, v3 = 0, v4 = 0 - P1;
+        do {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+            p += 32;
+        } while (end - p >= 32);
+        hash = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        hash = merge(merge(merge(merge(hash, v1), v2), v3), v4);
+    } else {
+        hash = P5;
+    }
+    hash += size;
+
+    // Fold in the tail, then mix the bits
+    for (; end - p >= 8; p += 8) {
+        hash = rotl(hash ^ round(0, read64(p)), 27) * P1 + P4;
+    }
+    if (end - p >= 4) {
+        uint32_t word;
+        std::memcpy(&word, p, sizeof(word));
+        hash = rotl(hash ^ (word * P1), 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        hash = rotl(hash ^ ((unsigned char)*p * P5), 11) * P1;
+    }
+    hash ^= hash >> 33;
+    hash *= P2;
+    hash ^= hash >> 29;
+    hash *= P3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Formats a body hash as the 16 hex digits used by alias records
+std::string body_hash_hex(uint64_t hash) {
+    char text[17];
+    std::snprintf(text, sizeof(text), "%016llx", (unsigned long long)hash);
+    return text;
+}
+
+// Returns the line starting at pos (without its newline) and advances pos past the newline
+std::string_view next_line(std::string_view data, size_t& pos) {
+    const char* start = data.data() + pos;
+    const char* newline = (const char*)std::memchr(start, '\n', data.size() - pos);
+    size_t length = newline ? (size_t)(newline - start) : data.size() - pos;
+    pos += length + (newline ? 1 : 0);
+    return std::string_view(start, length);
+}
+
+// Counts lines the way std::getline would: a final line without a newline still counts
+uint64_t count_lines(std::string_view data) {
+    PhaseTimer timer(PHASE_LOOKUP);
+    uint64_t count = count_newlines(data.data(), data.size());
+    if (!data.empty() && data.back() != '\n') {
+        count++;
+    }
+    stats_add(run_stats.lines_scanned, count);
+    return count;
+}
+
+// Copies the lines of a template body into a vector of strings
+std::vector<std::string> split_lines(std::string_view body) {
+    std::vector<std::string> lines;
+    size_t pos = 0;
+    while (pos < body.size()) {
+        lines.emplace_back(next_line(body, pos));
+    }
+    return lines;
+}
+
+// A template located inside a snippet file; all views point into the parsed buffer
+struct TemplateView {
+    std::string_view name;     // Template name, without the "#-- name: " prefix
+    std::string_view body;     // Body bytes, excluding the header and "#-- end" lines
+    size_t header_offset = 0;  // Byte offset of the "#-- name:" line
+    size_t end_offset = 0;     // Byte offset just past the "#-- end" line (or end of file)
+};
+
+// A delete or rename record appended to a snippet file by a log-structured delete or rename, or an
+// alias record that names a body stored earlier in the file
+struct LogRecord {
+    std::string_view name;        // Template the record applies to, or the name an alias defines
+    std::string_view new_name;    // New name of a rename; empty for a delete
+    bool is_rename = false;
+    bool is_alias = false;
+    uint64_t body_hash = 0;       // hash_body() of the body an alias refers to
+    size_t offset = 0;            // Byte offset of the record's first line
+    size_t end_offset = 0;        // Byte offset just past the record's last line
+    size_t templates_before = 0;  // Number of template blocks that precede the record
+};
+
+/**
+ * @brief Zero-copy parser that walks the `#-- name:` / `#-- end` blocks of a snippet buffer.
+ *
+ * Lines outside templates are skipped with memchr, and template bodies are skipped by searching
+ * for the end marker directly, so no per-line allocation takes place. A template without an end
+ * marker runs to the end of the buffer, and `#-- name:` lines inside a body belong to that body.
+ * Delete, rename and alias records between blocks are collected as they are passed; see SnippetLog.
+ */
+
+class SnippetParser {
+public:
+    explicit SnippetParser(std::string_view data) : data_(data) {}
+
+    // Advances to the next template; returns false when the buffer is exhausted
+    bool next(TemplateView& tmpl) {
+        uint64_t lines = 0;
+        while (pos_ < data_.size()) {
+            size_t line_start = pos_;
+            std::string_view line = next_line(data_, pos_);
+            lines++;
+            if (line.compare(0, NAME_PREFIX.size(), NAME_PREFIX) != 0) {
+                if (line.compare(0, 4, "#-- ") == 0) {
+                    collect_record(line, line_start);
+                }
+                continue;
+            }
+            stats_add(run_stats.lines_scanned, lines);
+            templates_++;
+
+            tmpl.name = line.substr(NAME_PREFIX.size());
+            tmpl.header_offset = line_start;
+            size_t body_start = pos_;
+            size_t body_end = find_end_marker(body_start);
+            tmpl.body = data_.substr(body_start, body_end - body_start);
+
+            pos_ = body_end;
+            if (pos_ < data_.size()) {
+                next_line(data_, pos_); // Consume the end marker
+            }
+            tmpl.end_offset = pos_;
+            return true;
+        }
+        stats_add(run_stats.lines_scanned, lines);
+        return false;
+    }
+
+    // Records passed so far, in file order
+    const std::vector<LogRecord>& records() const { return records_; }
+
+private:
+    // Recognizes a delete record, or a rename or alias record together with its second line
+    void collect_record(std::string_view line, size_t line_start) {
+        LogRecord record;
+        record.offset = line_start;
+        record.templates_before = templates_;
+        if (line.compare(0, DELETE_PREFIX.size(), DELETE_PREFIX) == 0) {
+            record.name = line.substr(DELETE_PREFIX.size());
+        } else if (line.compare(0, RENAME_PREFIX.size(), RENAME_PREFIX) == 0) {
+            size_t to_pos = pos_;
+            std::string_view to_line = next_line(data_, to_pos);
+            if (to_line.compare(0, RENAME_TO_PREFIX.size(), RENAME_TO_PREFIX) != 0) {
+                return;
+            }
+            record.name = line.substr(RENAME_PREFIX.size());
+            record.new_name = to_line.substr(RENAME_TO_PREFIX.size());
+            record.is_rename = true;
+            pos_ = to_pos;
+        } else if (line.compare(0, ALIAS_PREFIX.size(), ALIAS_PREFIX) == 0) {
+            size_t body_pos = pos_;
+            std::string_view body_line = next_line(data_, body_pos);
+            if (body_line.compare(0, ALIAS_BODY_PREFIX.size(), ALIAS_BODY_PREFIX) != 0) {
+                return;
+            }
+            std::string hex(body_line.substr(ALIAS_BODY_PREFIX.size()));
+            char* hex_end = nullptr;
+            record.body_hash = std::strtoull(hex.c_str(), &hex_end, 16);
+            if (hex.size() != 16 || *hex_end != '\0') {
+                return;
+            }
+            record.name = line.substr(ALIAS_PREFIX.size());
+            record.is_alias = true;
+            pos_ = body_pos;
+        } else {
+            return;
+        }
+        record.end_offset = pos_;
+        records_.push_back(record);
+    }
+
+    // Returns the offset of the next line that is exactly the end marker, or the buffer size
+    size_t find_end_marker(size_t from) const {
+        const char* base = data_.data();
+        while (from < data_.size()) {
+            const char* hit = (const char*)memmem(base + from, data_.size() - from,
+                                                  END_MARKER.data(), END_MARKER.size());
+            if (!hit) {
+                break;
+            }
+
+            size_t offset = hit - base;
+            size_t after = offset + END_MARKER.size();
+            bool at_line_start = offset == from || base[offset - 1] == '\n';
+            bool at_line_end = after == data_.size() || base[after] == '\n';
+            if (at_line_start && at_line_end) {
+                return offset;
+            }
+            from = offset + 1;
+        }
+        return data_.size();
+    }
+
+    std::string_view data_;
+    size_t pos_ = 0;
+    size_t templates_ = 0;
+    std::vector<LogRecord> records_;
+};
+
+// A template block of a snippet file, or an alias of one, together with its state after the file's
+// records are applied
+struct ResolvedTemplate {
+    TemplateView tmpl;      // The block as written; for an alias, its record's offsets and the block's body
+    std::string_view name;  // Current name, after any renames
+    bool live = true;       // False once a delete record has removed the block
+    bool is_alias = false;  // True if the entry comes from an alias record rather than a block
+    size_t record = 0;      // Index of an alias's record in SnippetLog::records()
+};
+
+/**
+ * @brief Parses a snippet buffer and applies its delete, rename and alias records.
+ *
+ * A log-structured delete or rename does not rewrite the file; it appends a record instead:
+ *   #-- delete: <name>
+ *   #-- rename: <old_name>
+ *   #-- to: <new_name>
+ * A record applies to every block above it that has the given name at that point, exactly like the
+ * rewriting commands, which act on every block with the name. Walking the records from the end of
+ * the file back to the start gives each block its final name in one pass. As usual, the first live
+ * block with a name is the one lookups resolve to.
+ *
+ * The deduplicating store adds a third record, which defines a name without storing its body again:
+ *   #-- alias: <name>
+ *   #-- body: <hash_body() of the body, 16 hex digits>
+ * An alias resolves to the first block above it whose body has that hash, whether or not the block is
+ * still live, and takes part in renames, deletes and name lookups like a block at the record's place.
+ * An alias without such a block is ignored.
+ */
+
+class SnippetLog {
+public:
+    explicit SnippetLog(std::string_view data) : data_(data) {
+        SnippetParser parser(data);
+        std::vector<ResolvedTemplate> blocks;
+        TemplateView tmpl;
+        while (parser.next(tmpl)) {
+            ResolvedTemplate resolved;
+            resolved.tmpl = tmpl;
+            resolved.name = tmpl.name;
+            blocks.push_back(resolved);
+        }
+        records_ = parser.records();
+        if (records_.empty()) {
+            templates_ = std::move(blocks);
+            return;
+        }
+
+        // Resolve each alias to the first block above it with the same body; bodies are only hashed
+        // as far down as the last alias
+        std::vector<size_t> alias_block(records_.size(), blocks.size());
+        std::unordered_map<uint64_t, size_t> first_block;
+        size_t hashed = 0;
+        for (size_t r = 0; r < records_.size(); ++r) {
+            if (!records_[r].is_alias) {
+                continue;
+            }
+            for (; hashed < records_[r].templates_before; ++hashed) {
+                std::string_view body = blocks[hashed].tmpl.body;
+                first_block.emplace(hash_body(body.data(), body.size()), hashed);
+            }
+            auto found = first_block.find(records_[r].body_hash);
+            if (found != first_block.end()) {
+                alias_block[r] = found->second;
+                has_aliases_ = true;
+            }
+        }
+
+        // Map each name to its final fate, applying the records from the last one backwards; an alias
+        // takes the fate its name has at its own position
+        std::unordered_map<std::string_view, std::pair<bool, std::string_view>> fate;
+        std::vector<std::pair<bool, std::string_view>> alias_fate(records_.size());
+        auto final_fate = [&](std::string_view name) {
+            auto found = fate.find(name);
+            return found != fate.end() ? found->second : std::make_pair(true, name);
+        };
+        auto apply_record = [&](size_t r) {
+            const LogRecord& applied = records_[r];
+            if (applied.is_alias) {
+                alias_fate[r] = final_fate(applied.name);
+            } else {
+                fate[applied.name] = applied.is_rename ? final_fate(applied.new_name)
+                                                       : std::make_pair(false, std::string_view());
+            }
+        };
+        size_t record = records_.size();
+        for (size_t i = blocks.size(); i-- > 0;) {
+            while (record > 0 && records_[record - 1].templates_before > i) {
+                apply_record(--record);
+            }
+            std::pair<bool, std::string_view> result = final_fate(blocks[i].tmpl.name);
+            blocks[i].live = result.first;
+            blocks[i].name = result.second;
+        }
+        while (record > 0) {
+            apply_record(--record);
+        }
+
+        // Merge the blocks and the resolved aliases in file order
+        size_t next_block = 0;
+        for (size_t r = 0; r < records_.size(); ++r) {
+            if (alias_block[r] == blocks.size()) {
+                continue;
+            }
+            for (; next_block < records_[r].templates_before; ++next_block) {
+                templates_.push_back(blocks[next_block]);
+            }
+            ResolvedTemplate alias;
+            alias.tmpl.name = records_[r].name;
+            alias.tmpl.body = blocks[alias_block[r]].tmpl.body;
+            alias.tmpl.header_offset = records_[r].offset;
+            alias.tmpl.end_offset = records_[r].end_offset;
+            alias.live = alias_fate[r].first;
+            alias.name = alias_fate[r].second;
+            alias.is_alias = true;
+            alias.record = r;
+            templates_.push_back(alias);
+        }
+        for (; next_block < blocks.size(); ++next_block) {
+            templates_.push_back(blocks[next_block]);
+        }
+
+        // Dead blocks and the records other than live aliases are space a compaction would reclaim
+        for (const ResolvedTemplate& resolved : templates_) {
+            bool dead_block = !resolved.is_alias && !resolved.live;
+            dead_bytes_ += dead_block ? resolved.tmpl.end_offset - resolved.tmpl.header_offset : 0;
+        }
+        for (size_t r = 0; r < records_.size(); ++r) {
+            bool live_alias = alias_block[r] != blocks.size() && alias_fate[r].first;
+            dead_bytes_ += live_alias ? 0 : records_[r].end_offset - records_[r].offset;
+        }
+    }
+
+    std::string_view data() const { return data_; }
+    const std::vector<ResolvedTemplate>& templates() const { return templates_; }
+    const std::vector<LogRecord>& records() const { return records_; }
+    uint64_t dead_bytes() const { return dead_bytes_; }
+    bool has_aliases() const { return has_aliases_; }
+
+private:
+    std::string_view data_;
+    std::vector<ResolvedTemplate> templates_;
+    std::vector<LogRecord> records_;
+    uint64_t dead_bytes_ = 0;
+    bool has_aliases_ = false;
+};
+
+/**
+ * @brief Appends a template block to snippet text, separated from earlier content by an empty line.
+ *
+ * @param content The snippet text to extend.
+ * @param template_name Name for the `#-- name:` header.
+ * @param body Template body; a missing final newline is added.
+ * @return Offset of the body within the content.
+ */
+
+size_t append_template_block(std::string& content, std::string_view template_name, std::string_view body) {
+    if (!content.empty()) {
+        if (content.back() != '\n') {
+            content += '\n';
+        }
+        content += '\n';
+    }
+    content += NAME_PREFIX;
+    content.append(template_name.data(), template_name.size());
+    content += '\n';
+
+    size_t body_offset = content.size();
+    content.append(body.data(), body.size());
+    if (!body.empty() && body.back() != '\n') {
+        content += '\n';
+    }
+    content += END_MARKER;
+    content += '\n';
+    return body_offset;
+}
+
+/**
+ * @brief Replaces a file with the concatenation of the given byte ranges.
+ *
+ * The content is written to a temporary file that is flushed to disk and then moved into place with
+ * move_into_place(), so the ranges may safely point into a mapping of the file being replaced, readers
+ * never see a partly written file, and a symlinked library keeps its link, owner and mode. A missing
+ * final newline is added so the result matches what line-by-line rewriting produced.
+ *
+ * @param target_file The path to the file to replace.
+ * @param pieces Byte ranges to write, in order.
+ * @return True if the file was replaced.
+ */
+
+bool write_file_pieces(const std::string& target_file, const std::vector<std::string_view>& pieces) {
+    PhaseTimer timer(PHASE_WRITE);
+    std::string temp_file = temp_path(resolve_target(target_file));
+    std::ofstream target_output(temp_file, std::ios::binary | std::ios::trunc);
+    if (!target_output.is_open()) {
+        return false;
+    }
+
+    char last = '\n';
+    for (const std::string_view& piece : pieces) {
+        if (!piece.empty()) {
+            target_output.write(piece.data(), piece.size());
+            stats_add(run_stats.bytes_written, piece.size());
+            last = piece.back();
+        }
+    }
+    if (last != '\n') {
+        target_output.put('\n');
+    }
+    target_output.close();
+
+    if (!target_output) {
+        std::remove(temp_file.c_str());
+        return false;
+    }
+    return replace_with_temp_file(temp_file, target_file);
+}
+
+/**
+ * @brief Takes the writer lock of a snippet file, waiting while another process or thread holds it.
+ *
+ * Every change to a snippet file is made under this lock, from reading the current content until the
+ * file and its indexes are updated, so concurrent writers never lose each other's changes. The lock is
+ * held on a separate file, "<snippet_file>.lock" next to the file the path resolves to, so every link to
+ * a library shares it, rather than on the snippet file itself: rewrites
+ * rename a new file over the old one, and readers only take a shared lock on the snippet file while
+ * mapping it, so readers never wait for a writer's rewrite. If the lock file is deleted while locked,
+ * it is reopened until the locked file is current. The lock is released when the descriptor is closed.
+ *
+ * @param snippet_file Path to the snippet file, which must exist and be writable.
+ * @return The locked descriptor, or -1 if the snippet file or its lock file cannot be opened.
+ */
+
+int lock_snippet_file(const std::string& snippet_file) {
+    if (access(snippet_file.c_str(), W_OK) != 0) {
+        return -1;
+    }
+
+    std::string lock_file = resolve_target(snippet_file) + ".lock";
+    while (true) {
+        int fd = ::open(lock_file.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return -1;
+        }
+        flock(fd, LOCK_EX);
+
+        struct stat locked, current;
+        if (fstat(fd, &locked) == 0 && stat(lock_file.c_str(), &current) == 0 &&
+            locked.st_dev == current.st_dev && locked.st_ino == current.st_ino) {
+            return fd;
+        }
+        ::close(fd);
+    }
+}
+
+/**
+ * @brief Appends text to a snippet file whose writer lock is held, then flushes it to disk.
+ *
+ * The write itself is made under an exclusive lock on the snippet file, which only waits for readers
+ * that are mapping it at that moment. On failure, the error is reported and the file is truncated to
+ * its previous size before readers can see the partial text.
+ *
+ * @param snippet_file Path to the snippet file.
+ * @param text The text to append.
+ * @param previous_size Size of the file before the append.
+ * @return True if the text was appended.
+ */
+
+bool append_to_snippet_file(const std::string& snippet_file, const std::string& text, uint64_t previous_size) {
+    int fd = ::open(snippet_file.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0) {
+        command_errors() << "Error writing to target file: " << snippet_file << std::endl;
+        return false;
+    }
+
+    flock(fd, LOCK_EX);
+    bool ok = write_all(fd, text.data(), text.size());
+    if (!ok) {
+        command_errors() << "Error writing to target file: " << snippet_file << std::endl;
+        if (ftruncate(fd, (off_t)previous_size) != 0) {
+            command_errors() << "Error restoring snippet file: " << snippet_file << std::endl;
+        }
+    }
+    flock(fd, LOCK_UN);
+
+    // Flush after unlocking, so readers do not wait for the disk
+    if (ok) {
+        PhaseTimer timer(PHASE_FSYNC);
+        ok = fsync(fd) == 0;
+        if (!ok) {
+            command_errors() << "Error writing to target file: " << snippet_file << std::endl;
+        }
+    }
+    ::close(fd);
+    return ok;
+}
+
+// Location and checksum of a single template body inside a snippet file
+struct IndexEntry {
+    uint64_t offset = 0;       // Byte offset of the first body line (just after the header line)
+    uint64_t length = 0;       // Body length in bytes, excluding the "#-- end" line
+    uint64_t line_count = 0;   // Number of body lines
+    uint64_t hash = 0;         // hash_body() of the body bytes
+};
+
+// On-disk layout of the sidecar index file "<snippet_file>.idx":
+//   IndexHeader, then slot_count slots of { name_hash, record_pos }, then slot_count slots of
+//   { body_hash, record_pos }, then the entry records.
+//   Each record is { offset, length, line_count, hash, name_length, name bytes } padded to 8 bytes.
+//   The slots form open-addressing hash tables; a record_pos of 0 marks an empty slot, and a
+//   record_pos of INDEX_DELETED_SLOT marks a slot whose template was deleted in place, or whose body
+//   was edited away. The body table holds the first record with each body hash, so the deduplicating
+//   store can find stored bodies.
+static const char INDEX_MAGIC[8] = {'C', 'S', 'I', 'D', 'X', '0', '0', '3'};
+const uint64_t INDEX_DELETED_SLOT = 1;
+
+struct IndexHeader {
+    char magic[8];
+    uint64_t file_size;
+    int64_t mtime_ns;
+    uint64_t entry_count;  // Slots in use, including deleted ones
+    uint64_t slot_count;
+    uint64_t dead_bytes;   // Bytes of dead blocks and delete/rename records in the snippet file
+    uint64_t alias_count;  // Entries that come from alias records
+};
+
+/**
+ * @brief Scans a snippet file and writes a fresh sidecar index for it.
+ *
+ * Every live `#-- name:` block and alias is recorded under its current name with the byte range of
+ * its body, its line count and a hash of its content. When a name appears more than once, only the first block
+ * is indexed, matching the lookup order of a plain scan. The index is written to a temporary file and renamed into place so
+ * that concurrent readers never observe a partial index.
+ *
+ * @param snippet_file Path to the snippet file to index.
+ * @return True if the index was written successfully.
+ */
+
+bool build_index(const std::string& snippet_file) {
+    uint64_t file_size = 0;
+    int64_t mtime_ns = 0;
+    if (!file_stamp(snippet_file, file_size, mtime_ns)) {
+        return false;
+    }
+
+    MappedFile snippets;
+    if (!snippets.open(snippet_file)) {
+        return false;
+    }
+
+    // Record every live template block and alias in file order
+    std::vector<std::pair<std::string_view, IndexEntry>> entries;
+    uint64_t alias_count = 0;
+    SnippetLog log(snippets.view());
+    for (const ResolvedTemplate& resolved : log.templates()) {
+        if (!resolved.live) {
+            continue;
+        }
+        const TemplateView& tmpl = resolved.tmpl;
+        IndexEntry entry;
+        entry.offset = tmpl.body.data() - snippets.data();
+        entry.length = tmpl.body.size();
+        entry.line_count = count_lines(tmpl.body);
+        entry.hash = hash_body(tmpl.body.data(), tmpl.body.size());
+        entries.emplace_back(resolved.name, entry);
+        alias_count += resolved.is_alias ? 1 : 0;
+    }
+
+    // Size the hash table at twice the entry count, rounded up to a power of two
+    uint64_t slot_count = 16;
+    while (slot_count < entries.size() * 2) {
+        slot_count *= 2;
+    }
+
+    std::vector<uint64_t> slots(slot_count * 2, 0);
+    std::vector<uint64_t> body_slots(slot_count * 2, 0);
+    std::string records;
+    uint64_t records_start = sizeof(IndexHeader) + slot_count * 4 * sizeof(uint64_t);
+    uint64_t entry_count = 0;
+
+    for (auto& named_entry : entries) {
+        std::string_view name = named_entry.first;
+        const IndexEntry& entry = named_entry.second;
+
+        // Linear probing; skip names that are already present so the first definition wins
+        uint64_t name_hash = fnv1a(name.data(), name.size());
+        uint64_t slot = name_hash & (slot_count - 1);
+        bool duplicate = false;
+        while (slots[slot * 2 + 1] != 0) {
+            if (slots[slot * 2] == name_hash) {
+                uint64_t pos = slots[slot * 2 + 1] - records_start;
+                uint32_t existing_length;
+                std::memcpy(&existing_length, records.data() + pos + 4 * sizeof(uint64_t), sizeof(uint32_t));
+                if (existing_length == name.size() &&
+                    records.compare(pos + 4 * sizeof(uint64_t) + sizeof(uint32_t), name.size(), name) == 0) {
+                    duplicate = true;
+                    break;
+                }
+            }
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        if (duplicate) {
+            continue;
+        }
+
+        slots[slot * 2] = name_hash;
+        slots[slot * 2 + 1] = records_start + records.size();
+
+        // Index the body too, unless an earlier record has the same one
+        uint64_t body_slot = entry.hash & (slot_count - 1);
+        while (body_slots[body_slot * 2 + 1] != 0 && body_slots[body_slot * 2] != entry.hash) {
+            body_slot = (body_slot + 1) & (slot_count - 1);
+        }
+        if (body_slots[body_slot * 2 + 1] == 0) {
+            body_slots[body_slot * 2] = entry.hash;
+            body_slots[body_slot * 2 + 1] = records_start + records.size();
+        }
+
+        uint32_t name_length = (uint32_t)name.size();
+        records.append((const char*)&entry, sizeof(IndexEntry));
+        records.append((const char*)&name_length, sizeof(uint32_t));
+        records.append(name.data(), name.size());
+        records.append((8 - records.size() % 8) % 8, '\0');
+        entry_count++;
+    }
+
+    IndexHeader header;
+    std::memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.file_size = file_size;
+    header.mtime_ns = mtime_ns;
+    header.entry_count = entry_count;
+    header.slot_count = slot_count;
+    header.dead_bytes = log.dead_bytes();
+    header.alias_count = alias_count;
+
+    // Write the index next to the snippet file, replacing any previous one atomically
+    std::string index_file = snippet_file + ".idx";
+    std::string temp_file = temp_path(index_file);
+    std::ofstream index_output(temp_file, std::ios::binary | std::ios::trunc);
+    if (!index_output.is_open()) {
+        return false;
+    }
+
+    index_output.write((const char*)&header, sizeof(header));
+    index_output.write((const char*)slots.data(), slots.size() * sizeof(uint64_t));
+    index_output.write((const char*)body_slots.data(), body_slots.size() * sizeof(uint64_t));
+    index_output.write(records.data(), records.size());
+    index_output.close();
+
+    if (!index_output || std::rename(temp_file.c_str(), index_file.c_str()) != 0) {
+        std::remove(temp_file.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Maps the sidecar index of a snippet file, rebuilding it first if it is missing or stale.
+ *
+ * An index is considered current when its recorded size and modification time match the snippet file.
+ *
+ * @param snippet_file Path to the snippet file.
+ * @param index Receives the mapping of the index file.
+ * @return True if a current index is mapped; false if none could be built (e.g. a read-only directory).
+ */
+
+bool open_index(const std::string& snippet_file, MappedFile& index) {
+    uint64_t file_size = 0;
+    int64_t mtime_ns = 0;
+    if (!file_stamp(snippet_file, file_size, mtime_ns)) {
+        return false;
+    }
+
+    std::string index_file = snippet_file + ".idx";
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (index.open(index_file) && index.size() >= sizeof(IndexHeader)) {
+            IndexHeader header;
+            std::memcpy(&header, index.data(), sizeof(header));
+            if (std::memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 &&
+                header.file_size == file_size && header.mtime_ns == mtime_ns &&
+                sizeof(IndexHeader) + header.slot_count * 4 * sizeof(uint64_t) <= index.size()) {
+                return true;
+            }
+        }
+
+        index.close();
+        if (attempt == 0 && !build_index(snippet_file)) {
+            return false;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Looks up a template by name in a mapped sidecar index.
+ *
+ * @param index Mapping returned by open_index().
+ * @param template_name The template name to find.
+ * @param entry Receives the location of the template body when found.
+ * @return True if the template is present in the index.
+ */
+
+bool index_find(const MappedFile& index, const std::string& template_name, IndexEntry& entry) {
+    IndexHeader header;
+    std::memcpy(&header, index.data(), sizeof(header));
+
+    uint64_t name_hash = fnv1a(template_name.data(), template_name.size());
+    uint64_t slot = name_hash & (header.slot_count - 1);
+    const char* slots = index.data() + sizeof(IndexHeader);
+
+    // Probe until an empty slot is reached
+    for (uint64_t probes = 0; probes < header.slot_count; ++probes) {
+        uint64_t slot_hash, record_pos;
+        std::memcpy(&slot_hash, slots + slot * 2 * sizeof(uint64_t), sizeof(uint64_t));
+        std::memcpy(&record_pos, slots + (slot * 2 + 1) * sizeof(uint64_t), sizeof(uint64_t));
+        if (record_pos == 0) {
+            return false;
+        }
+
+        if (slot_hash == name_hash && record_pos != INDEX_DELETED_SLOT && record_pos + sizeof(IndexEntry) + sizeof(uint32_t) <= index.size()) {
+            const char* record = index.data() + record_pos;
+            uint32_t name_length;
+            std::memcpy(&name_length, record + sizeof(IndexEntry), sizeof(uint32_t));
+            const char* name = record + sizeof(IndexEntry) + sizeof(uint32_t);
+            if (name_length == template_name.size() && name + name_length <= index.data() + index.size() &&
+                std::memcmp(name, template_name.data(), name_length) == 0) {
+                std::memcpy(&entry, record, sizeof(IndexEntry));
+                return true;
+            }
+        }
+        slot = (slot + 1) & (header.slot_count - 1);
+    }
+    return false;
+}
+
+/**
+ * @brief In-place update of a sidecar index after a snippet file was appended to.
+ *
+ * Appends, renames and log-structured deletes never move existing blocks, so the index can follow
+ * them without a rebuild: new records are appended to the index file, slots are relinked or marked
+ * deleted, and commit() stamps the header with the snippet file's new size and modification time
+ * last. If any step fails, or the update is abandoned, the old stamp stays in place and the next
+ * lookup rebuilds the index. Once the slot table is half full, no more names can be added, and the
+ * next lookup rebuilds the index with a table twice the size. The watch command also follows edits
+ * that move blocks: shift() moves the bodies after an edit, and the names of the edited blocks are
+ * relinked to their new records.
+ */
+
+class IndexUpdate {
+public:
+    IndexUpdate() = default;
+    IndexUpdate(const IndexUpdate&) = delete;
+    IndexUpdate& operator=(const IndexUpdate&) = delete;
+    ~IndexUpdate() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    // Opens the index of a snippet file; fails unless it describes the file at the given size and mtime
+    bool open(const std::string& snippet_file, uint64_t file_size, int64_t mtime_ns) {
+        fd_ = ::open((snippet_file + ".idx").c_str(), O_RDWR);
+        struct stat st;
+        ok_ = fd_ >= 0 && pread(fd_, &header_, sizeof(header_), 0) == (ssize_t)sizeof(header_) &&
+              fstat(fd_, &st) == 0 && std::memcmp(header_.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 &&
+              header_.file_size == file_size && header_.mtime_ns == mtime_ns && st.st_size % 8 == 0;
+        index_size_ = ok_ ? (uint64_t)st.st_size : 0;
+        return ok_;
+    }
+
+    // Looks up the entry of a name
+    bool find(const std::string& template_name, IndexEntry& entry) {
+        uint64_t slot;
+        uint64_t record_pos = probe(template_name, slot);
+        return record_pos != 0 && ok_ &&
+               pread(fd_, &entry, sizeof(entry), record_pos) == (ssize_t)sizeof(entry);
+    }
+
+    // Looks up the first entry recorded with a body hash
+    bool find_body(uint64_t body_hash, IndexEntry& entry) {
+        uint64_t slot = body_hash & (header_.slot_count - 1);
+        for (uint64_t probes = 0; ok_ && probes < header_.slot_count; ++probes) {
+            uint64_t slot_value[2];
+            if (pread(fd_, slot_value, sizeof(slot_value), body_slot_pos(slot)) != (ssize_t)sizeof(slot_value) ||
+                slot_value[1] == 0) {
+                return false;
+            }
+            if (slot_value[0] == body_hash) {
+                return slot_value[1] != INDEX_DELETED_SLOT &&
+                       pread(fd_, &entry, sizeof(entry), slot_value[1]) == (ssize_t)sizeof(entry);
+            }
+            slot = (slot + 1) & (header_.slot_count - 1);
+        }
+        return false;
+    }
+
+    // Points a name at a template body, adding the name if it is not in the index yet
+    void put(const std::string& template_name, const IndexEntry& entry) {
+        uint64_t slot;
+        bool present = probe(template_name, slot) != 0;
+        if (!present && (header_.entry_count + 1) * 2 > header_.slot_count) {
+            ok_ = false;
+        }
+        if (!ok_) {
+            return;
+        }
+
+        std::string record((const char*)&entry, sizeof(IndexEntry));
+        uint32_t name_length = (uint32_t)template_name.size();
+        record.append((const char*)&name_length, sizeof(uint32_t));
+        record += template_name;
+        record.append((8 - record.size() % 8) % 8, '\0');
+        uint64_t slot_value[2] = {fnv1a(template_name.data(), template_name.size()), index_size_};
+        ok_ = pwrite(fd_, record.data(), record.size(), index_size_) == (ssize_t)record.size() &&
+              write_slot(slot, slot_value) && put_body(entry.hash, index_size_);
+        index_size_ += record.size();
+        header_.entry_count += present ? 0 : 1;
+    }
+
+    // Removes a name from the index
+    void remove(const std::string& template_name) {
+        uint64_t slot;
+        if (probe(template_name, slot) != 0 && ok_) {
+            uint64_t slot_value[2] = {0, INDEX_DELETED_SLOT};
+            ok_ = write_slot(slot, slot_value);
+        }
+    }
+
+    // Forgets the stored body with a hash, so that extract --dedupe no longer refers to it
+    void remove_body(uint64_t body_hash) {
+        uint64_t slot = body_hash & (header_.slot_count - 1);
+        for (uint64_t probes = 0; ok_ && probes < header_.slot_count; ++probes) {
+            uint64_t slot_value[2];
+            if (pread(fd_, slot_value, sizeof(slot_value), body_slot_pos(slot)) != (ssize_t)sizeof(slot_value)) {
+                ok_ = false;
+                return;
+            }
+            if (slot_value[1] == 0) {
+                return;
+            }
+            if (slot_value[0] == body_hash) {
+                slot_value[1] = INDEX_DELETED_SLOT;
+                ok_ = pwrite(fd_, slot_value, sizeof(slot_value), body_slot_pos(slot)) == (ssize_t)sizeof(slot_value);
+                return;
+            }
+            slot = (slot + 1) & (header_.slot_count - 1);
+        }
+    }
+
+    // Moves every body at or after an offset of the snippet file by delta bytes, one block of records at a time
+    void shift(uint64_t from_offset, int64_t delta) {
+        const size_t record_head = sizeof(IndexEntry) + sizeof(uint32_t);
+        uint64_t pos = sizeof(IndexHeader) + header_.slot_count * 4 * sizeof(uint64_t);
+        std::string buffer;
+        while (ok_ && pos + record_head <= index_size_) {
+            size_t size = (size_t)std::min<uint64_t>(COPY_BLOCK_SIZE, index_size_ - pos);
+            buffer.resize(size);
+            if (pread(fd_, &buffer[0], size, pos) != (ssize_t)size) {
+                ok_ = false;
+                return;
+            }
+
+            // Patch the records whose entry starts in the block; the next block begins after the last of them
+            uint64_t used = 0;
+            while (used + record_head <= size) {
+                IndexEntry entry;
+                uint32_t name_length;
+                std::memcpy(&entry, buffer.data() + used, sizeof(entry));
+                std::memcpy(&name_length, buffer.data() + used + sizeof(IndexEntry), sizeof(name_length));
+                if (entry.offset >= from_offset) {
+                    entry.offset += delta;
+                    std::memcpy(&buffer[used], &entry, sizeof(entry));
+                }
+                uint64_t record_size = record_head + name_length;
+                used += record_size + (8 - record_size % 8) % 8;
+            }
+            size_t patched = (size_t)std::min<uint64_t>(used, size);
+            ok_ = pwrite(fd_, buffer.data(), patched, pos) == (ssize_t)patched;
+            pos += used;
+        }
+    }
+
+    // Counts bytes of the snippet file that a compaction would reclaim
+    void add_dead_bytes(uint64_t size) { header_.dead_bytes += size; }
+
+    uint64_t dead_bytes() const { return header_.dead_bytes; }
+
+    // Counts a name added by an alias record
+    void add_alias() { header_.alias_count++; }
+
+    uint64_t alias_count() const { return header_.alias_count; }
+
+    // Stamps the header with the snippet file's current size and mtime; returns true if the index is current
+    bool commit(const std::string& snippet_file) {
+        uint64_t file_size = 0;
+        int64_t mtime_ns = 0;
+        return commit(ok_ && file_stamp(snippet_file, file_size, mtime_ns), file_size, mtime_ns);
+    }
+
+    // Stamps the header with a given size and mtime of the snippet file
+    bool commit(bool stamped, uint64_t file_size, int64_t mtime_ns) {
+        header_.file_size = file_size;
+        header_.mtime_ns = mtime_ns;
+        ok_ = ok_ && stamped && pwrite(fd_, &header_, sizeof(header_), 0) == (ssize_t)sizeof(header_);
+        return ok_;
+    }
+
+private:
+    // Returns the record position of a name and its slot, or 0 and the slot where it would be added
+    uint64_t probe(const std::string& template_name, uint64_t& slot) {
+        uint64_t name_hash = fnv1a(template_name.data(), template_name.size());
+        slot = name_hash & (header_.slot_count - 1);
+        for (uint64_t probes = 0; ok_ && probes < header_.slot_count; ++probes) {
+            uint64_t slot_value[2];
+            off_t slot_pos = sizeof(IndexHeader) + slot * sizeof(slot_value);
+            if (pread(fd_, slot_value, sizeof(slot_value), slot_pos) != (ssize_t)sizeof(slot_value)) {
+                break;
+            }
+            if (slot_value[1] == 0) {
+                return 0;
+            }
+            if (slot_value[0] == name_hash && slot_value[1] != INDEX_DELETED_SLOT) {
+                uint32_t name_length = 0;
+                std::string name;
+                if (pread(fd_, &name_length, sizeof(name_length), slot_value[1] + sizeof(IndexEntry)) ==
+                    (ssize_t)sizeof(name_length) && name_length == template_name.size()) {
+                    name.resize(name_length);
+                    if (pread(fd_, &name[0], name_length, slot_value[1] + sizeof(IndexEntry) + sizeof(uint32_t)) ==
+                        (ssize_t)name_length && name == template_name) {
+                        return slot_value[1];
+                    }
+                }
+            }
+            slot = (slot + 1) & (header_.slot_count - 1);
+        }
+        ok_ = false;
+        return 0;
+    }
+
+    bool write_slot(uint64_t slot, const uint64_t value[2]) {
+        off_t slot_pos = sizeof(IndexHeader) + slot * 2 * sizeof(uint64_t);
+        return pwrite(fd_, value, 2 * sizeof(uint64_t), slot_pos) == (ssize_t)(2 * sizeof(uint64_t));
+    }
+
+    off_t body_slot_pos(uint64_t slot) const {
+        return sizeof(IndexHeader) + (header_.slot_count + slot) * 2 * sizeof(uint64_t);
+    }
+
+    // Records a body hash for the record at record_pos, unless the body table already has it
+    bool put_body(uint64_t body_hash, uint64_t record_pos) {
+        uint64_t slot = body_hash & (header_.slot_count - 1);
+        for (uint64_t probes = 0; probes < header_.slot_count; ++probes) {
+            uint64_t slot_value[2];
+            if (pread(fd_, slot_value, sizeof(slot_value), body_slot_pos(slot)) != (ssize_t)sizeof(slot_value)) {
+                return false;
+            }
+            if (slot_value[1] == 0 || (slot_value[0] == body_hash && slot_value[1] == INDEX_DELETED_SLOT)) {
+                slot_value[0] = body_hash;
+                slot_value[1] = record_pos;
+                return pwrite(fd_, slot_value, sizeof(slot_value), body_slot_pos(slot)) == (ssize_t)sizeof(slot_value);
+            }
+            if (slot_value[0] == body_hash) {
+                return true;
+            }
+            slot = (slot + 1) & (header_.slot_count - 1);
+        }
+        return false;
+    }
+
+    int fd_ = -1;
+    bool ok_ = false;
+    IndexHeader header_{};
+    uint64_t index_size_ = 0;
+};
+
+// Minimum match length and hash table size of the block codec
+const size_t CODEC_MIN_MATCH = 4;
+const int CODEC_HASH_BITS = 14;
+
+// Appends the length of a token field beyond 15 as bytes of 255 followed by the remainder
+static void codec_put_length(std::string& output, size_t length) {
+    for (; length >= 255; length -= 255) {
+        output += (char)255;
+    }
+    output += (char)length;
+}
+
+/**
+ * @brief Compresses a block of up to 64 KiB with a small LZ77 codec.
+ *
+ * The output is a sequence of commands. Each command starts with a token byte: its high nibble is a
+ * literal count and its low nibble a match length minus 4. A nibble of 15 is followed by extra length
+ * bytes, which continue while they are 255. Then come the literal bytes and a 16-bit little-endian
+ * distance back to the match. The last command holds only literals. Matches are found through a hash
+ * table of the 4-byte sequences seen so far.
+ *
+ * @param data Bytes to compress.
+ * @param size Number of bytes, at most 65536.
+ * @param output Receives the compressed bytes, appended.
+ */
+
+void compress_block(const char* data, size_t size, std::string& output) {
+    std::vector<int32_t> table((size_t)1 << CODEC_HASH_BITS, -1);
+    size_t anchor = 0, pos = 0;
+    while (pos + CODEC_MIN_MATCH <= size) {
+        uint32_t sequence;
+        std::memcpy(&sequence, data + pos, sizeof(sequence));
+        uint32_t slot = (sequence * 2654435761u) >> (32 - CODEC_HASH_BITS);
+        int32_t candidate = table[slot];
+        table[slot] = (int32_t)pos;
+        if (candidate < 0 || pos - candidate > 65535 || std::memcmp(data + candidate, data + pos, CODEC_MIN_MATCH) != 0) {
+            ++pos;
+            continue;
+        }
+
+        size_t length = CODEC_MIN_MATCH;
+        while (pos + length < size && data[candidate + length] == data[pos + length]) {
+            ++length;
+        }
+        size_t literals = pos - anchor, extra = length - CODEC_MIN_MATCH;
+        output += (char)((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(extra, 15));
+        if (literals >= 15) {
+            codec_put_length(output, literals - 15);
+        }
+        output.append(data + anchor, literals);
+        size_t distance = pos - candidate;
+        output += (char)(distance & 0xff);
+        output += (char)(distance >> 8);
+        if (extra >= 15) {
+            codec_put_length(output, extra - 15);
+        }
+        pos += length;
+        anchor = pos;
+    }
+
+    size_t literals = size - anchor;
+    output += (char)(std::min<size_t>(literals, 15) << 4);
+    if (literals >= 15) {
+        codec_put_length(output, literals - 15);
+    }
+    output.append(data + anchor, literals);
+}
+
+/**
+ * @brief Decompresses a block written by compress_block.
+ *
+ * Every length and distance is checked, so corrupt input fails instead of reading or writing out of
+ * bounds.
+ *
+ * @param data Compressed bytes.
+ * @param size Number of compressed bytes.
+ * @param output Buffer of raw_size bytes that receives the block.
+ * @param raw_size Size of the block before compression.
+ * @return True if the input decoded to exactly raw_size bytes.
+ */
+
+bool decompress_block(const char* data, size_t size, char* output, size_t raw_size) {
+    size_t in = 0, out = 0;
+    auto read_length = [&](size_t& length) {
+        unsigned char byte;
+        do {
+            if (in >= size) {
+                return false;
+            }
+            byte = (unsigned char)data[in++];
+            length += byte;
+        } while (byte == 255);
+        return true;
+    };
+
+    while (in < size) {
+        unsigned char token = (unsigned char)data[in++];
+        size_t literals = token >> 4;
+        if ((literals == 15 && !read_length(literals)) || literals > size - in || literals > raw_size - out) {
+            return false;
+        }
+        std::memcpy(output + out, data + in, literals);
+        in += literals;
+        out += literals;
+        if (in == size) {
+            break;
+        }
+
+        if (size - in < 2) {
+            return false;
+        }
+        size_t distance = (unsigned char)data[in] | ((size_t)(unsigned char)data[in + 1] << 8);
+        in += 2;
+        size_t length = token & 15;
+        if (length == 15 && !read_length(length)) {
+            return false;
+        }
+        length += CODEC_MIN_MATCH;
+        if (distance == 0 || distance > out || length > raw_size - out) {
+            return false;
+        }
+        // A match closer than its length repeats the bytes it is producing, so copy those one at a time
+        if (distance >= length) {
+            std::memcpy(output + out, output + out - distance, length);
+            out += length;
+        } else {
+            for (size_t i = 0; i < length; ++i, ++out) {
+                output[out] = output[out - distance];
+            }
+        }
+    }
+    return out == raw_size;
+}
+
+// Layout of a compiled snippet pack:
+//   PackHeader, template_count PackRecords sorted by name, template_count 32-bit record numbers in
+//   source order, the name bytes, the body bytes of every template back to back, and line_count
+//   64-bit offsets (into the body bytes) of the start of every body line.
+//
+// A compressed pack has the same header, records, order table and names, so listing it reads no body
+// data. The body bytes are cut into PACK_BLOCK_SIZE blocks that are compressed independently; a
+// PackBlock for each block follows the names, then the compressed blocks. There is no line offset
+// table: line_count is 0 and the records' first_line is unused.
+static const char PACK_MAGIC[8] = {'C', 'S', 'P', 'A', 'C', 'K', '0', '1'};
+static const char COMPRESSED_PACK_MAGIC[8] = {'C', 'S', 'P', 'A', 'C', 'K', 'Z', '1'};
+const uint64_t PACK_BLOCK_SIZE = 65536;
+
+struct PackHeader {
+    char magic[8];
+    uint64_t file_size;
+    uint64_t template_count;
+    uint64_t names_size;
+    uint64_t bodies_size;
+    uint64_t line_count;
+};
+
+struct PackRecord {
+    uint64_t name_offset;
+    uint64_t body_offset;
+    uint64_t body_length;
+    uint64_t first_line;   // Index of the template's first entry in the line offset table
+    uint64_t line_count;
+    uint64_t hash;         // FNV-1a hash of the body bytes
+    uint32_t name_length;
+    uint32_t reserved;
+};
+
+struct PackBlock {
+    uint64_t offset;        // Start of the compressed bytes, from the start of the file
+    uint32_t stored_size;   // Equal to raw_size when the block did not compress and is stored as is
+    uint32_t raw_size;
+};
+
+// Returns true if a buffer starts with the snippet pack magic
+bool is_snippet_pack(std::string_view data) {
+    return data.size() >= sizeof(PACK_MAGIC) && (std::memcmp(data.data(), PACK_MAGIC, sizeof(PACK_MAGIC)) == 0 ||
+           std::memcmp(data.data(), COMPRESSED_PACK_MAGIC, sizeof(COMPRESSED_PACK_MAGIC)) == 0);
+}
+
+/**
+ * @brief Read-only view of a compiled snippet pack inside a mapping.
+ *
+ * Opening a pack only validates its header and section sizes, so it takes constant time however many
+ * templates the pack holds. Individual records are bounds-checked as they are read, and template
+ * bodies are checked against their stored hash before use.
+ *
+ * In a compressed pack, reading a body decompresses only the blocks it overlaps. Decoded blocks are
+ * kept by the MappedFile, so body views live as long as the mapping, as they do for a plain pack.
+ */
+
+class SnippetPack {
+public:
+    bool open(const MappedFile& file) {
+        std::string_view data = file.view();
+        if (!is_snippet_pack(data) || data.size() < sizeof(PackHeader)) {
+            return false;
+        }
+        std::memcpy(&header_, data.data(), sizeof(header_));
+        compressed_ = std::memcmp(header_.magic, COMPRESSED_PACK_MAGIC, sizeof(COMPRESSED_PACK_MAGIC)) == 0;
+
+        // Every section must fit exactly inside the file
+        uint64_t count = header_.template_count;
+        uint64_t limit = data.size();
+        if (header_.file_size != limit || count > limit || header_.names_size > limit || header_.line_count > limit) {
+            return false;
+        }
+        records_ = sizeof(PackHeader);
+        order_ = records_ + count * sizeof(PackRecord);
+        names_ = order_ + count * sizeof(uint32_t);
+        bodies_ = names_ + header_.names_size;
+        if (compressed_) {
+            uint64_t block_count = header_.bodies_size / PACK_BLOCK_SIZE + (header_.bodies_size % PACK_BLOCK_SIZE != 0);
+            if (header_.line_count != 0 || block_count > limit / sizeof(PackBlock) ||
+                bodies_ + block_count * sizeof(PackBlock) > limit) {
+                return false;
+            }
+        } else {
+            lines_ = bodies_ + header_.bodies_size;
+            if (header_.bodies_size > limit || lines_ + header_.line_count * sizeof(uint64_t) != limit) {
+                return false;
+            }
+        }
+
+        data_ = data;
+        file_ = &file;
+        return true;
+    }
+
+    size_t size() const { return header_.template_count; }
+
+    // Returns the record at a position in name order; false if it is malformed
+    bool record(size_t position, PackRecord& result) const {
+        std::memcpy(&result, data_.data() + records_ + position * sizeof(PackRecord), sizeof(result));
+        return result.name_offset + result.name_length <= header_.names_size &&
+               result.body_offset + result.body_length <= header_.bodies_size &&
+               (compressed_ || result.first_line + result.line_count <= header_.line_count);
+    }
+
+    // Returns the position in name order of the template at a position in source order
+    size_t ordered(size_t position) const {
+        uint32_t result;
+        std::memcpy(&result, data_.data() + order_ + position * sizeof(uint32_t), sizeof(result));
+        return result < header_.template_count ? result : 0;
+    }
+
+    std::string_view name(const PackRecord& record) const {
+        return data_.substr(names_ + record.name_offset, record.name_length);
+    }
+
+    // Returns the body of a template; empty if a compressed block it overlaps is corrupt
+    std::string_view body(const PackRecord& record) const {
+        if (compressed_) {
+            return decompressed(record.body_offset, record.body_length);
+        }
+        return data_.substr(bodies_ + record.body_offset, record.body_length);
+    }
+
+    // Checks a body against the hash stored for it
+    bool verify(const PackRecord& record) const {
+        std::string_view content = body(record);
+        return fnv1a(content.data(), content.size()) == record.hash;
+    }
+
+    // Copies the lines of a template using the precomputed line offsets
+    std::vector<std::string> lines(const PackRecord& record) const {
+        if (compressed_) {
+            return split_lines(body(record));
+        }
+        std::vector<std::string> result;
+        result.reserve(record.line_count);
+        std::string_view content = body(record);
+        for (uint64_t i = 0; i < record.line_count; ++i) {
+            uint64_t start = line_offset(record.first_line + i) - record.body_offset;
+            uint64_t end = i + 1 < record.line_count ? line_offset(record.first_line + i + 1) - record.body_offset
+                                                     : content.size();
+            if (start > end || end > content.size()) {
+                break;
+            }
+            std::string_view line = content.substr(start, end - start);
+            if (!line.empty() && line.back() == '\n') {
+                line.remove_suffix(1);
+            }
+            result.emplace_back(line);
+        }
+        return result;
+    }
+
+    // Finds a template by binary search over the sorted name table
+    bool find(std::string_view template_name, PackRecord& result) const {
+        size_t low = 0, high = size();
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (!record(middle, result)) {
+                return false;
+            }
+            int order = name(result).compare(template_name);
+            if (order < 0) {
+                low = middle + 1;
+            } else if (order > 0) {
+                high = middle;
+            } else {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    uint64_t line_offset(uint64_t line) const {
+        uint64_t result;
+        std::memcpy(&result, data_.data() + lines_ + line * sizeof(uint64_t), sizeof(result));
+        return result;
+    }
+
+    // Returns a decompressed block of a compressed pack, decoding it on first use; nullptr if corrupt
+    const std::string* block(uint64_t number) const {
+        if (const std::string* decoded = file_->decoded(number)) {
+            return decoded;
+        }
+        PackBlock entry;
+        std::memcpy(&entry, data_.data() + bodies_ + number * sizeof(PackBlock), sizeof(entry));
+        uint64_t expected = std::min(PACK_BLOCK_SIZE, header_.bodies_size - number * PACK_BLOCK_SIZE);
+        if (entry.raw_size != expected || entry.stored_size > entry.raw_size || entry.offset > data_.size() ||
+            entry.stored_size > data_.size() - entry.offset) {
+            return nullptr;
+        }
+
+        PhaseTimer timer(PHASE_READ);
+        std::string bytes(entry.raw_size, '\0');
+        const char* stored = data_.data() + entry.offset;
+        if (entry.stored_size == entry.raw_size) {
+            std::memcpy(&bytes[0], stored, entry.raw_size);
+        } else if (!decompress_block(stored, entry.stored_size, &bytes[0], entry.raw_size)) {
+            return nullptr;
+        }
+        stats_add(run_stats.bytes_decompressed, entry.raw_size);
+        return &file_->keep_decoded(number, std::move(bytes));
+    }
+
+    // Returns a range of the body bytes of a compressed pack, decompressing only the blocks it overlaps
+    std::string_view decompressed(uint64_t offset, uint64_t length) const {
+        if (length == 0) {
+            return data_.substr(0, 0);
+        }
+        uint64_t first = offset / PACK_BLOCK_SIZE, last = (offset + length - 1) / PACK_BLOCK_SIZE;
+        if (first == last) {
+            const std::string* decoded = block(first);
+            if (decoded == nullptr) {
+                return data_.substr(0, 0);
+            }
+            return std::string_view(*decoded).substr(offset - first * PACK_BLOCK_SIZE, length);
+        }
+
+        // A body that spans blocks is joined once and kept under its offset, with the top bit set so the
+        // key cannot clash with a block number
+        uint64_t key = (1ULL << 63) | offset;
+        const std::string* joined = file_->decoded(key);
+        if (joined == nullptr) {
+            std::string bytes;
+            bytes.reserve(length);
+            for (uint64_t number = first; number <= last; ++number) {
+                const std::string* decoded = block(number);
+                if (decoded == nullptr) {
+                    return data_.substr(0, 0);
+                }
+                size_t start = number == first ? offset - first * PACK_BLOCK_SIZE : 0;
+                bytes.append(*decoded, start, length - bytes.size());
+            }
+            joined = &file_->keep_decoded(key, std::move(bytes));
+        }
+        return *joined;
+    }
+
+    std::string_view data_;
+    const MappedFile* file_ = nullptr;
+    PackHeader header_;
+    bool compressed_ = false;
+    size_t records_ = 0, order_ = 0, names_ = 0, bodies_ = 0, lines_ = 0;
+};
+
+/**
+ * @brief Finds a template in a mapped snippet file or snippet pack.
+ *
+ * A compiled pack is searched through its own name table. For text files, the sidecar index is consulted
+ * first and the body it points at is checked against the stored hash, so an edit that slipped past the
+ * size/mtime check is detected rather than returning wrong lines. If the index cannot be used, the
+ * mapping is parsed from the start instead.
+ *
+ * @param snippet_file Path to the snippet file, used to locate its index.
+ * @param snippets Mapping of the snippet file.
+ * @param template_name The template to find.
+ * @param body Receives a view of the template body inside the mapping.
+ * @return True if the template exists.
+ */
+
+bool find_template(const std::string& snippet_file, const MappedFile& snippets,
+const std::string& template_name, std::string_view& body) {
+    PhaseTimer timer(PHASE_LOOKUP);
+
+    // Compiled packs carry their own sorted name table
+    SnippetPack pack;
+    if (pack.open(snippets)) {
+        PackRecord record;
+        if (!pack.find(template_name, record)) {
+            return false;
+        }
+        if (!pack.verify(record)) {
+            command_errors() << "Template '" << template_name << "' is corrupt in snippet pack " << snippet_file << "." << std::endl;
+            return false;
+        }
+        body = pack.body(record);
+        return true;
+    }
+
+    MappedFile index;
+    if (open_index(snippet_file, index)) {
+        IndexEntry entry;
+        if (!index_find(index, template_name, entry)) {
+            return false;
+        }
+        if (entry.offset + entry.length <= snippets.size()) {
+            body = snippets.view().substr(entry.offset, entry.length);
+            if (hash_body(body.data(), body.size()) == entry.hash) {
+                return true;
+            }
+        }
+    }
+
+    // Fall back to parsing the snippet file
+    SnippetLog log(snippets.view());
+    for (const ResolvedTemplate& resolved : log.templates()) {
+        if (resolved.live && resolved.name == template_name) {
+            body = resolved.tmpl.body;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Appends the pieces of a full template block with the given name and body, such as an alias's
+// body stored in the alias's place
+void push_block_pieces(std::vector<std::string_view>& pieces, std::deque<std::string>& headers,
+std::string_view name, std::string_view body) {
+    headers.push_back(NAME_PREFIX + std::string(name) + '\n');
+    pieces.push_back(headers.back());
+    pieces.push_back(body);
+    headers.push_back(!body.empty() && body.back() != '\n' ? "\n" + END_MARKER + '\n' : END_MARKER + '\n');
+    pieces.push_back(headers.back());
+}
+
+/**
+ * @brief Collects the byte ranges of a snippet buffer with its records applied and, optionally, one
+ *        template deleted or renamed.
+ *
+ * Blocks removed by delete records and the records themselves are dropped, and blocks renamed by
+ * records get a rewritten header line, so the result holds no records other than live aliases. Every
+ * block or alias currently named template_name is then dropped, or given new_header if one is passed.
+ * An alias whose body is no longer stored above it becomes a full block holding that body.
+ *
+ * @param log The parsed snippet buffer.
+ * @param template_name The template to delete or rename, or null to only apply the records.
+ * @param new_header Replacement header line for a rename, without a newline; empty to delete.
+ * @param headers Storage for rewritten header lines; must outlive the returned views.
+ * @return Views that make up the rewritten content, in order.
+ */
+
+std::vector<std::string_view> rewrite_pieces(const SnippetLog& log, const std::string_view* template_name,
+std::string_view new_header, std::deque<std::string>& headers) {
+    PhaseTimer timer(PHASE_LOOKUP);
+    std::string_view data = log.data();
+    std::vector<std::string_view> pieces;
+    size_t kept_from = 0;
+
+    // Replaces the bytes from kept_from up to a cut, keeping what precedes it
+    auto cut = [&](size_t from, size_t to, std::string_view replacement) {
+        pieces.push_back(data.substr(kept_from, from - kept_from));
+        if (!replacement.empty()) {
+            pieces.push_back(replacement);
+        }
+        kept_from = to;
+    };
+
+    // Bodies of the blocks kept so far, which later aliases can still refer to
+    std::set<uint64_t> stored_bodies;
+    auto keep_body = [&](std::string_view body) {
+        if (log.has_aliases()) {
+            stored_bodies.insert(hash_body(body.data(), body.size()));
+        }
+    };
+
+    // Walk the blocks and records together in file order
+    const std::vector<ResolvedTemplate>& templates = log.templates();
+    const std::vector<LogRecord>& records = log.records();
+    size_t record = 0;
+    for (const ResolvedTemplate& resolved : templates) {
+        const TemplateView& tmpl = resolved.tmpl;
+        for (; record < records.size() && records[record].offset < tmpl.header_offset; ++record) {
+            cut(records[record].offset, records[record].end_offset, std::string_view());
+        }
+
+        size_t name_end = tmpl.name.data() + tmpl.name.size() - data.data();
+        bool selected = template_name != nullptr && resolved.name == *template_name;
+        if (!resolved.live || (selected && new_header.empty())) {
+            cut(tmpl.header_offset, tmpl.end_offset, std::string_view());
+        } else if (resolved.is_alias) {
+            // Keep the alias while its body is still stored above it; otherwise store the body in its place
+            std::string_view name = selected ? new_header.substr(NAME_PREFIX.size()) : resolved.name;
+            if (stored_bodies.count(records[resolved.record].body_hash)) {
+                if (name.data() != tmpl.name.data()) {
+                    headers.push_back(ALIAS_PREFIX + std::string(name));
+                    cut(tmpl.header_offset, name_end, headers.back());
+                }
+            } else {
+                cut(tmpl.header_offset, tmpl.end_offset, std::string_view());
+                push_block_pieces(pieces, headers, name, tmpl.body);
+                keep_body(tmpl.body);
+            }
+        } else {
+            if (selected) {
+                cut(tmpl.header_offset, name_end, new_header);
+            } else if (resolved.name.data() != tmpl.name.data()) {
+                headers.push_back(NAME_PREFIX + std::string(resolved.name));
+                cut(tmpl.header_offset, name_end, headers.back());
+            }
+            keep_body(tmpl.body);
+        }
+        if (resolved.is_alias) {
+            record++; // The alias's own record has been handled
+        }
+    }
+    for (; record < records.size(); ++record) {
+        cut(records[record].offset, records[record].end_offset, std::string_view());
+    }
+    pieces.push_back(data.substr(kept_from));
+    return pieces;
+}
+
+/**
+ * @brief Collects the byte ranges of a snippet buffer that remain after deleting a template.
+ *
+ * Every block with the given name is dropped, including its header and end marker lines, and any
+ * delete and rename records are applied; see rewrite_pieces().
+ *
+ * @param log The parsed snippet buffer.
+ * @param template_name The template to delete.
+ * @param headers Storage for rewritten header lines; must outlive the returned views.
+ * @return Views into the buffer that make up the remaining content, in order.
+ */
+
+std::vector<std::string_view> delete_pieces(const SnippetLog& log, std::string_view template_name,
+std::deque<std::string>& headers) {
+    return rewrite_pieces(log, &template_name, std::string_view(), headers);
+}
+
+/**
+ * @brief Collects the byte ranges of a snippet buffer with a template's header lines replaced.
+ *
+ * @param log The parsed snippet buffer.
+ * @param old_template_name The template to rename.
+ * @param new_header The replacement header line, without a newline; must outlive the returned views.
+ * @param headers Storage for rewritten header lines; must outlive the returned views.
+ * @return Views that make up the renamed content, in order.
+ */
+
+std::vector<std::string_view> rename_pieces(const SnippetLog& log, std::string_view old_template_name,
+std::string_view new_header, std::deque<std::string>& headers) {
+    return rewrite_pieces(log, &old_template_name, new_header, headers);
+}
+
+// Share of a snippet file that dead blocks and records may take up before a log-structured delete
+// or rename compacts it automatically
+const double AUTO_COMPACT_DEAD_RATIO = 0.5;
+
+/**
+ * @brief Rewrites a snippet file without its delete and rename records and the blocks they removed.
+ *
+ * The content is streamed from the mapping into a temporary file that is renamed over the snippet
+ * file, and the sidecar index is rebuilt. The caller should hold the lock from lock_snippet_file().
+ *
+ * @param snippet_file Path to the snippet file.
+ * @param log The parsed content of the snippet file.
+ * @return True if the file was rewritten.
+ */
+
+bool compact_snippet_file(const std::string& snippet_file, const SnippetLog& log) {
+    std::deque<std::string> headers;
+    if (!write_file_pieces(snippet_file, rewrite_pieces(log, nullptr, std::string_view(), headers))) {
+        command_errors() << "Error writing to target file: " << snippet_file << std::endl;
+        return false;
+    }
+    build_index(snippet_file);
+    return true;
+}
+
+/**
+ * @brief Loads the line checkpoints of a file, if it has a checkpoint file that is still current.
+ *
+ * @param path Path to the file.
+ * @param file_size Current size of the file.
+ * @param offsets Receives the byte offset of line k * LINE_CHECKPOINT_INTERVAL + 1 at index k - 1.
+ * @return False if there is no checkpoint file or it does not match the file's size and modification time.
+ */
+
+bool load_line_checkpoints(const std::string& path, uint64_t file_size, std::vector<uint64_t>& offsets) {
+    uint64_t stamp_size = 0;
+    int64_t mtime_ns = 0;
+    MappedFile checkpoints;
+    if (!file_stamp(path, stamp_size, mtime_ns) || stamp_size != file_size || !checkpoints.open(path + ".lines") ||
+        checkpoints.size() < sizeof(LineCheckpointHeader)) {
+        return false;
+    }
+
+    LineCheckpointHeader header;
+    std::memcpy(&header, checkpoints.data(), sizeof(header));
+    if (std::memcmp(header.magic, LINES_MAGIC, sizeof(header.magic)) != 0 || header.file_size != file_size ||
+        header.mtime_ns != mtime_ns || header.interval != LINE_CHECKPOINT_INTERVAL ||
+        header.count != (checkpoints.size() - sizeof(header)) / sizeof(uint64_t)) {
+        return false;
+    }
+
+    offsets.resize(header.count);
+    std::memcpy(offsets.data(), checkpoints.data() + sizeof(header), header.count * sizeof(uint64_t));
+    return true;
+}
+
+/**
+ * @brief Reads an inclusive range of lines from a source file.
+ *
+ * The file is mapped and the start of the range is found by counting newlines. If the file has a
+ * current line checkpoint file, counting starts from the nearest checkpoint instead of the top of the
+ * file; with CODESNIP_LINE_CHECKPOINTS set, a missing or stale checkpoint file is rebuilt first.
+ *
+ * @param source_file Path to the file to read.
+ * @param start_line First line of the range (1-based index).
+ * @param end_line Last line of the range (inclusive).
+ * @param lines Receives the lines of the range; must be empty on entry.
+ * @return False, after printing an error, if the file cannot be opened or does not cover the range.
+ */
+
+bool read_line_range(const std::string& source_file, int start_line, int end_line, std::vector<std::string>& lines) {
+    PhaseTimer timer(PHASE_READ);
+
+    // Mapping and validating the source file for reading
+    MappedFile source;
+    if (!source.open(source_file)) {
+        command_errors() << "Error opening source file: " << source_file << std::endl;
+        return false;
+    }
+    std::string_view data = source.view();
+
+    // Starting from the nearest line checkpoint before the range, if there is one
+    std::vector<uint64_t> checkpoints;
+    if (!load_line_checkpoints(source_file, data.size(), checkpoints) && line_checkpoints_enabled()) {
+        LineCheckpointBuilder builder;
+        builder.add(data.data(), data.size());
+        builder.save(source_file);
+        checkpoints = builder.offsets();
+    }
+    uint64_t skip = (uint64_t)std::max(start_line, 1) - 1;
+    size_t pos = 0;
+    size_t checkpoint = (size_t)std::min<uint64_t>(skip / LINE_CHECKPOINT_INTERVAL, checkpoints.size());
+    if (checkpoint > 0 && checkpoints[checkpoint - 1] <= data.size()) {
+        pos = checkpoints[checkpoint - 1];
+        skip -= checkpoint * LINE_CHECKPOINT_INTERVAL;
+    }
+
+    // Counting newlines up to the first line of the range
+    const char* first = data.empty() ? nullptr : skip_lines(data.data() + pos, data.size() - pos, skip);
+    uint64_t line_number = (uint64_t)std::max(start_line, 1) - 1;
+
+    // Adding lines within the specified range; nothing after the range is read
+    if (first) {
+        pos = first - data.data();
+        while ((int64_t)line_number < end_line && pos < data.size()) {
+            size_t line_start = pos;
+            lines.emplace_back(next_line(data, pos));
+            line_number++;
+            stats_add(run_stats.bytes_read, pos - line_start);
+        }
+    }
+    stats_add(run_stats.lines_scanned, line_number);
+
+    // Check if any lines were extracted
+    if (lines.empty()) {
+        command_errors() << "No lines extracted from " << source_file
+                  << " for the specified range." << std::endl;
+        return false;
+    }
+
+    // If the number of extracted lines does not match the expected range, report an error
+    if ((int)lines.size() != (end_line - start_line + 1)) {
+        command_errors() << "Extracted lines do not match the specified range." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Fixed-size thread pool that runs a set of independent tasks with work stealing.
+ *
+ * Tasks are dealt round-robin into one queue per worker. A worker takes tasks from the back of its own
+ * queue and, once that is empty, steals from the front of the other queues, so a few slow tasks (such
+ * as one very large file) do not leave the remaining workers idle.
+ */
+
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(size_t thread_count = std::thread::hardware_concurrency())
+        : thread_count_(thread_count == 0 ? 1 : thread_count) {}
+
+    // Runs task(0) .. task(task_count - 1) and waits for all of them to finish
+    void run(size_t task_count, const std::function<void(size_t)>& task) {
+        size_t workers = std::min(thread_count_, task_count);
+        if (workers <= 1) {
+            for (size_t i = 0; i < task_count; ++i) {
+                task(i);
+            }
+            return;
+        }
+
+        std::vector<WorkQueue> queues(workers);
+        for (size_t i = 0; i < task_count; ++i) {
+            queues[i % workers].tasks.push_back(i);
+        }
+
+        std::vector<std::thread> threads;
+        for (size_t worker = 0; worker < workers; ++worker) {
+            threads.emplace_back([&queues, &task, worker]() {
+                size_t id;
+                while (take(queues, worker, id)) {
+                    task(id);
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+private:
+    struct WorkQueue {
+        std::mutex lock;
+        std::deque<size_t> tasks;
+    };
+
+    // Takes the next task for a worker, stealing from the other queues when its own is empty
+    static bool take(std::vector<WorkQueue>& queues, size_t worker, size_t& id) {
+        {
+            std::lock_guard<std::mutex> guard(queues[worker].lock);
+            if (!queues[worker].tasks.empty()) {
+                id = queues[worker].tasks.back();
+                queues[worker].tasks.pop_back();
+                return true;
+            }
+        }
+
+        for (size_t offset = 1; offset < queues.size(); ++offset) {
+            WorkQueue& victim = queues[(worker + offset) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                id = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t thread_count_;
+};
+
+// Returns true if a snippet source names a directory or a glob pattern rather than a single file
+bool is_snippet_collection(const std::string& snippet_source) {
+    struct stat st;
+    if (stat(snippet_source.c_str(), &st) == 0) {
+        return S_ISDIR(st.st_mode);
+    }
+    return snippet_source.find_first_of("*?[") != std::string::npos;
+}
+
+/**
+ * @brief Expands a directory or glob pattern into the snippet files it covers.
+ *
+ * A directory contributes every `.txt` file below it. The result is sorted by path, which is also the
+ * precedence order when the same template name is defined in more than one file.
+ *
+ * @param snippet_source Directory path or glob pattern.
+ * @param snippet_files Receives the matching files.
+ * @return False if the source matches no files.
+ */
+
+bool expand_snippet_source(const std::string& snippet_source, std::vector<std::string>& snippet_files) {
+    std::error_code error;
+    if (std::filesystem::is_directory(snippet_source, error)) {
+        for (std::filesystem::recursive_directory_iterator it(snippet_source, error), end; !error && it != end;
+             it.increment(error)) {
+            if (it->is_regular_file(error) && it->path().extension() == ".txt") {
+                snippet_files.push_back(it->path().string());
+            }
+        }
+    } else {
+        glob_t matches;
+        if (glob(snippet_source.c_str(), 0, nullptr, &matches) == 0) {
+            for (size_t i = 0; i < matches.gl_pathc; ++i) {
+                if (!std::filesystem::is_directory(matches.gl_pathv[i], error)) {
+                    snippet_files.push_back(matches.gl_pathv[i]);
+                }
+            }
+        }
+        globfree(&matches);
+    }
+
+    std::sort(snippet_files.begin(), snippet_files.end());
+    return !snippet_files.empty();
+}
+
+/**
+ * @brief Finds a template across every file of a snippet directory or glob.
+ *
+ * Each file is searched as an independent task on a work-stealing pool. When several files define the
+ * name, the one that sorts first wins, regardless of which task finishes first.
+ *
+ * @param snippet_source Directory path or glob pattern.
+ * @param template_name The template to find.
+ * @param body Receives a copy of the template body.
+ * @return False, after printing an error, if the source is empty or no file defines the template.
+ */
+
+bool find_in_collection(const std::string& snippet_source, const std::string& template_name, std::string& body) {
+    std::vector<std::string> snippet_files;
+    if (!expand_snippet_source(snippet_source, snippet_files)) {
+        std::cerr << "No snippet files found for: " << snippet_source << std::endl;
+        return false;
+    }
+
+    std::vector<std::string> bodies(snippet_files.size());
+    std::vector<char> found(snippet_files.size(), 0);
+    WorkStealingPool pool;
+    pool.run(snippet_files.size(), [&](size_t i) {
+        MappedFile snippets;
+        std::string_view view;
+        if (snippets.open(snippet_files[i]) && find_template(snippet_files[i], snippets, template_name, view)) {
+            bodies[i].assign(view.data(), view.size());
+            found[i] = 1;
+        }
+    });
+
+    for (size_t i = 0; i < snippet_files.size(); ++i) {
+        if (found[i]) {
+            body.swap(bodies[i]);
+            return true;
+        }
+    }
+    std::cerr << "Template '" << template_name << "' not found in snippet file." << std::endl;
+    return false;
+}
+
+// One template block recorded in the search index
+struct SearchEntry {
+    uint64_t header_offset = 0;  // Byte offset of the "#-- name:" line
+    uint64_t body_offset = 0;    // Byte offset of the body
+    uint64_t body_length = 0;    // Body length in bytes
+    bool live = true;            // False once the block has been deleted from the snippet file
+    bool visible = true;         // True if this is the first live block with its name
+    std::string name;
+};
+
+// In-memory form of the sidecar trigram index "<snippet_file>.tri"
+struct SearchIndex {
+    std::vector<SearchEntry> entries;                              // Every block, in file order; ids are positions
+    std::unordered_map<uint32_t, std::vector<uint32_t>> postings;  // Trigram -> ascending entry ids
+};
+
+// On-disk layout of "<snippet_file>.tri":
+//   SearchHeader, entry_count SearchRecords, the name bytes, trigram_count TrigramSlots sorted by
+//   trigram, then the posting lists as arrays of 32-bit entry ids. The layout is searched in place
+//   through a mapping; it is only loaded into a SearchIndex when it has to be updated.
+static const char SEARCH_MAGIC[8] = {'C', 'S', 'T', 'R', 'I', '0', '0', '1'};
+
+struct SearchHeader {
+    char magic[8];
+    uint64_t file_size;
+    int64_t mtime_ns;
+    uint64_t entry_count;
+    uint64_t names_size;
+    uint64_t trigram_count;
+    uint64_t posting_count;
+};
+
+struct SearchRecord {
+    uint64_t header_offset;
+    uint64_t body_offset;
+    uint64_t body_length;
+    uint64_t name_offset;
+    uint32_t name_length;
+    uint32_t flags;  // Bit 0: live, bit 1: visible
+};
+
+struct TrigramSlot {
+    uint32_t trigram;
+    uint32_t count;
+    uint64_t first_posting;
+};
+
+// Collects the distinct trigrams of a byte range, sorted
+void collect_trigrams(std::string_view text, std::vector<uint32_t>& trigrams) {
+    trigrams.clear();
+    for (size_t i = 0; i + 3 <= text.size(); ++i) {
+        trigrams.push_back(((uint32_t)(unsigned char)text[i] << 16) |
+                           ((uint32_t)(unsigned char)text[i + 1] << 8) | (unsigned char)text[i + 2]);
+    }
+    std::sort(trigrams.begin(), trigrams.end());
+    trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+}
+
+// Adds a block to the index, recording its trigrams
+void search_index_add(SearchIndex& index, SearchEntry entry, std::string_view body) {
+    uint32_t id = (uint32_t)index.entries.size();
+    index.entries.push_back(std::move(entry));
+
+    std::vector<uint32_t> trigrams;
+    collect_trigrams(body, trigrams);
+    for (uint32_t trigram : trigrams) {
+        index.postings[trigram].push_back(id);
+    }
+}
+
+// Recomputes which live block of each name is the one lookups resolve to
+void search_index_mark_visible(SearchIndex& index) {
+    std::set<std::string_view> seen;
+    for (SearchEntry& entry : index.entries) {
+        entry.visible = entry.live && seen.insert(entry.name).second;
+    }
+}
+
+// Builds a search index from scratch by parsing a snippet file
+bool build_search_index(const std::string& snippet_file, SearchIndex& index) {
+    MappedFile snippets;
+    if (!snippets.open(snippet_file)) {
+        return false;
+    }
+
+    index = SearchIndex();
+    SnippetLog log(snippets.view());
+    for (const ResolvedTemplate& resolved : log.templates()) {
+        if (!resolved.live) {
+            continue;
+        }
+        const TemplateView& tmpl = resolved.tmpl;
+        SearchEntry entry;
+        entry.header_offset = tmpl.header_offset;
+        entry.body_offset = tmpl.body.data() - snippets.data();
+        entry.body_length = tmpl.body.size();
+        entry.name = std::string(resolved.name);
+        search_index_add(index, std::move(entry), tmpl.body);
+    }
+    search_index_mark_visible(index);
+    return true;
+}
+
+/**
+ * @brief Writes a search index next to its snippet file, stamped with a given size and mtime of the file.
+ *
+ * When deleted blocks make up most of the index, it is rebuilt from the snippet file instead so that
+ * dead postings do not accumulate.
+ *
+ * @param snippet_file Path to the snippet file the index describes.
+ * @param index The index to write.
+ * @param file_size Size of the snippet file the index describes.
+ * @param mtime_ns Modification time (see file_stamp()) of the snippet file the index describes.
+ * @return True if the index was written.
+ */
+
+bool write_search_index(const std::string& snippet_file, SearchIndex& index, uint64_t file_size, int64_t mtime_ns) {
+    size_t dead = 0;
+    for (const SearchEntry& entry : index.entries) {
+        dead += entry.live ? 0 : 1;
+    }
+    if (dead > 1024 && dead * 2 > index.entries.size() && !build_search_index(snippet_file, index)) {
+        return false;
+    }
+
+    SearchHeader header;
+    std::memcpy(header.magic, SEARCH_MAGIC, sizeof(SEARCH_MAGIC));
+    header.file_size = file_size;
+    header.mtime_ns = mtime_ns;
+
+    // Lay out the entry records and their names
+    std::vector<SearchRecord> records;
+    std::string names;
+    for (const SearchEntry& entry : index.entries) {
+        SearchRecord record;
+        record.header_offset = entry.header_offset;
+        record.body_offset = entry.body_offset;
+        record.body_length = entry.body_length;
+        record.name_offset = names.size();
+        record.name_length = (uint32_t)entry.name.size();
+        record.flags = (entry.live ? 1u : 0u) | (entry.visible ? 2u : 0u);
+        records.push_back(record);
+        names += entry.name;
+    }
+
+    // Lay out the trigram table in key order, followed by the posting lists
+    std::vector<uint32_t> trigrams;
+    trigrams.reserve(index.postings.size());
+    for (const auto& posting : index.postings) {
+        trigrams.push_back(posting.first);
+    }
+    std::sort(trigrams.begin(), trigrams.end());
+
+    std::vector<TrigramSlot> slots;
+    std::vector<uint32_t> postings;
+    for (uint32_t trigram : trigrams) {
+        const std::vector<uint32_t>& ids = index.postings[trigram];
+        slots.push_back(TrigramSlot{trigram, (uint32_t)ids.size(), postings.size()});
+        postings.insert(postings.end(), ids.begin(), ids.end());
+    }
+
+    header.entry_count = records.size();
+    header.names_size = names.size();
+    header.trigram_count = slots.size();
+    header.posting_count = postings.size();
+
+    std::string index_file = snippet_file + ".tri";
+    std::string temp_file = temp_path(index_file);
+    std::ofstream index_output(temp_file, std::ios::binary | std::ios::trunc);
+    if (!index_output.is_open()) {
+        return false;
+    }
+
+    names.append((8 - names.size() % 8) % 8, '\0');
+    index_output.write((const char*)&header, sizeof(header));
+    index_output.write((const char*)records.data(), records.size() * sizeof(SearchRecord));
+    index_output.write(names.data(), names.size());
+    index_output.write((const char*)slots.data(), slots.size() * sizeof(TrigramSlot));
+    index_output.write((const char*)postings.data(), postings.size() * sizeof(uint32_t));
+    index_output.close();
+
+    if (!index_output || std::rename(temp_file.c_str(), index_file.c_str()) != 0) {
+        std::remove(temp_file.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Writes a search index stamped with the snippet file's current size and mtime
+bool write_search_index(const std::string& snippet_file, SearchIndex& index) {
+    uint64_t file_size = 0;
+    int64_t mtime_ns = 0;
+    return file_stamp(snippet_file, file_size, mtime_ns) &&
+           write_search_index(snippet_file, index, file_size, mtime_ns);
+}
+
+/**
+ * @brief Mapped, validated view of a search index file.
+ *
+ * open() succeeds only if the index exists, is well formed and still matches the snippet file. Being
+ * well formed covers the contents as well as the layout: every name, posting list and posting id is
+ * checked to lie within its section, and every body within the snippet file, so that a corrupt or
+ * hand-edited index whose stamp still matches is rebuilt rather than read out of bounds.
+ */
+
+class SearchIndexView {
+public:
+    bool open(const std::string& snippet_file) {
+        uint64_t file_size = 0;
+        int64_t mtime_ns = 0;
+        if (!file_stamp(snippet_file, file_size, mtime_ns) || !mapping_.open(snippet_file + ".tri") ||
+            mapping_.size() < sizeof(SearchHeader)) {
+            return false;
+        }
+
+        std::memcpy(&header_, mapping_.data(), sizeof(header_));
+        if (std::memcmp(header_.magic, SEARCH_MAGIC, sizeof(SEARCH_MAGIC)) != 0 ||
+            header_.file_size != file_size || header_.mtime_ns != mtime_ns) {
+            return false;
+        }
+
+        // Each section must fit in what is left of the file, which also keeps the sums from overflowing
+        const uint64_t size = mapping_.size();
+        const uint64_t names_padding = (8 - header_.names_size % 8) % 8;
+        records_ = sizeof(SearchHeader);
+        if (header_.entry_count > (size - records_) / sizeof(SearchRecord) || header_.entry_count > UINT32_MAX) {
+            return false;
+        }
+        names_ = records_ + header_.entry_count * sizeof(SearchRecord);
+        if (header_.names_size > size - names_ || names_padding > size - names_ - header_.names_size) {
+            return false;
+        }
+        slots_ = names_ + header_.names_size + names_padding;
+        if (header_.trigram_count > (size - slots_) / sizeof(TrigramSlot)) {
+            return false;
+        }
+        postings_ = slots_ + header_.trigram_count * sizeof(TrigramSlot);
+        if ((size - postings_) % sizeof(uint32_t) != 0 ||
+            header_.posting_count != (size - postings_) / sizeof(uint32_t)) {
+            return false;
+        }
+        return contents_valid(file_size);
+    }
+
+    uint64_t entry_count() const { return header_.entry_count; }
+
+    SearchRecord record(uint64_t id) const {
+        SearchRecord record;
+        std::memcpy(&record, mapping_.data() + records_ + id * sizeof(SearchRecord), sizeof(record));
+        return record;
+    }
+
+    std::string_view name(const SearchRecord& record) const {
+        return std::string_view(mapping_.data() + names_ + record.name_offset, record.name_length);
+    }
+
+    // Returns the entry ids containing a trigram, by binary search over the trigram table
+    std::vector<uint32_t> postings(uint32_t trigram) const {
+        size_t low = 0, high = header_.trigram_count;
+        while (low < high) {
+            size_t middle = (low + high) / 2;
+            TrigramSlot found = slot(middle);
+            if (found.trigram < trigram) {
+                low = middle + 1;
+            } else if (found.trigram > trigram) {
+                high = middle;
+            } else {
+                return slot_postings(found);
+            }
+        }
+        return std::vector<uint32_t>();
+    }
+
+    // Loads the whole index into memory so it can be updated
+    void load(SearchIndex& index) const {
+        index = SearchIndex();
+        for (uint64_t id = 0; id < header_.entry_count; ++id) {
+            SearchRecord stored = record(id);
+            SearchEntry entry;
+            entry.header_offset = stored.header_offset;
+            entry.body_offset = stored.body_offset;
+            entry.body_length = stored.body_length;
+            entry.live = (stored.flags & 1u) != 0;
+            entry.visible = (stored.flags & 2u) != 0;
+            entry.name = std::string(name(stored));
+            index.entries.push_back(std::move(entry));
+        }
+        for (uint64_t i = 0; i < header_.trigram_count; ++i) {
+            TrigramSlot stored = slot(i);
+            index.postings[stored.trigram] = slot_postings(stored);
+        }
+    }
+
+private:
+    TrigramSlot slot(uint64_t i) const {
+        TrigramSlot slot;
+        std::memcpy(&slot, mapping_.data() + slots_ + i * sizeof(TrigramSlot), sizeof(slot));
+        return slot;
+    }
+
+    std::vector<uint32_t> slot_postings(const TrigramSlot& slot) const {
+        std::vector<uint32_t> ids(slot.count);
+        std::memcpy(ids.data(), mapping_.data() + postings_ + slot.first_posting * sizeof(uint32_t),
+                    slot.count * sizeof(uint32_t));
+        return ids;
+    }
+
+    // Checks that every record, trigram slot and posting points inside its section, that the trigrams
+    // are sorted for binary search, and that each posting list holds ascending ids of existing entries
+    bool contents_valid(uint64_t file_size) const {
+        for (uint64_t id = 0; id < header_.entry_count; ++id) {
+            SearchRecord stored = record(id);
+            if (stored.name_offset > header_.names_size || stored.name_length > header_.names_size - stored.name_offset ||
+                stored.body_offset > file_size || stored.body_length > file_size - stored.body_offset) {
+                return false;
+            }
+        }
+        uint32_t previous_id = 0;
+        for (uint64_t i = 0; i < header_.trigram_count; ++i) {
+            TrigramSlot stored = slot(i);
+            if ((i > 0 && stored.trigram <= slot(i - 1).trigram) || stored.first_posting > header_.posting_count ||
+                stored.count > header_.posting_count - stored.first_posting) {
+                return false;
+            }
+            const char* ids = mapping_.data() + postings_ + stored.first_posting * sizeof(uint32_t);
+            for (uint32_t k = 0; k < stored.count; ++k) {
+                uint32_t id;
+                std::memcpy(&id, ids + k * sizeof(uint32_t), sizeof(id));
+                if (id >= header_.entry_count || (k > 0 && id <= previous_id)) {
+                    return false;
+                }
+                previous_id = id;
+            }
+        }
+        return true;
+    }
+
+    MappedFile mapping_;
+    SearchHeader header_;
+    size_t records_ = 0, names_ = 0, slots_ = 0, postings_ = 0;
+};
+
+/**
+ * @brief Loads the search index of a snippet file for an incremental update.
+ *
+ * Must be called before the snippet file is modified, because the index is only usable if it matched
+ * the file as it was. A missing or stale index is left alone; the next search rebuilds it.
+ *
+ * @param snippet_file Path to the snippet file.
+ * @param index Receives the loaded index.
+ * @return True if a current index was loaded.
+ */
+
+bool load_search_index(const std::string& snippet_file, SearchIndex& index) {
+    SearchIndexView view;
+    if (!view.open(snippet_file)) {
+        return false;
+    }
+    view.load(index);
+    return true;
+}
+
+// Updates a loaded search index after a template block or alias was appended to the end of the
+// snippet file, given the offset of its first line and of the body it uses
+void search_index_after_extract(const std::string& snippet_file, SearchIndex& index,
+const std::string& template_name, uint64_t header_offset, uint64_t body_offset, const std::string& body) {
+    SearchEntry entry;
+    entry.header_offset = header_offset;
+    entry.body_offset = body_offset;
+    entry.body_length = body.size();
+    entry.name = template_name;
+    search_index_add(index, std::move(entry), body);
+    search_index_mark_visible(index);
+    write_search_index(snippet_file, index);
+}
+
+// Updates a loaded search index after every block with a name was deleted, either cut out of the
+// snippet file or, with in_place, left where it was behind a delete record
+void search_index_after_delete(const std::string& snippet_file, SearchIndex& index,
+const std::string& template_name, bool in_place) {
+    std::vector<SearchEntry>& entries = index.entries;
+    uint64_t shift = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (!entries[i].live) {
+            continue;
+        }
+
+        entries[i].header_offset -= shift;
+        entries[i].body_offset -= shift;
+        if (entries[i].name == template_name) {
+            // The block spans up to the next block's header, less any text between the two
+            entries[i].live = false;
+            uint64_t end_marker = entries[i].body_offset + entries[i].body_length;
+            uint64_t removed = end_marker - entries[i].header_offset + END_MARKER.size() + 1;
+            shift += in_place ? 0 : removed;
+        }
+    }
+    search_index_mark_visible(index);
+    write_search_index(snippet_file, index);
+}
+
+// Updates a loaded search index after the header lines of a template were renamed in the snippet file,
+// or, with in_place, after a rename record was appended instead
+void search_index_after_rename(const std::string& snippet_file, SearchIndex& index,
+const std::string& old_template_name, const std::string& new_template_name, bool in_place) {
+    int64_t shift = 0;
+    int64_t delta = in_place ? 0 : (int64_t)new_template_name.size() - (int64_t)old_template_name.size();
+    for (SearchEntry& entry : index.entries) {
+        if (!entry.live) {
+            continue;
+        }
+
+        entry.header_offset += shift;
+        entry.body_offset += shift;
+        if (entry.name == old_template_name) {
+            entry.name = new_template_name;
+            entry.body_offset += delta;
+            shift += delta;
+        }
+    }
+    search_index_mark_visible(index);
+    write_search_index(snippet_file, index);
+}
+
+/**
+ * @brief Replaces a run of blocks in a search index with the blocks parsed from an edited range.
+ *
+ * Entries first to first + removed - 1 are dropped and the added blocks take their place. Later blocks
+ * keep their postings under shifted ids, and their offsets move by delta, the change in size of the
+ * edited range. Visibility is left to the caller, which knows which names the edit touched.
+ *
+ * @param index The index to update.
+ * @param first Id of the first replaced entry.
+ * @param removed Number of replaced entries.
+ * @param added The blocks that replace them, in file order, with their bodies.
+ * @param delta Bytes by which the entries after the range move.
+ */
+
+void search_index_replace(SearchIndex& index, size_t first, size_t removed,
+std::vector<std::pair<SearchEntry, std::string_view>>& added, int64_t delta) {
+    std::vector<SearchEntry>& entries = index.entries;
+    const uint32_t removed_end = (uint32_t)(first + removed);
+    const int64_t id_shift = (int64_t)added.size() - (int64_t)removed;
+    for (size_t i = removed_end; i < entries.size(); ++i) {
+        entries[i].header_offset += delta;
+        entries[i].body_offset += delta;
+    }
+    std::vector<SearchEntry> replaced;
+    replaced.reserve(added.size());
+    for (auto& block : added) {
+        replaced.push_back(std::move(block.first));
+    }
+    entries.erase(entries.begin() + first, entries.begin() + removed_end);
+    entries.insert(entries.begin() + first, std::make_move_iterator(replaced.begin()),
+                   std::make_move_iterator(replaced.end()));
+
+    // Drop the replaced ids from every posting list and renumber the ids after them
+    for (auto posting = index.postings.begin(); posting != index.postings.end();) {
+        std::vector<uint32_t>& ids = posting->second;
+        auto low = std::lower_bound(ids.begin(), ids.end(), (uint32_t)first);
+        auto high = std::lower_bound(low, ids.end(), removed_end);
+        for (auto id = high; id != ids.end(); ++id) {
+            *id = (uint32_t)(*id + id_shift);
+        }
+        ids.erase(low, high);
+        posting = ids.empty() ? index.postings.erase(posting) : std::next(posting);
+    }
+
+    // Record the trigrams of the added blocks
+    std::vector<uint32_t> trigrams;
+    for (size_t i = 0; i < added.size(); ++i) {
+        uint32_t id = (uint32_t)(first + i);
+        collect_trigrams(added[i].second, trigrams);
+        for (uint32_t trigram : trigrams) {
+            std::vector<uint32_t>& ids = index.postings[trigram];
+            ids.insert(std::upper_bound(ids.begin(), ids.end(), id), id);
+        }
+    }
+}
+
+// Returns literal substrings that every match of an ECMAScript regular expression must contain
+std::vector<std::string> regex_required_literals(const std::string& pattern) {
+    std::vector<std::string> literals;
+    if (pattern.find('|') != std::string::npos) {
+        return literals; // Alternation makes every literal optional
+    }
+
+    std::string current;
+    auto flush = [&]() {
+        if (current.size() >= 3) {
+            literals.push_back(current);
+        }
+        current.clear();
+    };
+
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        char c = pattern[i];
+        if (c == '(') {
+            // Skip groups entirely, since a quantifier may follow them
+            flush();
+            for (int depth = 1; depth > 0 && ++i < pattern.size();) {
+                if (pattern[i] == '\\') {
+                    i++;
+                } else if (pattern[i] == '(') {
+                    depth++;
+                } else if (pattern[i] == ')') {
+                    depth--;
+                }
+            }
+        } else if (c == '[') {
+            flush();
+            size_t close = i + 1;
+            if (close < pattern.size() && pattern[close] == '^') {
+                close++;
+            }
+            if (close < pattern.size() && pattern[close] == ']') {
+                close++;
+            }
+            while (close < pattern.size() && pattern[close] != ']') {
+                close += pattern[close] == '\\' ? 2 : 1;
+            }
+            i = close;
+        } else if (c == '*' || c == '?' || c == '{') {
+            // The preceding character may be absent
+            if (!current.empty()) {
+                current.pop_back();
+            }
+            flush();
+            if (c == '{') {
+                i = std::min(pattern.find('}', i), pattern.size());
+            }
+        } else if (c == '+' || c == '.' || c == '^' || c == '$') {
+            flush();
+        } else if (c == '\\') {
+            if (i + 1 < pattern.size()) {
+                char escaped = pattern[++i];
+                if (std::isalnum((unsigned char)escaped)) {
+                    flush(); // A character class or assertion such as \d or \b
+                } else {
+                    current += escaped;
+                }
+            }
+        } else {
+            current += c;
+        }
+    }
+    flush();
+    return literals;
+}
+
+// Template names of one snippet file that match a query, plus every name the file defines
+struct FileSearchResult {
+    bool opened = false;
+    std::vector<std::string> matches;
+    std::set<std::string> names;
+};
+
+/**
+ * @brief Searches the template bodies of a single snippet file.
+ *
+ * Candidates are the templates that contain every trigram of the query's literal text, found by
+ * intersecting posting lists from the trigram index; each candidate is then verified with memmem or
+ * the regular expression. The index is built on first use and whenever it no longer matches the file.
+ *
+ * @param snippet_file Path to the snippet file.
+ * @param query Substring or regular expression to look for.
+ * @param regex Compiled expression for regex queries, or null for substring queries.
+ * @param collect_names If true, also record every visible template name of the file.
+ * @param result Receives the matches.
+ */
+
+void search_file(const std::string& snippet_file, const std::string& query, const std::regex* regex,
+bool collect_names, FileSearchResult& result) {
+    MappedFile snippets;
+    if (!snippets.open(snippet_file)) {
+        return;
+    }
+    result.opened = true;
+
+    // Packs have no trigram index, so every body is checked directly
+    SnippetPack pack;
+    if (pack.open(snippets)) {
+        PackRecord record;
+        for (size_t position = 0; position < pack.size(); ++position) {
+            if (!pack.record(pack.ordered(position), record)) {
+                continue;
+            }
+            std::string_view body = pack.body(record);
+            bool match = regex ? std::regex_search(body.begin(), body.end(), *regex)
+                               : memmem(body.data(), body.size(), query.data(), query.size()) != nullptr;
+            if (match) {
+                result.matches.emplace_back(pack.name(record));
+            }
+            if (collect_names) {
+                result.names.emplace(pack.name(record));
+            }
+        }
+        return;
+    }
+
+    SearchIndexView index;
+    if (!index.open(snippet_file)) {
+        SearchIndex built;
+        if (!build_search_index(snippet_file, built) || !write_search_index(snippet_file, built) ||
+            !index.open(snippet_file)) {
+            // Without a usable index, verify every template directly
+            SnippetLog log(snippets.view());
+            std::set<std::string_view> seen;
+            for (const ResolvedTemplate& resolved : log.templates()) {
+                if (!resolved.live || !seen.insert(resolved.name).second) {
+                    continue;
+                }
+                const TemplateView& tmpl = resolved.tmpl;
+                bool match = regex ? std::regex_search(tmpl.body.begin(), tmpl.body.end(), *regex)
+                                   : memmem(tmpl.body.data(), tmpl.body.size(), query.data(), query.size()) != nullptr;
+                if (match) {
+                    result.matches.emplace_back(resolved.name);
+                }
+                if (collect_names) {
+                    result.names.emplace(resolved.name);
+                }
+            }
+            return;
+        }
+    }
+
+    // Intersect the posting lists of every trigram the query requires
+    std::vector<std::string> literals = regex ? regex_required_literals(query) : std::vector<std::string>{query};
+    std::vector<uint32_t> candidates;
+    bool filtered = false;
+    std::vector<uint32_t> trigrams;
+    for (const std::string& literal : literals) {
+        collect_trigrams(literal, trigrams);
+        for (uint32_t trigram : trigrams) {
+            std::vector<uint32_t> ids = index.postings(trigram);
+            if (!filtered) {
+                candidates.swap(ids);
+                filtered = true;
+            } else {
+                std::vector<uint32_t> both;
+                std::set_intersection(candidates.begin(), candidates.end(), ids.begin(), ids.end(),
+                                      std::back_inserter(both));
+                candidates.swap(both);
+            }
+            if (candidates.empty()) {
+                break;
+            }
+        }
+    }
+    if (!filtered) {
+        for (uint32_t id = 0; id < index.entry_count(); ++id) {
+            candidates.push_back(id);
+        }
+    }
+
+    // Verify each candidate against the template body
+    for (uint32_t id : candidates) {
+        SearchRecord record = index.record(id);
+        if (!(record.flags & 2u) || record.body_offset > snippets.size() ||
+            record.body_length > snippets.size() - record.body_offset) {
+            continue;
+        }
+        const char* body = snippets.data() + record.body_offset;
+        bool match = regex ? std::regex_search(body, body + record.body_length, *regex)
+                           : memmem(body, record.body_length, query.data(), query.size()) != nullptr;
+        if (match) {
+            result.matches.emplace_back(index.name(record));
+        }
+    }
+
+    if (collect_names) {
+        for (uint64_t id = 0; id < index.entry_count(); ++id) {
+            SearchRecord record = index.record(id);
+            if (record.flags & 2u) {
+                result.names.emplace(index.name(record));
+            }
+        }
+    }
+}
+
+/**
+ * @brief Finds the lines of a buffer selected by a marker or regex insert anchor.
+ *
+ * A marker is located with find_substring() across the whole buffer rather than line by line. A regex
+ * is located the same way through the longest literal every match must contain, when it has one, and
+ * only the lines holding that literal are tested against the full expression.
+ */
+
+class AnchorMatcher {
+public:
+    // Prepares the anchor; returns false, after printing an error, if it cannot be used
+    bool compile(const InsertAnchor& anchor) {
+        if (anchor.pattern.empty()) {
+            command_errors() << "Anchor cannot be empty." << std::endl;
+            return false;
+        }
+        if (anchor.kind == InsertAnchor::MARKER) {
+            if (anchor.pattern.find('\n') != std::string::npos) {
+                command_errors() << "Marker cannot span lines." << std::endl;
+                return false;
+            }
+            literal_ = anchor.pattern;
+            return true;
+        }
+
+        try {
+            regex_ = std::regex(anchor.pattern, std::regex::ECMAScript | std::regex::optimize);
+        } catch (const std::regex_error& error) {
+            command_errors() << "Invalid regular expression: " << error.what() << std::endl;
+            return false;
+        }
+        is_regex_ = true;
+        for (const std::string& literal : regex_required_literals(anchor.pattern)) {
+            if (literal.size() > literal_.size() && literal.find('\n') == std::string::npos) {
+                literal_ = literal;
+            }
+        }
+        return true;
+    }
+
+    // Returns the offset of the first selected line at or after pos, which must start a line, or npos
+    size_t next(std::string_view data, size_t pos) const {
+        while (pos < data.size()) {
+            size_t line_start = pos;
+            if (!literal_.empty()) {
+                const char* hit = find_substring(data.data() + pos, data.size() - pos, literal_);
+                if (!hit) {
+                    return std::string_view::npos;
+                }
+                line_start = (size_t)(hit - data.data());
+                while (line_start > pos && data[line_start - 1] != '\n') {
+                    line_start--;
+                }
+            }
+
+            size_t line_end = line_end_of(data, line_start);
+            if (!is_regex_ || std::regex_search(data.data() + line_start, data.data() + line_end, regex_)) {
+                return line_start;
+            }
+            pos = line_end + 1;
+        }
+        return std::string_view::npos;
+    }
+
+    // Returns the offset of the newline ending the line that starts at pos, or the size of data
+    static size_t line_end_of(std::string_view data, size_t pos) {
+        const char* newline = (const char*)std::memchr(data.data() + pos, '\n', data.size() - pos);
+        return newline ? (size_t)(newline - data.data()) : data.size();
+    }
+
+private:
+    std::string literal_;
+    std::regex regex_;
+    bool is_regex_ = false;
+};
+
+/**
+ * @brief Replaces the lines of a target file selected by an anchor with a group of new lines.
+ *
+ * The anchor is searched for in the same pass that copies the target into a temporary file, so the
+ * target is read once. Like file_splice(), the replaced line's indentation is applied to the inserted
+ * lines, and the temporary file is renamed over the target. If nothing matches, the target is left
+ * untouched.
+ *
+ * @param target_file The path to the file to modify.
+ * @param matcher The compiled anchor.
+ * @param every_match If true, every selected line is replaced; otherwise only the first.
+ * @param lines The lines to insert in place of each selected line.
+ * @param matches Receives the number of lines replaced.
+ * @return StoreStatus::OK if the target file was rewritten, NOT_FOUND if nothing matched, or IO_ERROR.
+ */
+
+StoreStatus file_splice_at_anchor(const std::string& target_file, const AnchorMatcher& matcher, bool every_match,
+const std::vector<std::string>& lines, size_t& matches) {
+    PhaseTimer timer(PHASE_SPLICE);
+    matches = 0;
+
+    // Map the target file and find the first anchor before creating anything
+    MappedFile target;
+    if (!target.open(target_file)) {
+        command_errors() << "Error opening target file: " << target_file << std::endl;
+        return StoreStatus::IO_ERROR;
+    }
+    std::string_view data = target.view();
+    size_t match = matcher.next(data, 0);
+    if (match == std::string_view::npos) {
+        command_errors() << "Anchor not found in target file: " << target_file << std::endl;
+        return StoreStatus::NOT_FOUND;
+    }
+
+    // Open a temporary file next to the file the target resolves to, with the same permissions
+    struct stat st;
+    if (stat(target_file.c_str(), &st) != 0) {
+        st.st_mode = 0644;
+    }
+    std::string temp_file = temp_path(resolve_target(target_file));
+    int output_fd = ::open(temp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+    if (output_fd < 0) {
+        command_errors() << "Error writing to target file: " << target_file << std::endl;
+        return StoreStatus::IO_ERROR;
+    }
+
+    std::vector<char> output(STREAM_BUFFER_SIZE);
+    size_t pending = 0;
+    char last_written = '\n';
+    bool ok = true;
+    LineCheckpointBuilder checkpoints;
+    bool track_checkpoints = line_checkpoints_enabled() || access((target_file + ".lines").c_str(), F_OK) == 0;
+
+    // Writes bytes to the temporary file, noting where checkpointed lines start
+    auto write_out = [&](const char* bytes, size_t size) {
+        if (track_checkpoints) {
+            checkpoints.add(bytes, size);
+        }
+        ok = ok && write_all(output_fd, bytes, size);
+    };
+
+    // Buffers bytes for the temporary file; runs larger than the buffer are written directly
+    auto emit = [&](const char* bytes, size_t size) {
+        if (size == 0) {
+            return;
+        }
+        last_written = bytes[size - 1];
+        if (pending + size > output.size()) {
+            write_out(output.data(), pending);
+            pending = 0;
+            if (size >= output.size()) {
+                write_out(bytes, size);
+                return;
+            }
+        }
+        std::memcpy(output.data() + pending, bytes, size);
+        pending += size;
+    };
+
+    // Copy the text between anchors through and replace each selected line
+    size_t pos = 0;
+    while (ok && match != std::string_view::npos) {
+        emit(data.data() + pos, match - pos);
+        size_t indent_end = match;
+        while (indent_end < data.size() && (data[indent_end] == ' ' || data[indent_end] == '\t')) {
+            indent_end++;
+        }
+        for (const std::string& line : lines) {
+            emit(data.data() + match, indent_end - match);
+            emit(line.data(), line.size());
+            emit("\n", 1);
+        }
+        matches++;
+
+        pos = std::min(AnchorMatcher::line_end_of(data, match) + 1, data.size());
+        match = every_match ? matcher.next(data, pos) : std::string_view::npos;
+    }
+    emit(data.data() + pos, data.size() - pos);
+    if (last_written != '\n') {
+        emit("\n", 1);
+    }
+    if (pending > 0) {
+        write_out(output.data(), pending);
+    }
+    stats_add(run_stats.bytes_read, data.size());
+
+    // Replace the target file with the rewritten copy
+    bool moved = ok && move_into_place(temp_file, output_fd, target_file, false);
+    if (::close(output_fd) != 0 || !moved) {
+        command_errors() << "Error writing to target file: " << target_file << std::endl;
+        if (!ok) {
+            std::remove(temp_file.c_str());
+        }
+        return StoreStatus::IO_ERROR;
+    }
+    if (track_checkpoints) {
+        checkpoints.save(target_file);
+    }
+    return StoreStatus::OK;
+}
+
+/**
+ * @brief Writes a group of lines into a target file at the place an insert anchor selects.
+ *
+ * @param target_file The path to the file to modify.
+ * @param lines The lines to insert.
+ * @param anchor The line number, marker or regex selecting where the lines go.
+ * @param location Receives where the lines went, for the success message (e.g. "line 12").
+ * @return StoreStatus::OK if the target file was rewritten, or the kind of error, which is reported to
+ *         command_errors().
+ */
+
+StoreStatus insert_at_anchor(const std::string& target_file, const std::vector<std::string>& lines,
+const InsertAnchor& anchor, std::string& location) {
+    if (anchor.kind == InsertAnchor::LINE) {
+        location = "line " + std::to_string(anchor.line_number);
+        if (file_overwrite(target_file, lines, anchor.line_number)) {
+            return StoreStatus::OK;
+        }
+        return anchor.line_number < 1 ? StoreStatus::INVALID_ARGUMENT : StoreStatus::IO_ERROR;
+    }
+
+    AnchorMatcher matcher;
+    size_t matches = 0;
+    if (!matcher.compile(anchor)) {
+        return StoreStatus::INVALID_ARGUMENT;
+    }
+    StoreStatus status = file_splice_at_anchor(target_file, matcher, anchor.every_match, lines, matches);
+    location = std::to_string(matches) + (matches == 1 ? " matching line" : " matching lines");
+    return status;
+}
+
+/**
+ * @brief Parses a "name=value" assignment of a template variable.
+ *
+ * @param assignment The assignment text.
+ * @param variables Receives the value under the given name, replacing any earlier one.
+ * @return False, after printing an error, if the text is not an assignment to a valid name.
+ */
+
+bool parse_variable_assignment(const std::string& assignment, TemplateVariables& variables) {
+    size_t equals = assignment.find('=');
+    std::string name = assignment.substr(0, equals);
+    bool valid = equals != std::string::npos && !name.empty() && !std::isdigit((unsigned char)name[0]);
+    for (char c : name) {
+        valid = valid && (std::isalnum((unsigned char)c) || c == '_');
+    }
+    if (!valid) {
+        std::cerr << "Invalid variable assignment: " << assignment << std::endl;
+        return false;
+    }
+    variables[name] = assignment.substr(equals + 1);
+    return true;
+}
+
+/**
+ * @brief Removes "--var name=value" options from a list of arguments.
+ *
+ * @param args The arguments; the options and their values are removed in place.
+ * @param variables Receives the assigned values.
+ * @return False, after printing an error, if an option lacks its value or the assignment is invalid.
+ */
+
+bool take_variable_args(std::vector<std::string>& args, TemplateVariables& variables) {
+    std::vector<std::string> remaining;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] != "--var") {
+            remaining.push_back(args[i]);
+        } else if (i + 1 == args.size()) {
+            std::cerr << "Missing value for --var." << std::endl;
+            return false;
+        } else if (!parse_variable_assignment(args[++i], variables)) {
+            return false;
+        }
+    }
+    args.swap(remaining);
+    return true;
+}
+
+/**
+ * @brief A template body compiled into literal spans and ${name} slots for repeated expansion.
+ *
+ * A placeholder is "${" followed by a name made of letters, digits and underscores and a closing "}".
+ * Anything else, such as the shell's "${HOME:-/tmp}", is kept as literal text, and "$${" stands for a
+ * literal "${". Expanding appends straight into a caller-owned buffer after growing it once, so a
+ * buffer reused across many expansions stops allocating after the first few.
+ */
+
+class CompiledTemplate {
+public:
+    // Splits a body into segments; the body is copied, so it need not outlive the compiled template
+    void compile(std::string_view body) {
+        text_.clear();
+        segments_.clear();
+        slots_.clear();
+        literal_size_ = 0;
+
+        size_t literal_start = 0;
+        size_t pos = 0;
+        while ((pos = body.find("${", pos)) != std::string_view::npos) {
+            // "$${" stands for a literal "${"
+            if (pos > 0 && body[pos - 1] == '$') {
+                add_literal(body.substr(literal_start, pos - 1 - literal_start));
+                literal_start = pos;
+                pos += 2;
+                continue;
+            }
+
+            size_t name_end = pos + 2;
+            while (name_end < body.size() && (std::isalnum((unsigned char)body[name_end]) || body[name_end] == '_')) {
+                name_end++;
+            }
+            if (name_end == pos + 2 || name_end == body.size() || body[name_end] != '}' ||
+                std::isdigit((unsigned char)body[pos + 2])) {
+                pos += 2;
+                continue;
+            }
+
+            add_literal(body.substr(literal_start, pos - literal_start));
+            std::string_view name = body.substr(pos + 2, name_end - pos - 2);
+            size_t slot = std::find(slots_.begin(), slots_.end(), name) - slots_.begin();
+            if (slot == slots_.size()) {
+                slots_.emplace_back(name);
+            }
+            segments_.push_back({0, 0, (int)slot});
+            pos = literal_start = name_end + 1;
+        }
+        add_literal(body.substr(literal_start));
+    }
+
+    // Names of the placeholders, indexed by slot
+    const std::vector<std::string>& slot_names() const { return slots_; }
+
+    // Looks up a value for every slot; returns false, after printing an error, if one is missing
+    bool bind(const TemplateVariables& variables, std::vector<std::string_view>& values) const {
+        values.clear();
+        for (const std::string& name : slots_) {
+            auto found = variables.find(name);
+            if (found == variables.end()) {
+                command_errors() << "Missing value for template variable '" << name << "'." << std::endl;
+                return false;
+            }
+            values.emplace_back(found->second);
+        }
+        return true;
+    }
+
+    // Appends the body with each slot replaced by its bound value
+    void expand(const std::vector<std::string_view>& values, std::string& output) const {
+        size_t size = literal_size_;
+        for (const Segment& segment : segments_) {
+            if (segment.slot >= 0) {
+                size += values[segment.slot].size();
+            }
+        }
+        size_t pos = output.size();
+        output.resize(pos + size);
+        char* out = &output[0] + pos;
+        for (const Segment& segment : segments_) {
+            std::string_view piece = segment.slot >= 0 ? values[segment.slot]
+                                                       : std::string_view(text_).substr(segment.offset, segment.length);
+            std::memcpy(out, piece.data(), piece.size());
+            out += piece.size();
+        }
+    }
+
+private:
+    struct Segment {
+        size_t offset;  // Literal text position in text_
+        size_t length;
+        int slot;       // Slot index, or -1 for literal text
+    };
+
+    // Appends literal text, merging it with a preceding literal segment
+    void add_literal(std::string_view literal) {
+        if (literal.empty()) {
+            return;
+        }
+        if (!segments_.empty() && segments_.back().slot < 0) {
+            segments_.back().length += literal.size();
+        } else {
+            segments_.push_back({text_.size(), literal.size(), -1});
+        }
+        text_.append(literal.data(), literal.size());
+        literal_size_ += literal.size();
+    }
+
+    std::string text_;
+    std::vector<Segment> segments_;
+    std::vector<std::string> slots_;
+    size_t literal_size_ = 0;
+};
+
+/**
+ * @brief Expands the ${name} placeholders of a template body into a buffer.
+ *
+ * @param body The template body.
+ * @param variables The values of the placeholders.
+ * @param output Receives the expanded body, appended to any existing content.
+ * @return False, after printing an error, if a placeholder has no value.
+ */
+
+bool expand_template(std::string_view body, const TemplateVariables& variables, std::string& output) {
+    CompiledTemplate compiled;
+    compiled.compile(body);
+    std::vector<std::string_view> values;
+    if (!compiled.bind(variables, values)) {
+        return false;
+    }
+    compiled.expand(values, output);
+    return true;
+}
+
+/**
+ * @brief Looks up a template in a snippet file, directory, glob or pack and splits it into lines.
+ *
+ * @param snippet_file Path to the snippet source.
+ * @param template_name The template to look up.
+ * @param snippet_lines Receives the lines of the template body.
+ * @param variables Values for the template's ${name} placeholders; if empty, the body is used as is.
+ * @return False, after printing an error, if the template cannot be found, lacks a variable or is empty.
+ */
+
+bool load_template_lines(const std::string& snippet_file, const std::string& template_name,
+std::vector<std::string>& snippet_lines, const TemplateVariables& variables = TemplateVariables()) {
+    // Look up the template by name and extract its lines
+    if (is_snippet_collection(snippet_file)) {
+        std::string body;
+        if (!find_in_collection(snippet_file, template_name, body)) {
+            return false;
+        }
+        PhaseTimer timer(PHASE_LOOKUP);
+        std::string expanded;
+        if (!variables.empty() && !expand_template(body, variables, expanded)) {
+            return false;
+        }
+        snippet_lines = split_lines(variables.empty() ? body : expanded);
+    } else {
+        // Map the snippet file for reading
+        MappedFile snippets;
+        if (!snippets.open(snippet_file)) {
+            std::cerr << "Error opening snippet file: " << snippet_file << std::endl;
+            return false;
+        }
+
+        std::string_view body;
+        if (!find_template(snippet_file, snippets, template_name, body)) {
+            std::cerr << "Template '" << template_name << "' not found in snippet file." << std::endl;
+            return false;
+        }
+
+        // Packs store line offsets, so their bodies are split without scanning
+        PhaseTimer timer(PHASE_LOOKUP);
+        SnippetPack pack;
+        PackRecord record;
+        std::string expanded;
+        if (!variables.empty()) {
+            if (!expand_template(body, variables, expanded)) {
+                return false;
+            }
+            snippet_lines = split_lines(expanded);
+        } else if (pack.open(snippets) && pack.find(template_name, record)) {
+            snippet_lines = pack.lines(record);
+        } else {
+            snippet_lines = split_lines(body);
+        }
+    }
+
+    // An empty template has nothing to insert
+    if (snippet_lines.empty()) {
+        std::cerr << "No lines found for template '" << template_name << "'." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Prints the message of a store operation, to standard output on success and standard error otherwise
+bool report(const StoreResult& result) {
+    if (!result.message.empty()) {
+        (result.ok() ? std::cout : std::cerr) << result.message << std::endl;
+    }
+    return result.ok();
+}
+
+/**
+ * @brief Inserts a named code snippet into a target file at a specified line number or anchor.
+ *
+ * This function reads a code snippet from the given snippet file using a defined template format,
+ * then inserts the snippet into the target file at the specified line number. If the target file
+ * has fewer lines than the insertion point, it is padded with empty lines. The inserted snippet
+ * is automatically indented to match the target line's existing indentation. Instead of a line
+ * number, the anchor may name a marker or regex, and the snippet then replaces the first line (or
+ * every line) that contains it.
+ *
+ * Snippets in the snippet file must be enclosed between:
+ *   #-- name: <template_name>
+ *   ... (snippet content) ...
+ *   #-- end
+ *
+ * @param snippet_file The file path containing named code snippets.
+ * @param target_file The file path to insert the snippet into.
+ * @param template_name The name of the snippet template to insert.
+ * @param anchor The line number (1-based index), marker or regex selecting the line to replace.
+ * @param variables Values for the template's ${name} placeholders; if empty, the template is inserted as is.
+ *
+ * @return True if the snippet was inserted.
+ *
+ * @note
+ * - If the template is not found or contains no content, the function exits with an error message.
+ * - If the target file doesn't exist or is empty, it will be created or padded accordingly.
+ * - The original line at the insertion point is overwritten by the snippet.
+ */
+
+bool insert(std::string& snippet_file, std::string& target_file,
+std::string& template_name, const InsertAnchor& anchor, const TemplateVariables& variables) {
+    // A single snippet file or pack is served by a store
+    if (!is_snippet_collection(snippet_file)) {
+        SnippetStore store;
+        StoreResult result = store.open(snippet_file);
+        if (result) {
+            result = store.insert(template_name, target_file, anchor, variables);
+        }
+        return report(result);
+    }
+
+    std::vector<std::string> snippet_lines;
+    if (!load_template_lines(snippet_file, template_name, snippet_lines, variables)) {
+        return false;
+    }
+
+    // Overwrite the target file with the snippet at the specified line or anchor
+    std::string location;
+    if (insert_at_anchor(target_file, snippet_lines, anchor, location) != StoreStatus::OK) {
+        return false;
+    }
+    
+    // Output a success message
+    std::cout << "Inserted snippet '" << template_name << "' into "
+              << target_file << " at " << location << "." << std::endl;
+    return true;
+}
+
+/**
+ * @brief Expands target arguments of apply into a list of files.
+ *
+ * Each argument is a file path or a glob pattern; a list file adds one path per line ("-" reads the
+ * list from standard input). Paths are kept in the order given, and repeats are dropped so that no
+ * file is rewritten twice at the same time.
+ *
+ * @param patterns File paths and glob patterns.
+ * @param list_file Path of a file listing targets, or empty for none.
+ * @param target_files Receives the files to apply the template to.
+ * @return False, after printing an error, if the list file cannot be read.
+ */
+
+bool expand_target_files(const std::vector<std::string>& patterns, const std::string& list_file,
+std::vector<std::string>& target_files) {
+    std::vector<std::string> paths;
+    for (const std::string& pattern : patterns) {
+        glob_t matches;
+        if (pattern.find_first_of("*?[") != std::string::npos && glob(pattern.c_str(), 0, nullptr, &matches) == 0) {
+            paths.insert(paths.end(), matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);
+            globfree(&matches);
+        } else {
+            paths.push_back(pattern);
+        }
+    }
+
+    // Read one target per line from the list file
+    if (!list_file.empty()) {
+        std::ifstream list_input;
+        if (list_file != "-") {
+            list_input.open(list_file);
+            if (!list_input.is_open()) {
+                std::cerr << "Error opening file list: " << list_file << std::endl;
+                return false;
+            }
+        }
+        std::istream& input = list_file == "-" ? std::cin : list_input;
+        std::string line;
+        while (std::getline(input, line)) {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (!line.empty()) {
+                paths.push_back(line);
+            }
+        }
+    }
+
+    std::set<std::string> seen;
+    for (const std::string& path : paths) {
+        if (seen.insert(std::filesystem::path(path).lexically_normal().string()).second) {
+            target_files.push_back(path);
+        }
+    }
+    return true;
+}
+
+// Outcome of applying a template to one target file
+struct ApplyResult {
+    bool ok = false;
+    std::string error;
+};
+
+/**
+ * @brief Inserts one template into many target files in parallel.
+ *
+ * The template is loaded and the anchor compiled once, then each target is spliced as a separate task
+ * on a work-stealing pool. The number of workers bounds how many files are open and being rewritten at
+ * once, and every splice streams through fixed-size buffers, so memory use does not grow with the
+ * number or size of the targets. A failing target is reported with its error and does not stop the
+ * others.
+ *
+ * @param template_name The template to insert.
+ * @param snippet_file The snippet source holding the template.
+ * @param anchor The line number, marker or regex selecting where the template goes in each target.
+ * @param variables Values for the template's ${name} placeholders.
+ * @param target_files The files to insert into.
+ * @param jobs Maximum number of files processed at once; 0 uses one per hardware thread.
+ * @return True if the template was applied to every target.
+ */
+
+bool apply_template(const std::string& template_name, const std::string& snippet_file, const InsertAnchor& anchor,
+const TemplateVariables& variables, const std::vector<std::string>& target_files, size_t jobs) {
+    std::vector<std::string> snippet_lines;
+    AnchorMatcher matcher;
+    if (!load_template_lines(snippet_file, template_name, snippet_lines, variables) ||
+        (anchor.kind != InsertAnchor::LINE && !matcher.compile(anchor))) {
+        return false;
+    }
+    if (target_files.empty()) {
+        std::cerr << "No target files given." << std::endl;
+        return false;
+    }
+
+    // Splice each target as a separate task, collecting its errors instead of interleaving them
+    std::vector<ApplyResult> results(target_files.size());
+    WorkStealingPool pool(jobs == 0 ? std::thread::hardware_concurrency() : jobs);
+    pool.run(target_files.size(), [&](size_t i) {
+        std::ostringstream errors;
+        command_error_output = &errors;
+        struct stat st;
+        if (stat(target_files[i].c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            errors << "Error opening target file: " << target_files[i] << std::endl;
+        } else if (anchor.kind == InsertAnchor::LINE) {
+            results[i].ok = file_overwrite(target_files[i], snippet_lines, anchor.line_number);
+        } else {
+            size_t matches = 0;
+            results[i].ok = file_splice_at_anchor(target_files[i], matcher, anchor.every_match, snippet_lines, matches) ==
+                            StoreStatus::OK;
+        }
+        command_error_output = nullptr;
+        results[i].error = errors.str();
+    });
+
+    // Report failures in the order the targets were given, then a summary
+    size_t applied = 0;
+    for (const ApplyResult& result : results) {
+        if (result.ok) {
+            applied++;
+        } else {
+            std::cerr << result.error;
+        }
+    }
+    std::cout << "Applied snippet '" << template_name << "' to " << applied << " of "
+              << target_files.size() << (target_files.size() == 1 ? " file." : " files.") << std::endl;
+    return applied == target_files.size();
+}
+
+/**
+ * @brief Extracts a range of lines from a source file and saves them as a new named template
+ *        in a snippet file, using a standard format with header and end markers.
+ *
+ * The function checks for errors such as missing files, invalid ranges, or duplicate template names.
+ * It appends the extracted content to the end of the snippet file, formatted with `#-- name:` and `#-- end` markers.
+ * The source is only read up to end_line, duplicates are found through the sidecar index, and the block
+ * is written with O_APPEND under an exclusive lock, so the cost does not grow with the library size.
+ *
+ * With dedupe, a body that is already stored under another name is not written again. An alias record
+ * that refers to it by hash is appended instead; see SnippetLog.
+ *
+ * @param source_file Path to the source file to extract lines from.
+ * @param start_line First line of the range to extract (1-based index).
+ * @param end_line Last line of the range to extract (inclusive).
+ * @param new_template_name Name of the new snippet template.
+ * @param snippet_file Path to the snippet file where the template will be stored.
+ * @param dedupe If true, store a body identical to an existing one as a reference to it.
+ * @param stored_as_alias Set to true if the body was stored as a reference.
+ * @return StoreStatus::OK, or the kind of error, which is reported to command_errors().
+ */
+
+StoreStatus extract(const std::string& source_file, int start_line, int end_line,
+const std::string& new_template_name, const std::string& snippet_file, bool dedupe, bool& stored_as_alias) {
+    std::vector<std::string> range_lines;
+    if (!read_line_range(source_file, start_line, end_line, range_lines)) {
+        return access(source_file.c_str(), R_OK) == 0 ? StoreStatus::INVALID_ARGUMENT : StoreStatus::IO_ERROR;
+    }
+
+    // Hold the writer lock of the snippet file until the block is appended and the indexes are updated
+    int writer_lock = lock_snippet_file(snippet_file);
+    if (writer_lock < 0) {
+        command_errors() << "Error opening snippet file: " << snippet_file << std::endl;
+        return StoreStatus::IO_ERROR;
+    }
+
+    // Map the snippet file for reading
+    MappedFile snippets;
+    if (!snippets.open(snippet_file)) {
+        command_errors() << "Error opening snippet file: " << snippet_file << std::endl;
+        ::close(writer_lock);
+        return StoreStatus::IO_ERROR;
+    }
+
+    if (is_snippet_pack(snippets.view())) {
+        command_errors() << "Snippet packs are read-only; edit the text source and recompile: " << snippet_file << std::endl;
+        ::close(writer_lock);
+        return StoreStatus::READ_ONLY;
+    }
+
+    // Check if the template already exists in the snippet file, through the sidecar index if possible
+    std::string_view existing;
+    if (find_template(snippet_file, snippets, new_template_name, existing)) {
+        command_errors() << "Template '" << new_template_name << "' already exists in snippet file." << std::endl;
+        ::close(writer_lock);
+        return StoreStatus::ALREADY_EXISTS;
+    }
+
+    // Load the search index while it still matches the snippet file, so it can be updated afterwards
+    uint64_t previous_size = 0;
+    int64_t previous_mtime_ns = 0;
+    file_stamp(snippet_file, previous_size, previous_mtime_ns);
+    SearchIndex search_index;
+    bool has_search_index = load_search_index(snippet_file, search_index);
+
+    // Hash the body, and when deduplicating, look for an identical body through the index
+    std::string body;
+    for (int i = 0; i < (int)range_lines.size(); ++i) {
+        body += range_lines[i];
+        body += '\n';
+    }
+    IndexEntry entry;
+    entry.length = body.size();
+    entry.line_count = range_lines.size();
+    entry.hash = hash_body(body.data(), body.size());
+    IndexUpdate index_update;
+    bool has_index = index_update.open(snippet_file, previous_size, previous_mtime_ns);
+    IndexEntry stored;
+    bool is_alias = dedupe && has_index && index_update.find_body(entry.hash, stored) &&
+                    stored.length == body.size() && stored.offset + stored.length <= snippets.size() &&
+                    std::memcmp(snippets.data() + stored.offset, body.data(), body.size()) == 0;
+
+    // Build the block, or an alias record for a stored body, separated from existing content by an empty line
+    std::string block;
+    if (snippets.size() > 0) {
+        block += snippets.data()[snippets.size() - 1] == '\n' ? "\n" : "\n\n";
+    }
+    size_t header_start = block.size();
+    if (is_alias) {
+        block += ALIAS_PREFIX + new_template_name + '\n' + ALIAS_BODY_PREFIX + body_hash_hex(entry.hash) + '\n';
+        entry.offset = stored.offset;
+    } else {
+        block += NAME_PREFIX + new_template_name + '\n';
+        entry.offset = previous_size + block.size();
+        block += body;
+        block += END_MARKER + '\n';
+    }
+    snippets.close();
+
+    // Append the block to the end of the snippet file without rewriting it
+    if (!append_to_snippet_file(snippet_file, block, previous_size)) {
+        ::close(writer_lock);
+        return StoreStatus::IO_ERROR;
+    }
+
+    // Extend the name index and the search index with the new template
+    if (has_index) {
+        index_update.put(new_template_name, entry);
+        if (is_alias) {
+            index_update.add_alias();
+        }
+        index_update.commit(snippet_file);
+    }
+    if (has_search_index) {
+        search_index_after_extract(snippet_file, search_index, new_template_name, previous_size + header_start,
+                                   entry.offset, body);
+    }
+    ::close(writer_lock);
+    stored_as_alias = is_alias;
+    return StoreStatus::OK;
+}
+
+/**
+ * @brief Lists all template names stored in the given snippet file.
+ *
+ * Searches for lines starting with "#-- name: " and prints the name of each template.
+ * If no templates are found, prints a message indicating so.
+ *
+ * @param snippet_file Path to the snippet file to read from.
+ * @return False if the snippet file, or a file of a collection, could not be read.
+ */
+
+bool list_templates(std::string& snippet_file) {
+    // A single snippet file or pack is served by a store
+    if (!is_snippet_collection(snippet_file)) {
+        SnippetStore store;
+        std::vector<std::string_view> names;
+        StoreResult result = store.open(snippet_file);
+        if (result) {
+            result = store.names(names);
+        }
+        if (!report(result)) {
+            return false;
+        }
+        PhaseTimer timer(PHASE_WRITE);
+        for (std::string_view name : names) {
+            std::cout.write(name.data(), name.size());
+            std::cout.put('\n');
+        }
+        if (names.empty()) {
+            std::cout << "No templates found in " << snippet_file << "." << std::endl;
+        }
+        std::cout.flush();
+        return true;
+    }
+
+    std::vector<std::string> snippet_files;
+    if (!expand_snippet_source(snippet_file, snippet_files)) {
+        std::cerr << "No snippet files found for: " << snippet_file << std::endl;
+        return false;
+    }
+
+    // Collect the template names of each file as a separate task
+    std::vector<std::vector<std::string_view>> names(snippet_files.size());
+    std::vector<MappedFile> mappings(snippet_files.size());
+    std::vector<char> opened(snippet_files.size(), 0);
+    WorkStealingPool pool;
+    pool.run(snippet_files.size(), [&](size_t i) {
+        if (!mappings[i].open(snippet_files[i])) {
+            return;
+        }
+        opened[i] = 1;
+        PhaseTimer timer(PHASE_LOOKUP);
+        SnippetPack pack;
+        if (pack.open(mappings[i])) {
+            PackRecord record;
+            for (size_t position = 0; position < pack.size(); ++position) {
+                if (pack.record(pack.ordered(position), record)) {
+                    names[i].push_back(pack.name(record));
+                }
+            }
+            return;
+        }
+
+        SnippetLog log(mappings[i].view());
+        for (const ResolvedTemplate& resolved : log.templates()) {
+            if (resolved.live) {
+                names[i].push_back(resolved.name);
+            }
+        }
+    });
+
+    // Print the names in file order; a name already listed, by this file or an earlier one, is shadowed
+    PhaseTimer timer(PHASE_WRITE);
+    std::set<std::string_view> listed;
+    bool found = false;
+    bool all_opened = true;
+    for (size_t i = 0; i < snippet_files.size(); ++i) {
+        if (!opened[i]) {
+            std::cerr << "Error opening snippet file: " << snippet_files[i] << std::endl;
+            all_opened = false;
+            continue;
+        }
+        for (const std::string_view& name : names[i]) {
+            if (!listed.insert(name).second) {
+                continue;
+            }
+            found = true;
+            std::cout.write(name.data(), name.size());
+            std::cout.put('\n');
+        }
+    }
+
+    // If no template markers were found, print a message
+    if (!found && (snippet_files.size() > 1 || opened[0])) {
+        std::cout << "No templates found in " << snippet_file << "." << std::endl;
+    }
+    std::cout.flush();
+    return all_opened;
+}
+
+/**
+ * @brief Displays the contents of a specific template from a snippet file.
+ *
+ * Searches for the specified template name in the snippet file and prints its
+ * entire content, including the `#-- name:` header and all lines up to (but not including)
+ * the `#-- end` marker. If the template does not exist, an error message is shown.
+ *
+ * @param template_name The name of the template to display.
+ * @param snippet_file Path to the snippet file containing the templates.
+ * @return True if the template was found and printed.
+ */
+
+bool show(std::string& template_name, std::string& snippet_file) {
+    // Resolve the name across every file of a directory or glob
+    if (is_snippet_collection(snippet_file)) {
+        std::string body;
+        if (!find_in_collection(snippet_file, template_name, body)) {
+            return false;
+        }
+        std::cout << NAME_PREFIX << template_name << '\n' << body;
+        if (!body.empty() && body.back() != '\n') {
+            std::cout.put('\n');
+        }
+        std::cout.flush();
+        return true;
+    }
+
+    // Look up the template by name through a store
+    SnippetStore store;
+    std::string_view body;
+    StoreResult result = store.open(snippet_file);
+    if (result) {
+        result = store.lookup(template_name, body);
+    }
+    if (!report(result)) {
+        return false;
+    }
+
+    // Print the header line followed by the template body, written directly from the mapping
+    PhaseTimer timer(PHASE_WRITE);
+    std::cout << NAME_PREFIX << template_name << '\n';
+    std::cout.write(body.data(), body.size());
+    if (!body.empty() && body.back() != '\n') {
+        std::cout.put('\n');
+    }
+    std::cout.flush();
+    return true;
+}
+
+// The live templates of a snippet file or pack, as views into its mapping
+struct SnippetFileTemplates {
+    MappedFile mapping;
+    std::vector<StoredTemplate> templates;  // In file order, including later definitions of a name
+    bool opened = false;
+    bool corrupt = false;  // A pack record failed its checks
+};
+
+// Maps and parses snippet files in parallel, one task per file
+void load_snippet_files(const std::vector<std::string>& snippet_files, std::vector<SnippetFileTemplates>& files) {
+    WorkStealingPool pool;
+    pool.run(snippet_files.size(), [&](size_t i) {
+        SnippetFileTemplates& file = files[i];
+        if (!file.mapping.open(snippet_files[i])) {
+            return;
+        }
+        file.opened = true;
+        PhaseTimer timer(PHASE_LOOKUP);
+        SnippetPack pack;
+        if (pack.open(file.mapping)) {
+            PackRecord record;
+            for (size_t position = 0; position < pack.size(); ++position) {
+                if (!pack.record(pack.ordered(position), record) || !pack.verify(record)) {
+                    file.corrupt = true;
+                    return;
+                }
+                file.templates.push_back(StoredTemplate{pack.name(record), pack.body(record)});
+            }
+            return;
+        }
+
+        SnippetLog log(file.mapping.view());
+        for (const ResolvedTemplate& resolved : log.templates()) {
+            if (resolved.live) {
+                file.templates.push_back(StoredTemplate{resolved.name, resolved.tmpl.body});
+            }
+        }
+    });
+}
+
+// Prints why a snippet file could not be loaded; returns true if it was
+bool report_snippet_file(const std::string& snippet_file, const SnippetFileTemplates& file) {
+    if (!file.opened || file.corrupt) {
+        std::cerr << (file.opened ? "Snippet pack is corrupt: " : "Error opening snippet file: ") << snippet_file
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// How export writes templates: as snippet blocks, as one JSON object per line, or as NUL-terminated
+// name and body fields
+enum class ExportFormat { TEXT, JSON_LINES, NUL_DELIMITED };
+
+// Appends text to a buffer as the contents of a JSON string, escaping quotes, backslashes and control bytes
+void append_json_string(std::string& output, std::string_view text) {
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+    size_t start = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+        unsigned char c = (unsigned char)text[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        output.append(text.data() + start, i - start);
+        start = i + 1;
+        if (c == '"' || c == '\\') {
+            output += '\\';
+            output += (char)c;
+        } else if (c == '\n') {
+            output += "\\n";
+        } else if (c == '\t') {
+            output += "\\t";
+        } else if (c == '\r') {
+            output += "\\r";
+        } else {
+            output += "\\u00";
+            output += HEX_DIGITS[c >> 4];
+            output += HEX_DIGITS[c & 15];
+        }
+    }
+    output.append(text.data() + start, text.size() - start);
+}
+
+// Appends one exported template to the output buffer in the given format
+void append_exported_template(std::string& output, ExportFormat format, std::string_view name, std::string_view body,
+                              bool first) {
+    if (format == ExportFormat::JSON_LINES) {
+        output += "{\"name\":\"";
+        append_json_string(output, name);
+        output += "\",\"body\":\"";
+        append_json_string(output, body);
+        output += "\"}\n";
+    } else if (format == ExportFormat::NUL_DELIMITED) {
+        output.append(name.data(), name.size());
+        output += '\0';
+        output.append(body.data(), body.size());
+        output += '\0';
+    } else {
+        // Blocks are separated by an empty line, so the output is itself a snippet file
+        if (!first) {
+            output += '\n';
+        }
+        output += NAME_PREFIX;
+        output.append(name.data(), name.size());
+        output += '\n';
+        output.append(body.data(), body.size());
+        if (!body.empty() && body.back() != '\n') {
+            output += '\n';
+        }
+        output += END_MARKER;
+        output += '\n';
+    }
+}
+
+/**
+ * @brief Writes many templates of a snippet source in one pass.
+ *
+ * Every snippet file (or pack) of the source is mapped and parsed once, whatever the number of templates
+ * requested; the files of a directory or glob are parsed in parallel. The selected templates are then
+ * written in file order, as show would resolve them: the first live definition of each name, and for a
+ * collection the file whose path sorts first. All output goes through one buffer that is written out in
+ * large blocks, so the cost per template is the copying of its text.
+ *
+ * @param snippet_source Path to the snippet file, pack, directory or glob.
+ * @param selectors Template names, or glob patterns (containing '*', '?' or '[') matched against names.
+ * @param names_file Path of a file with one more selector per line, "-" for standard input, or empty.
+ * @param all If true, every template is written and the selectors are ignored.
+ * @param format The output format.
+ * @param output_file Path to write to, or empty for standard output.
+ * @return False, after printing an error, if a file cannot be read, a selector matches nothing or a write fails.
+ */
+
+bool export_templates(const std::string& snippet_source, std::vector<std::string> selectors,
+                      const std::string& names_file, bool all, ExportFormat format, const std::string& output_file) {
+    // Read one more selector per line from the names file
+    if (!names_file.empty()) {
+        std::ifstream names_input;
+        if (names_file != "-") {
+            names_input.open(names_file);
+            if (!names_input.is_open()) {
+                std::cerr << "Error opening names file: " << names_file << std::endl;
+                return false;
+            }
+        }
+        std::istream& input = names_file == "-" ? std::cin : names_input;
+        std::string line;
+        while (std::getline(input, line)) {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (!line.empty()) {
+                selectors.push_back(line);
+            }
+        }
+    }
+
+    // Exact names are found with one hash probe per template; patterns are tried in turn
+    std::unordered_map<std::string_view, bool> names;
+    std::vector<std::pair<std::string, bool>> patterns;
+    for (const std::string& selector : selectors) {
+        if (selector.find_first_of("*?[") != std::string::npos) {
+            patterns.emplace_back(selector, false);
+        } else {
+            names.emplace(selector, false);
+        }
+    }
+
+    std::vector<std::string> snippet_files;
+    if (!is_snippet_collection(snippet_source)) {
+        snippet_files.push_back(snippet_source);
+    } else if (!expand_snippet_source(snippet_source, snippet_files)) {
+        std::cerr << "No snippet files found for: " << snippet_source << std::endl;
+        return false;
+    }
+
+    std::vector<SnippetFileTemplates> files(snippet_files.size());
+    load_snippet_files(snippet_files, files);
+
+    int output_fd = output_file.empty() ? STDOUT_FILENO
+                                        : ::open(output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
+        std::cerr << "Error writing to target file: " << output_file << std::endl;
+        return false;
+    }
+
+    // Write the selected templates in file order; a name already written is shadowed
+    std::string output;
+    output.reserve(2 * COPY_BLOCK_SIZE);
+    std::unordered_map<std::string_view, bool> exported;
+    size_t template_count = 0;
+    for (const SnippetFileTemplates& file : files) {
+        template_count += file.templates.size();
+    }
+    exported.reserve(all ? template_count : names.size() + patterns.size());
+    bool ok = true;
+    bool written = true;
+    for (size_t i = 0; i < snippet_files.size() && written; ++i) {
+        if (!report_snippet_file(snippet_files[i], files[i])) {
+            ok = false;
+            continue;
+        }
+        for (const StoredTemplate& stored : files[i].templates) {
+            bool selected = all;
+            auto name = names.find(stored.name);
+            if (name != names.end()) {
+                name->second = selected = true;
+            }
+            if (!patterns.empty()) {
+                std::string name_text(stored.name);
+                for (std::pair<std::string, bool>& pattern : patterns) {
+                    if (fnmatch(pattern.first.c_str(), name_text.c_str(), 0) == 0) {
+                        pattern.second = selected = true;
+                    }
+                }
+            }
+            if (!selected || !exported.emplace(stored.name, true).second) {
+                continue;
+            }
+
+            append_exported_template(output, format, stored.name, stored.body, exported.size() == 1);
+            if (output.size() >= COPY_BLOCK_SIZE) {
+                written = write_all(output_fd, output.data(), output.size());
+                output.clear();
+            }
+        }
+    }
+
+    written = written && write_all(output_fd, output.data(), output.size());
+    if (output_fd != STDOUT_FILENO && ::close(output_fd) != 0) {
+        written = false;
+    }
+    if (!written) {
+        std::cerr << "Error writing to target file: " << (output_file.empty() ? "standard output" : output_file)
+                  << std::endl;
+        return false;
+    }
+
+    // Report the names and patterns that selected nothing
+    if (!all) {
+        for (const std::string& selector : selectors) {
+            auto name = names.find(selector);
+            bool found = name != names.end() ? name->second
+                                             : std::find(patterns.begin(), patterns.end(),
+                                                         std::make_pair(selector, true)) != patterns.end();
+            if (!found) {
+                std::cerr << "Template '" << selector << "' not found in snippet file." << std::endl;
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+// How merge resolves a name defined by more than one input
+enum class MergePolicy { KEEP_FIRST, KEEP_LAST, RENAME, FAIL };
+
+// A template chosen for the merged library
+struct MergeEntry {
+    size_t file;            // Input file holding the template
+    size_t index;           // Position among the file's templates
+    std::string_view name;  // Name to write it under
+};
+
+/**
+ * @brief Merges snippet libraries into one, resolving repeated names by a policy.
+ *
+ * Every input is mapped and parsed once, in parallel, and contributes its templates as show resolves
+ * them: the first live definition of each name. When a later input defines a name again, the policy
+ * decides: KEEP_FIRST keeps the earlier template, KEEP_LAST the later one, RENAME keeps both and writes
+ * the later one as "<name>_2" (or the next free suffix), and FAIL writes nothing and lists every
+ * repeated name. The surviving templates are written in input order in one sequential pass through a
+ * fixed-size buffer, so bodies are never copied into memory and the work is linear in the total size
+ * of the inputs. The output is replaced atomically under its writer lock, so it may also be an input.
+ *
+ * @param output_file Path of the library to write.
+ * @param inputs Snippet files, packs, directories or globs, in priority order.
+ * @param policy How to resolve repeated names.
+ * @return False, after printing an error, if an input cannot be read, a name conflicts under FAIL, or
+ *         the output cannot be written.
+ */
+
+bool merge_libraries(const std::string& output_file, const std::vector<std::string>& inputs, MergePolicy policy) {
+    // Take the output's writer lock first, in case it is one of the inputs
+    int writer_lock = -1;
+    if (access(output_file.c_str(), F_OK) == 0 && (writer_lock = lock_snippet_file(output_file)) < 0) {
+        std::cerr << "Error writing to target file: " << output_file << std::endl;
+        return false;
+    }
+
+    std::vector<std::string> snippet_files;
+    for (const std::string& input : inputs) {
+        if (!is_snippet_collection(input)) {
+            snippet_files.push_back(input);
+        } else if (!expand_snippet_source(input, snippet_files)) {
+            std::cerr << "No snippet files found for: " << input << std::endl;
+            if (writer_lock >= 0) {
+                ::close(writer_lock);
+            }
+            return false;
+        }
+    }
+    std::vector<SnippetFileTemplates> files(snippet_files.size());
+    load_snippet_files(snippet_files, files);
+    bool loaded = true;
+    for (size_t i = 0; i < snippet_files.size(); ++i) {
+        loaded = report_snippet_file(snippet_files[i], files[i]) && loaded;
+    }
+    if (!loaded) {
+        if (writer_lock >= 0) {
+            ::close(writer_lock);
+        }
+        return false;
+    }
+
+    // Give every name one owner; a later definition in the same file is shadowed, one in another file conflicts
+    struct Owner {
+        size_t entry;      // Position of the name's template in entries
+        size_t last_file;  // Last input that defined the name
+    };
+    std::vector<MergeEntry> entries;
+    std::vector<MergeEntry> conflicts;
+    std::unordered_map<std::string_view, Owner> owners;
+    size_t template_count = 0;
+    for (const SnippetFileTemplates& file : files) {
+        template_count += file.templates.size();
+    }
+    owners.reserve(template_count);
+    {
+        PhaseTimer timer(PHASE_SPLICE);
+        for (size_t i = 0; i < files.size(); ++i) {
+            for (size_t j = 0; j < files[i].templates.size(); ++j) {
+                std::string_view name = files[i].templates[j].name;
+                auto found = owners.find(name);
+                if (found == owners.end()) {
+                    owners.emplace(name, Owner{entries.size(), i});
+                    entries.push_back(MergeEntry{i, j, name});
+                    continue;
+                }
+                if (found->second.last_file == i) {
+                    continue;
+                }
+                found->second.last_file = i;
+                conflicts.push_back(MergeEntry{i, j, name});
+                if (policy == MergePolicy::KEEP_LAST) {
+                    entries[found->second.entry] = MergeEntry{i, j, name};
+                }
+            }
+        }
+    }
+
+    if (policy == MergePolicy::FAIL && !conflicts.empty()) {
+        for (const MergeEntry& conflict : conflicts) {
+            std::cerr << "Template '" << conflict.name << "' is defined in both "
+                      << snippet_files[entries[owners[conflict.name].entry].file] << " and "
+                      << snippet_files[conflict.file] << "." << std::endl;
+        }
+        std::cerr << "Merge failed with " << conflicts.size() << " name conflicts; " << output_file
+                  << " was not changed." << std::endl;
+        if (writer_lock >= 0) {
+            ::close(writer_lock);
+        }
+        return false;
+    }
+
+    // Give each later definition the first free "<name>_<n>" name, then restore input order
+    std::deque<std::string> new_names;
+    if (policy == MergePolicy::RENAME) {
+        for (const MergeEntry& conflict : conflicts) {
+            std::string new_name;
+            for (int suffix = 2; new_name.empty() || owners.count(new_name); ++suffix) {
+                new_name = std::string(conflict.name) + "_" + std::to_string(suffix);
+            }
+            new_names.push_back(new_name);
+            owners.emplace(new_names.back(), Owner{entries.size(), conflict.file});
+            entries.push_back(MergeEntry{conflict.file, conflict.index, new_names.back()});
+        }
+    }
+    std::sort(entries.begin(), entries.end(), [](const MergeEntry& a, const MergeEntry& b) {
+        return a.file != b.file ? a.file < b.file : a.index < b.index;
+    });
+
+    // Write the chosen templates in one pass, flushing the buffer as it fills
+    std::string temp_file = temp_path(resolve_target(output_file));
+    int output_fd = ::open(temp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool written = output_fd >= 0;
+    std::string output;
+    output.reserve(2 * COPY_BLOCK_SIZE);
+    for (size_t e = 0; e < entries.size() && written; ++e) {
+        const StoredTemplate& stored = files[entries[e].file].templates[entries[e].index];
+        append_exported_template(output, ExportFormat::TEXT, entries[e].name, stored.body, e == 0);
+        if (output.size() >= COPY_BLOCK_SIZE || e + 1 == entries.size()) {
+            written = write_all(output_fd, output.data(), output.size());
+            output.clear();
+        }
+    }
+    if (output_fd >= 0 && ::close(output_fd) != 0) {
+        written = false;
+    }
+    if (!written || !replace_with_temp_file(temp_file, output_file)) {
+        std::cerr << "Error writing to target file: " << output_file << std::endl;
+        if (!written) {
+            std::remove(temp_file.c_str());
+        }
+        if (writer_lock >= 0) {
+            ::close(writer_lock);
+        }
+        return false;
+    }
+    if (writer_lock >= 0) {
+        ::close(writer_lock);
+    }
+
+    static const char* const POLICY_NAMES[] = {"keep-first", "keep-last", "rename", "fail"};
+    std::cout << "Merged " << entries.size() << " templates from " << snippet_files.size() << " files into "
+              << output_file;
+    if (!conflicts.empty()) {
+        std::cout << " (" << conflicts.size() << " name conflicts resolved by " << POLICY_NAMES[(int)policy] << ")";
+    }
+    std::cout << "." << std::endl;
+    return true;
+}
+
+/**
+ * @brief Deletes a specified template from a snippet file.
+ *
+ * Scans the snippet file for a template with the given name and removes its entire content,
+ * including the `#-- name:` header and `#-- end` marker. All other lines are preserved.
+ * If the template is not found, an error message is displayed. The file is then overwritten
+ * with the remaining content.
+ *
+ * In log-structured mode the file is not rewritten; a `#-- delete:` record is appended instead and
+ * the sidecar index is updated in place. Once dead blocks and records take up more than
+ * AUTO_COMPACT_DEAD_RATIO of the file, it is compacted.
  *
  * @param template_name The name of the template to delete.
  * @param snippet_file Path to the snippet file to update.
+ * @param log_structured If true, append a delete record instead of rewriting the file.
+ * @return StoreStatus::OK, or the kind of error, which is reported to command_errors().
+ */
+
+StoreStatus delete_template(const std::string& template_name, const std::string& snippet_file, bool log_structured) {
+    // Take the writer lock so that no concurrent change is lost while the file is updated
+    int writer_lock = lock_snippet_file(snippet_file);
+    if (writer_lock < 0) {
+        command_errors() << "Error opening snippet file: " << snippet_file << std::endl;
+        return StoreStatus::IO_ERROR;
+    }
+
+    // Map the snippet file for reading
+    MappedFile snippets;
+    if (!snippets.open(snippet_file)) {
+        command_errors() << "Error opening snippet file: " << snippet_file << std::endl;
+        ::close(writer_lock);
+        return StoreStatus::IO_ERROR;
+    }
+
+    if (is_snippet_pack(snippets.view())) {
+        command_errors() << "Snippet packs are read-only; edit the text source and recompile: " << snippet_file << std::endl;
+        ::close(writer_lock);
+        return StoreStatus::READ_ONLY;
+    }
+
+    // Fail fast through the sidecar index when the template does not exist
+    std::string_view body;
+    if (!find_template(snippet_file, snippets, template_name, body)) {
+        command_errors() << "Template '" << template_name << "' not found in snippet file." << std::endl;
+        ::close(writer_lock);
+        return StoreStatus::NOT_FOUND;
+    }
+
+    uint64_t previous_size = 0;
+    int64_t previous_mtime_ns = 0;
+    file_stamp(snippet_file, previous_size, previous_mtime_ns);
+    SearchIndex search_index;
+    bool has_search_index = load_search_index(snippet_file, search_index);
+
+    if (log_structured) {
+        // Append a delete record and drop the name from the index
+        std::string record = snippets.data()[snippets.size() - 1] == '\n' ? "" : "\n";
+        record += DELETE_PREFIX + template_name + '\n';
+
+        // The record kills every block, and every alias record, that answers for the name
+        SnippetLog log(snippets.view());
+        uint64_t freed = record.size();
+        for (const ResolvedTemplate& resolved : log.templates()) {
+            if (resolved.live && resolved.name == template_name) {
+                freed += resolved.tmpl.end_offset - resolved.tmpl.header_offset;
+            }
+        }
+        if (!append_to_snippet_file(snippet_file, record, previous_size)) {
+            ::close(writer_lock);
+            return StoreStatus::IO_ERROR;
+        }
+
+        IndexUpdate index_update;
+        bool compact = false;
+        if (index_update.open(snippet_file, previous_size, previous_mtime_ns)) {
+            index_update.remove(template_name);
+            index_update.add_dead_bytes(freed);
+            compact = index_update.commit(snippet_file) &&
+                      index_update.dead_bytes() > AUTO_COMPACT_DEAD_RATIO * (previous_size + record.size());
+        }
+
+        // Compact once too much of the file is dead; the search index is then rebuilt by the next search
+        if (compact) {
+            snippets.close();
+            MappedFile appended;
+            if (appended.open(snippet_file)) {
+                compact_snippet_file(snippet_file, SnippetLog(appended.view()));
+            }
+        } else if (has_search_index) {
+            search_index_after_delete(snippet_file, search_index, template_name, true);
+        }
+    } else {
+        // Overwrite the snippet file with the remaining content
+        SnippetLog log(snippets.view());
+        std::deque<std::string> headers;
+        if (!write_file_pieces(snippet_file, delete_pieces(log, template_name, headers))) {
+            command_errors() << "Error writing to target file: " << snippet_file << std::endl;
+            ::close(writer_lock);
+            return StoreStatus::IO_ERROR;
+        }
+        if (has_search_index && log.records().empty()) {
+            search_index_after_delete(snippet_file, search_index, template_name, false);
+        }
+    }
+    ::close(writer_lock);
+    return StoreStatus::OK;
+}
+
+/**
+ * @brief Renames a template within a snippet file.
+ *
+ * Searches for a template with the specified old name in the snippet file and replaces
+ * its `#-- name:` header with a new name. The rest of the template's content remains unchanged.
+ * If the original template name is not found, an error message is displayed. The file is then
+ * overwritten with the updated lines.
+ *
+ * In log-structured mode the file is not rewritten; a `#-- rename:` record is appended instead and
+ * the sidecar index is updated in place.
+ *
+ * @param old_template_name The current name of the template to rename.
+ * @param new_template_name The new name to assign to the template.
+ * @param snippet_file Path to the snippet file containing the template.
+ * @param log_structured If true, append a rename record instead of rewriting the file.
+ * @return StoreStatus::OK, or the kind of error, which is reported to command_errors().
+ */
+
+StoreStatus rename_template(const std::string& old_template_name, const std::string& new_template_name,
+const std::string& snippet_file, bool log_structured) {
+    // Take the writer lock so that no concurrent change is lost while the file is updated
+    int writer_lock = lock_snippet_file(snippet_file);
+    if (writer_lock < 0) {
+        command_errors() << "Error opening snippet file: " << snippet_file << std::endl;
+        return StoreStatus::IO_ERROR;
+    }
+
+    // Map the snippet file for reading
+    MappedFile snippets;
+    if (!snippets.open(snippet_file)) {
+        command_errors() << "Error opening snippet file: " << snippet_file << std::endl;
+        ::close(writer_lock);
+        return StoreStatus::IO_ERROR;
+    }
+
+    if (is_snippet_pack(snippets.view())) {
+        command_errors() << "Snippet packs are read-only; edit the text source and recompile: " << snippet_file << std::endl;
+        ::close(writer_lock);
+        return StoreStatus::READ_ONLY;
+    }
+
+    // Fail fast through the sidecar index when the template does not exist
+    std::string_view body;
+    if (!find_template(snippet_file, snippets, old_template_name, body)) {
+        command_errors() << "Template '" << old_template_name << "' not found in snippet file." << std::endl;
+        ::close(writer_lock);
+        return StoreStatus::NOT_FOUND;
+    }
+
+    uint64_t previous_size = 0;
+    int64_t previous_mtime_ns = 0;
+    file_stamp(snippet_file, previous_size, previous_mtime_ns);
+    SearchIndex search_index;
+    bool has_search_index = load_search_index(snippet_file, search_index);
+
+    if (log_structured) {
+        // Append a rename record
+        std::string record = snippets.data()[snippets.size() - 1] == '\n' ? "" : "\n";
+        record += RENAME_PREFIX + old_template_name + '\n' + RENAME_TO_PREFIX + new_template_name + '\n';
+        if (!append_to_snippet_file(snippet_file, record, previous_size)) {
+            ::close(writer_lock);
+            return StoreStatus::IO_ERROR;
+        }
+
+        // The renamed body now answers for the new name, unless an earlier block already has that name.
+        // An alias's entry points at a body stored before it, so once there are aliases, body offsets
+        // no longer order two names; a rename onto an existing name then leaves the index to a rebuild.
+        IndexUpdate index_update;
+        if (index_update.open(snippet_file, previous_size, previous_mtime_ns)) {
+            IndexEntry old_entry, new_entry;
+            bool found = index_update.find(old_template_name, old_entry);
+            bool exists = index_update.find(new_template_name, new_entry);
+            bool shadowed = exists && new_entry.offset < old_entry.offset;
+            if (found && !(exists && index_update.alias_count() > 0)) {
+                index_update.remove(old_template_name);
+                if (!shadowed) {
+                    index_update.put(new_template_name, old_entry);
+                }
+                index_update.add_dead_bytes(record.size());
+                index_update.commit(snippet_file);
+            }
+        }
+        if (has_search_index) {
+            search_index_after_rename(snippet_file, search_index, old_template_name, new_template_name, true);
+        }
+    } else {
+        // Overwrite the snippet file with the modified content
+        const std::string new_header = NAME_PREFIX + new_template_name;
+        SnippetLog log(snippets.view());
+        std::deque<std::string> headers;
+        if (!write_file_pieces(snippet_file, rename_pieces(log, old_template_name, new_header, headers))) {
+            command_errors() << "Error writing to target file: " << snippet_file << std::endl;
+            ::close(writer_lock);
+            return StoreStatus::IO_ERROR;
+        }
+        if (has_search_index && log.records().empty()) {
+            search_index_after_rename(snippet_file, search_index, old_template_name, new_template_name, false);
+        }
+    }
+    ::close(writer_lock);
+    return StoreStatus::OK;
+}
+
+/**
+ * @brief Rewrites a snippet file without the delete and rename records of log-structured edits.
+ *
+ * Blocks removed by delete records are dropped, renamed blocks get their new header lines, and the
+ * records themselves are removed, in one streaming pass. The new file is swapped in atomically.
+ *
+ * @param snippet_file Path to the snippet file to compact.
+ * @return True if the file is compact afterwards.
+ */
+
+bool compact(const std::string& snippet_file) {
+    int writer_lock = lock_snippet_file(snippet_file);
+    MappedFile snippets;
+    if (writer_lock < 0 || !snippets.open(snippet_file)) {
+        std::cerr << "Error opening snippet file: " << snippet_file << std::endl;
+        if (writer_lock >= 0) {
+            ::close(writer_lock);
+        }
+        return false;
+    }
+
+    if (is_snippet_pack(snippets.view())) {
+        std::cerr << "Snippet packs are read-only; edit the text source and recompile: " << snippet_file << std::endl;
+        ::close(writer_lock);
+        return false;
+    }
+
+    SnippetLog log(snippets.view());
+    if (log.dead_bytes() == 0) {
+        std::cout << "Nothing to compact in " << snippet_file << "." << std::endl;
+        ::close(writer_lock);
+        return true;
+    }
+
+    // Live aliases are kept; every other record is removed
+    size_t removed_records = log.records().size();
+    for (const ResolvedTemplate& resolved : log.templates()) {
+        removed_records -= resolved.is_alias && resolved.live ? 1 : 0;
+    }
+
+    bool ok = compact_snippet_file(snippet_file, log);
+    ::close(writer_lock);
+    if (ok) {
+        std::cout << "Compacted " << snippet_file << ", removing " << removed_records << " records and "
+                  << log.dead_bytes() << " bytes." << std::endl;
+    }
+    return ok;
+}
+
+/**
+ * @brief Rewrites a snippet file so that every distinct template body is stored only once.
+ *
+ * The file is rewritten in one streaming pass under the snippet file lock. The first live block with
+ * each body is kept. Every later live block or alias with an identical body becomes an alias record
+ * that refers to it by hash. Dead blocks and delete and rename records are dropped, as compact() drops
+ * them. Bodies with equal hashes are compared byte for byte, so a hash collision only costs a second
+ * copy. The new file is swapped in atomically and the sidecar index is rebuilt.
+ *
+ * @param snippet_file Path to the snippet file to deduplicate.
+ * @return True if the file is deduplicated afterwards.
+ */
+
+bool dedupe(const std::string& snippet_file) {
+    int writer_lock = lock_snippet_file(snippet_file);
+    MappedFile snippets;
+    if (writer_lock < 0 || !snippets.open(snippet_file)) {
+        std::cerr << "Error opening snippet file: " << snippet_file << std::endl;
+        if (writer_lock >= 0) {
+            ::close(writer_lock);
+        }
+        return false;
+    }
+
+    if (is_snippet_pack(snippets.view())) {
+        std::cerr << "Snippet packs are read-only; edit the text source and recompile: " << snippet_file << std::endl;
+        ::close(writer_lock);
+        return false;
+    }
+
+    PhaseTimer timer(PHASE_SPLICE);
+    SnippetLog log(snippets.view());
+    std::string_view data = log.data();
+    std::vector<std::string_view> pieces;
+    std::deque<std::string> headers;
+    size_t kept_from = 0;
+
+    // Replaces the bytes from kept_from up to a cut, keeping what precedes it
+    auto cut = [&](size_t from, size_t to, std::string_view replacement) {
+        pieces.push_back(data.substr(kept_from, from - kept_from));
+        if (!replacement.empty()) {
+            pieces.push_back(replacement);
+        }
+        kept_from = to;
+    };
+
+    // Walk the blocks and aliases in file order, keeping the first copy of every body
+    std::unordered_map<uint64_t, std::string_view> stored_bodies;
+    const std::vector<LogRecord>& records = log.records();
+    size_t record = 0;
+    uint64_t template_count = 0, duplicates = 0;
+    for (const ResolvedTemplate& resolved : log.templates()) {
+        const TemplateView& tmpl = resolved.tmpl;
+        for (; record < records.size() && records[record].offset < tmpl.header_offset; ++record) {
+            cut(records[record].offset, records[record].end_offset, std::string_view());
+        }
+        record += resolved.is_alias ? 1 : 0;
+        if (!resolved.live) {
+            cut(tmpl.header_offset, tmpl.end_offset, std::string_view());
+            continue;
+        }
+        template_count++;
+
+        uint64_t hash = hash_body(tmpl.body.data(), tmpl.body.size());
+        auto stored = stored_bodies.emplace(hash, tmpl.body);
+        if (stored.second) {
+            // The first copy of a body, written out as a block under its current name
+            if (resolved.is_alias || resolved.name.data() != tmpl.name.data()) {
+                cut(tmpl.header_offset, tmpl.end_offset, std::string_view());
+                push_block_pieces(pieces, headers, resolved.name, tmpl.body);
+            }
+        } else if (stored.first->second == tmpl.body) {
+            // Refer to the stored copy, keeping an alias that already does
+            if (resolved.is_alias && resolved.name.data() == tmpl.name.data()) {
+                continue;
+            }
+            std::string alias = ALIAS_PREFIX + std::string(resolved.name) + '\n' + ALIAS_BODY_PREFIX +
+                                body_hash_hex(hash) + '\n';
+            if (!resolved.is_alias && alias.size() >= tmpl.end_offset - tmpl.header_offset) {
+                // The block is no longer than an alias to it would be, so keep the copy
+                if (resolved.name.data() != tmpl.name.data()) {
+                    cut(tmpl.header_offset, tmpl.end_offset, std::string_view());
+                    push_block_pieces(pieces, headers, resolved.name, tmpl.body);
+                }
+                continue;
+            }
+            headers.push_back(std::move(alias));
+            cut(tmpl.header_offset, tmpl.end_offset, headers.back());
+            duplicates += resolved.is_alias ? 0 : 1;
+        } else {
+            // A different body with the same hash, which aliases cannot refer to; store a full copy
+            cut(tmpl.header_offset, tmpl.end_offset, std::string_view());
+            push_block_pieces(pieces, headers, resolved.name, tmpl.body);
+        }
+    }
+    for (; record < records.size(); ++record) {
+        cut(records[record].offset, records[record].end_offset, std::string_view());
+    }
+    pieces.push_back(data.substr(kept_from));
+
+    if (duplicates == 0 && log.dead_bytes() == 0) {
+        std::cout << "Nothing to deduplicate in " << snippet_file << "." << std::endl;
+        ::close(writer_lock);
+        return true;
+    }
+
+    // Swap in the rewritten file and rebuild the index for it
+    uint64_t new_size = 0;
+    for (const std::string_view& piece : pieces) {
+        new_size += piece.size();
+    }
+    if (!write_file_pieces(snippet_file, pieces)) {
+        std::cerr << "Error writing to target file: " << snippet_file << std::endl;
+        ::close(writer_lock);
+        return false;
+    }
+    build_index(snippet_file);
+    ::close(writer_lock);
+
+    std::cout << "Deduplicated " << snippet_file << ": " << template_count << " templates share "
+              << stored_bodies.size() << " stored bodies, ";
+    if (new_size < snippets.size()) {
+        std::cout << "saving " << snippets.size() - new_size << " bytes." << std::endl;
+    } else {
+        std::cout << "which saved no space." << std::endl;
+    }
+    return true;
+}
+
+// Runs a core operation with the errors it reports collected into the result instead of printed; the
+// redirect is per thread, so stores used from different threads keep their errors apart
+template <typename Operation>
+StoreResult capture_errors(Operation operation) {
+    std::ostringstream errors;
+    std::ostream* previous = command_error_output;
+    command_error_output = &errors;
+    StoreResult result;
+    result.status = operation();
+    command_error_output = previous;
+    result.message = errors.str();
+    while (!result.message.empty() && result.message.back() == '\n') {
+        result.message.pop_back();
+    }
+    return result;
+}
+
+// Builds a result from a status and a message
+StoreResult store_result(StoreStatus status, const std::string& message) {
+    StoreResult result;
+    result.status = status;
+    result.message = message;
+    return result;
+}
+
+// The result of an operation on a store that has no snippet file, such as one that was moved from
+StoreResult no_snippet_file() {
+    return store_result(StoreStatus::IO_ERROR, "No snippet file is open in this store.");
+}
+
+// The mapped snippet file of a SnippetStore and, once parsed, its templates
+}  // namespace
+
+namespace codesnip {
+
+struct SnippetStore::State {
+    std::string snippet_file;
+    MappedFile snippets;
+    uint64_t file_size = 0;
+    int64_t mtime_ns = 0;
+    bool parsed = false;
+    std::vector<StoredTemplate> templates;                          // Live templates in file order
+    std::unordered_map<std::string_view, std::string_view> bodies;  // First live body of each name
+
+    // Maps the file again if it is not mapped or has changed; returns false if it cannot be read
+    bool refresh() {
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        if (!file_stamp(snippet_file, size, mtime)) {
+            invalidate();
+            return false;
+        }
+        if (snippets.is_open() && size == file_size && mtime == mtime_ns) {
+            return true;
+        }
+        invalidate();
+        file_size = size;
+        mtime_ns = mtime;
+        return snippets.open(snippet_file);
+    }
+
+    // Drops the mapping and the parsed templates, such as after the store changed the file, which may
+    // leave its size and modification time as they were
+    void invalidate() {
+        snippets.close();
+        parsed = false;
+        templates.clear();
+        bodies.clear();
+    }
+
+    // Parses the mapped file into the template list and the name table, once per mapping
+    void parse() {
+        if (parsed) {
+            return;
+        }
+        PhaseTimer timer(PHASE_LOOKUP);
+        SnippetPack pack;
+        if (pack.open(snippets)) {
+            PackRecord record;
+            for (size_t position = 0; position < pack.size(); ++position) {
+                if (pack.record(pack.ordered(position), record)) {
+                    templates.push_back(StoredTemplate{pack.name(record), pack.body(record)});
+                }
+            }
+        } else {
+            SnippetLog log(snippets.view());
+            for (const ResolvedTemplate& resolved : log.templates()) {
+                if (resolved.live) {
+                    templates.push_back(StoredTemplate{resolved.name, resolved.tmpl.body});
+                }
+            }
+        }
+        for (const StoredTemplate& stored : templates) {
+            bodies.emplace(stored.name, stored.body);
+        }
+        parsed = true;
+    }
+};
+
+SnippetStore::SnippetStore() : state_(new State()) {}
+
+SnippetStore::~SnippetStore() = default;
+
+SnippetStore::SnippetStore(SnippetStore&& other) noexcept = default;
+
+SnippetStore& SnippetStore::operator=(SnippetStore&& other) noexcept = default;
+
+StoreResult SnippetStore::open(const std::string& snippet_file) {
+    state_.reset(new State());
+    state_->snippet_file = snippet_file;
+    struct stat st;
+    if (stat(snippet_file.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return store_result(StoreStatus::NOT_FOUND, "Error opening snippet file: " + snippet_file);
+    }
+    return StoreResult();
+}
+
+const std::string& SnippetStore::path() const {
+    static const std::string none;
+    return state_ ? state_->snippet_file : none;
+}
+
+StoreResult SnippetStore::lookup(const std::string& template_name, std::string_view& body) {
+    if (!state_) {
+        return no_snippet_file();
+    }
+    if (!state_->refresh()) {
+        return store_result(StoreStatus::IO_ERROR, "Error opening snippet file: " + path());
+    }
+
+    // Once the file is parsed, names resolve from memory; until then, through the sidecar index
+    StoreResult result;
+    if (state_->parsed) {
+        auto found = state_->bodies.find(template_name);
+        result.status = found == state_->bodies.end() ? StoreStatus::NOT_FOUND : StoreStatus::OK;
+        body = result.ok() ? found->second : std::string_view();
+    } else {
+        result = capture_errors([&]() {
+            return find_template(state_->snippet_file, state_->snippets, template_name, body) ? StoreStatus::OK
+                                                                                             : StoreStatus::NOT_FOUND;
+        });
+    }
+
+    // A lookup that fails with a message of its own hit a corrupt pack record
+    if (result.status == StoreStatus::NOT_FOUND && result.message.empty()) {
+        result.message = "Template '" + template_name + "' not found in snippet file.";
+    } else if (result.status == StoreStatus::NOT_FOUND) {
+        result.status = StoreStatus::IO_ERROR;
+    }
+    return result;
+}
+
+StoreResult SnippetStore::templates(std::vector<StoredTemplate>& templates) {
+    if (!state_) {
+        return no_snippet_file();
+    }
+    if (!state_->refresh()) {
+        return store_result(StoreStatus::IO_ERROR, "Error opening snippet file: " + path());
+    }
+    state_->parse();
+    templates = state_->templates;
+    return StoreResult();
+}
+
+StoreResult SnippetStore::names(std::vector<std::string_view>& names) {
+    if (!state_) {
+        return no_snippet_file();
+    }
+    if (!state_->refresh()) {
+        return store_result(StoreStatus::IO_ERROR, "Error opening snippet file: " + path());
+    }
+    names.clear();
+
+    // Read a pack's name table directly, so a compressed pack decompresses no bodies
+    SnippetPack pack;
+    if (pack.open(state_->snippets)) {
+        PackRecord record;
+        for (size_t position = 0; position < pack.size(); ++position) {
+            if (pack.record(pack.ordered(position), record)) {
+                names.push_back(pack.name(record));
+            }
+        }
+        return StoreResult();
+    }
+
+    state_->parse();
+    for (const StoredTemplate& stored : state_->templates) {
+        names.push_back(stored.name);
+    }
+    return StoreResult();
+}
+
+StoreResult SnippetStore::insert(const std::string& template_name, const std::string& target_file,
+const InsertAnchor& anchor, const TemplateVariables& variables) {
+    std::string_view body;
+    StoreResult result = lookup(template_name, body);
+    if (!result) {
+        return result;
+    }
+
+    // Split the body into lines; packs store line offsets, so their bodies are split without scanning
+    std::vector<std::string> lines;
+    {
+        PhaseTimer timer(PHASE_LOOKUP);
+        SnippetPack pack;
+        PackRecord record;
+        if (!variables.empty()) {
+            std::string expanded;
+            result = capture_errors([&]() {
+                return expand_template(body, variables, expanded) ? StoreStatus::OK : StoreStatus::INVALID_ARGUMENT;
+            });
+            if (!result) {
+                return result;
+            }
+            lines = split_lines(expanded);
+        } else if (pack.open(state_->snippets) && pack.find(template_name, record)) {
+            lines = pack.lines(record);
+        } else {
+            lines = split_lines(body);
+        }
+    }
+    if (lines.empty()) {
+        return store_result(StoreStatus::INVALID_ARGUMENT, "No lines found for template '" + template_name + "'.");
+    }
+
+    std::string location;
+    result = capture_errors([&]() { return insert_at_anchor(target_file, lines, anchor, location); });
+    if (result) {
+        result.message = "Inserted snippet '" + template_name + "' into " + target_file + " at " + location + ".";
+    }
+    return result;
+}
+
+StoreResult SnippetStore::extract(const std::string& source_file, int start_line, int end_line,
+const std::string& new_template_name, bool dedupe) {
+    if (!state_) {
+        return no_snippet_file();
+    }
+    bool stored_as_alias = false;
+    StoreResult result = capture_errors([&]() {
+        return ::extract(source_file, start_line, end_line, new_template_name, state_->snippet_file, dedupe,
+                         stored_as_alias);
+    });
+    state_->invalidate();
+    if (result) {
+        result.message = "Extracted lines from " + source_file + " and saved as template '" + new_template_name +
+                         "' in snippet file " + state_->snippet_file + ".";
+        if (stored_as_alias) {
+            result.message += "\nIts body is identical to a stored template, so only a reference was added.";
+        }
+    }
+    return result;
+}
+
+StoreResult SnippetStore::remove(const std::string& template_name, bool log_structured) {
+    if (!state_) {
+        return no_snippet_file();
+    }
+    StoreResult result = capture_errors([&]() {
+        return delete_template(template_name, state_->snippet_file, log_structured);
+    });
+    state_->invalidate();
+    if (result) {
+        result.message = "Deleted template '" + template_name + "' from " + state_->snippet_file + ".";
+    }
+    return result;
+}
+
+StoreResult SnippetStore::rename(const std::string& old_template_name, const std::string& new_template_name,
+bool log_structured) {
+    if (!state_) {
+        return no_snippet_file();
+    }
+    StoreResult result = capture_errors([&]() {
+        return rename_template(old_template_name, new_template_name, state_->snippet_file, log_structured);
+    });
+    state_->invalidate();
+    if (result) {
+        result.message = "Renamed template '" + old_template_name + "' to '" + new_template_name + "' in " +
+                         state_->snippet_file + ".";
+    }
+    return result;
+}
+
+}  // namespace codesnip
+
+namespace {
+
+/**
+ * @brief Lists the templates whose bodies contain a substring or match a regular expression.
+ *
+ * Each snippet file keeps a sidecar trigram index ("<snippet_file>.tri") that narrows the search to
+ * templates containing every trigram of the query before the bodies are checked. A directory or glob
+ * is searched file by file in parallel, and a name shadowed by an earlier file is not reported.
+ *
+ * @param query The text or regular expression to search for.
+ * @param snippet_file Path to the snippet file, directory or glob to search.
+ * @param is_regex If true, the query is an ECMAScript regular expression.
+ * @return False if the query or a snippet file could not be used; finding no match is not an error.
+ */
+
+bool search_templates(std::string& query, std::string& snippet_file, bool is_regex) {
+    std::regex regex;
+    if (is_regex) {
+        try {
+            regex = std::regex(query, std::regex::ECMAScript | std::regex::optimize);
+        } catch (const std::regex_error& error) {
+            std::cerr << "Invalid regular expression: " << error.what() << std::endl;
+            return false;
+        }
+    }
+
+    std::vector<std::string> snippet_files;
+    if (is_snippet_collection(snippet_file)) {
+        if (!expand_snippet_source(snippet_file, snippet_files)) {
+            std::cerr << "No snippet files found for: " << snippet_file << std::endl;
+            return false;
+        }
+    } else {
+        snippet_files.push_back(snippet_file);
+    }
+
+    // Search each file as a separate task
+    std::vector<FileSearchResult> results(snippet_files.size());
+    WorkStealingPool pool;
+    pool.run(snippet_files.size(), [&](size_t i) {
+        search_file(snippet_files[i], query, is_regex ? &regex : nullptr, i + 1 < snippet_files.size(), results[i]);
+    });
+
+    // Print matches in file order, skipping names defined by an earlier file
+    std::set<std::string> shadowed;
+    bool found = false;
+    bool all_opened = true;
+    for (size_t i = 0; i < snippet_files.size(); ++i) {
+        if (!results[i].opened) {
+            std::cerr << "Error opening snippet file: " << snippet_files[i] << std::endl;
+            all_opened = false;
+            continue;
+        }
+        for (const std::string& name : results[i].matches) {
+            if (!shadowed.count(name)) {
+                found = true;
+                std::cout << name << '\n';
+            }
+        }
+        shadowed.insert(results[i].names.begin(), results[i].names.end());
+    }
+
+    if (!found) {
+        std::cout << "No templates match '" << query << "'." << std::endl;
+    }
+    std::cout.flush();
+    return all_opened;
+}
+
+// On-disk layout of the completion table "<snippet_file>.names": a header, count + 1 64-bit offsets
+// into the name bytes, count 64-bit character sets (see name_characters()), then the distinct live
+// template names in byte order, back to back
+static const char NAMES_MAGIC[8] = {'C', 'S', 'N', 'A', 'M', '0', '0', '1'};
+
+struct NamesHeader {
+    char magic[8];
+    uint64_t file_size;
+    int64_t mtime_ns;
+    uint64_t count;
+    uint64_t names_size;
+};
+
+// A template name offered by complete: names starting with the query rank above every fuzzy match
+struct Completion {
+    std::string_view name;
+    bool prefix = false;
+    int score = 0;  // Fuzzy match score, higher is better
+};
+
+// Orders completions: prefix matches by name, then fuzzy matches by score, length and name
+bool completion_before(const Completion& a, const Completion& b) {
+    if (a.prefix != b.prefix) {
+        return a.prefix;
+    }
+    if (!a.prefix && a.score != b.score) {
+        return a.score > b.score;
+    }
+    if (!a.prefix && a.name.size() != b.name.size()) {
+        return a.name.size() < b.name.size();
+    }
+    return a.name < b.name;
+}
+
+// Folds ASCII letters to lowercase for fuzzy matching
+inline unsigned char fold_case(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? (unsigned char)(c + 32) : c;
+}
+
+// Returns the set of characters in a name, folded to lowercase, as bits: one per letter and digit, and
+// 27 shared by every other byte. A name can only fuzzy-match a query whose set is a subset of its own.
+uint64_t name_characters(std::string_view name) {
+    uint64_t characters = 0;
+    for (char c : name) {
+        unsigned char folded = fold_case((unsigned char)c);
+        characters |= folded >= 'a' && folded <= 'z' ? 1ULL << (folded - 'a')
+                      : folded >= '0' && folded <= '9' ? 1ULL << (26 + folded - '0')
+                      : 1ULL << (36 + folded % 27);
+    }
+    return characters;
+}
+
+/**
+ * @brief Scores a name as a fuzzy match of a query.
+ *
+ * The query's characters must appear in the name in order, ignoring ASCII case. Of all the ways to
+ * place them, the best scoring one counts: a character matched at the start of a word (after a
+ * non-alphanumeric character, or where lowercase turns to uppercase) scores 8, one that directly
+ * follows the previous match scores 4, and any other scores 1. A first match within the first three
+ * characters adds 3 points minus its position. Most names fail a quick subsequence check, and only the
+ * rest are scored, by dynamic programming restricted to the positions each character can occupy.
+ *
+ * @param query The text typed so far, already folded to lowercase.
+ * @param name The template name to score.
+ * @return The score, which is positive, or -1 if the name does not contain the query as a subsequence.
+ */
+
+int fuzzy_score(std::string_view query, std::string_view name) {
+    // Match the query as early and as late as possible; each character can only be placed in between
+    thread_local std::vector<size_t> earliest, latest;
+    earliest.resize(query.size());
+    latest.resize(query.size());
+    size_t matched = 0;
+    for (size_t j = 0; j < name.size() && matched < query.size(); ++j) {
+        if (fold_case((unsigned char)name[j]) == (unsigned char)query[matched]) {
+            earliest[matched++] = j;
+        }
+    }
+    if (matched < query.size()) {
+        return -1;
+    }
+    for (size_t j = name.size(); matched > 0 && j-- > 0;) {
+        if (fold_case((unsigned char)name[j]) == (unsigned char)query[matched - 1]) {
+            latest[--matched] = j;
+        }
+    }
+
+    // Classify the positions once: the bonus for matching there, 8 at a word start and 1 elsewhere
+    thread_local std::vector<int> bonus, best, previous;
+    bonus.resize(name.size());
+    best.resize(name.size());
+    previous.resize(name.size());
+    bool left_alnum = false, left_lower = false;
+    for (size_t j = 0; j <= latest.back(); ++j) {
+        unsigned char c = (unsigned char)name[j];
+        bool upper = c >= 'A' && c <= 'Z';
+        bool lower = c >= 'a' && c <= 'z';
+        bonus[j] = !left_alnum || (left_lower && upper) ? 8 : 1;
+        left_alnum = upper || lower || (c >= '0' && c <= '9');
+        left_lower = lower;
+    }
+
+    // best[j]: best score with query character i matched at name[j], for j in its window; NONE if impossible
+    const int NONE = -1000000;
+    for (size_t i = 0; i < query.size(); ++i) {
+        best.swap(previous);
+        int before = NONE;  // Best score of the previous character up to name[j - 2]
+        size_t next = i > 0 ? earliest[i - 1] : 0;
+        for (size_t j = earliest[i]; j <= latest[i]; ++j) {
+            while (i > 0 && next + 2 <= j && next <= latest[i - 1]) {
+                before = std::max(before, previous[next++]);
+            }
+            best[j] = NONE;
+            if (fold_case((unsigned char)name[j]) != (unsigned char)query[i]) {
+                continue;
+            }
+            if (i == 0) {
+                best[j] = bonus[j] + 3 - (int)std::min<size_t>(j, 3);
+                continue;
+            }
+            best[j] = before > NONE ? before + bonus[j] : NONE;
+            if (j - 1 >= earliest[i - 1] && j - 1 <= latest[i - 1] && previous[j - 1] > NONE) {
+                best[j] = std::max(best[j], previous[j - 1] + std::max(bonus[j], 4));
+            }
+        }
+    }
+    return *std::max_element(best.begin() + earliest.back(), best.begin() + latest.back() + 1);
+}
+
+/**
+ * @brief Finds the best completions of a query in a table of distinct names sorted in byte order.
+ *
+ * Names that start with the query form one run of the table, found by binary search, and are taken
+ * in order. Only if they are fewer than the limit is the rest of the table scanned for fuzzy matches.
+ * The scan is split into chunks that run in parallel and keep their best matches in bounded heaps,
+ * and names whose character set lacks part of the query are skipped without being read.
+ *
+ * @param count Number of names in the table.
+ * @param name_at Returns the name at a position of the table.
+ * @param characters_at Returns name_characters() of the name at a position, or all bits if unknown.
+ * @param query The text typed so far.
+ * @param limit Maximum number of completions to add.
+ * @param results Receives the completions, best first.
+ */
+
+template <typename NameAt, typename CharactersAt>
+void complete_sorted_names(size_t count, NameAt name_at, CharactersAt characters_at, std::string_view query,
+                           size_t limit, std::vector<Completion>& results) {
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (name_at(middle) < query) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    size_t run_end = low;
+    size_t found = 0;
+    while (run_end < count && found < limit && name_at(run_end).substr(0, query.size()) == query) {
+        Completion completion;
+        completion.name = name_at(run_end++);
+        completion.prefix = true;
+        results.push_back(completion);
+        found++;
+    }
+    if (found == limit || query.empty()) {
+        return;
+    }
+
+    // Score the names outside the prefix run, keeping the worst of each chunk's best on top of its heap
+    PhaseTimer timer(PHASE_LOOKUP);
+    std::string folded(query);
+    for (char& c : folded) {
+        c = (char)fold_case((unsigned char)c);
+    }
+    const uint64_t needed = name_characters(folded);
+    const size_t wanted = limit - found;
+    const size_t CHUNK_SIZE = 16384;
+    std::vector<std::vector<Completion>> best((count + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    WorkStealingPool pool;
+    pool.run(best.size(), [&](size_t chunk) {
+        std::vector<Completion>& heap = best[chunk];
+        for (size_t position = chunk * CHUNK_SIZE; position < std::min(count, (chunk + 1) * CHUNK_SIZE); ++position) {
+            if ((position >= low && position < run_end) || (characters_at(position) & needed) != needed) {
+                continue;
+            }
+            // Skip names that could not beat the worst kept match even with a perfect score
+            Completion completion;
+            completion.name = name_at(position);
+            completion.score = 8 * (int)folded.size() + 3;
+            if (heap.size() == wanted && !completion_before(completion, heap.front())) {
+                continue;
+            }
+            completion.score = fuzzy_score(folded, completion.name);
+            if (completion.score < 0) {
+                continue;
+            }
+            if (heap.size() < wanted) {
+                heap.push_back(completion);
+                std::push_heap(heap.begin(), heap.end(), completion_before);
+            } else if (completion_before(completion, heap.front())) {
+                std::pop_heap(heap.begin(), heap.end(), completion_before);
+                heap.back() = completion;
+                std::push_heap(heap.begin(), heap.end(), completion_before);
+            }
+        }
+    });
+    stats_add(run_stats.lines_scanned, count);
+
+    std::vector<Completion> merged;
+    for (const std::vector<Completion>& heap : best) {
+        merged.insert(merged.end(), heap.begin(), heap.end());
+    }
+    std::sort(merged.begin(), merged.end(), completion_before);
+    merged.resize(std::min(merged.size(), wanted));
+    results.insert(results.end(), merged.begin(), merged.end());
+}
+
+// Writes sorted, distinct names and their name_characters() as the sidecar name table of a snippet
+// file, replacing any previous one atomically
+bool write_names_table(const std::string& snippet_file, const std::vector<std::string_view>& names,
+                       const std::vector<uint64_t>& characters, uint64_t file_size, int64_t mtime_ns) {
+    NamesHeader header;
+    std::memcpy(header.magic, NAMES_MAGIC, sizeof(NAMES_MAGIC));
+    header.file_size = file_size;
+    header.mtime_ns = mtime_ns;
+    header.count = names.size();
+    std::vector<uint64_t> offsets(1, 0);
+    for (const std::string_view& name : names) {
+        offsets.push_back(offsets.back() + name.size());
+    }
+    header.names_size = offsets.back();
+
+    std::string table_file = snippet_file + ".names";
+    std::string temp_file = temp_path(table_file);
+    std::ofstream table_output(temp_file, std::ios::binary | std::ios::trunc);
+    if (!table_output.is_open()) {
+        return false;
+    }
+    table_output.write((const char*)&header, sizeof(header));
+    table_output.write((const char*)offsets.data(), offsets.size() * sizeof(uint64_t));
+    table_output.write((const char*)characters.data(), characters.size() * sizeof(uint64_t));
+    for (const std::string_view& name : names) {
+        table_output.write(name.data(), name.size());
+    }
+    table_output.close();
+
+    if (!table_output || std::rename(temp_file.c_str(), table_file.c_str()) != 0) {
+        std::remove(temp_file.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Sorted, distinct template names of one snippet file or pack, for completion.
+ *
+ * A snippet file's names are kept in a sidecar table ("<snippet_file>.names") that is mapped and
+ * searched in place, so answering a query does not read the snippet file at all. The table is built
+ * on first use and rebuilt whenever the snippet file changes; if it cannot be written, the names are
+ * sorted in memory instead. A pack's own name table is already sorted and is used directly.
+ */
+
+class NameTable {
+public:
+    // Opens the names of a snippet file or pack; returns false if it cannot be read
+    bool open(const std::string& snippet_file) {
+        uint64_t file_size = 0;
+        int64_t mtime_ns = 0;
+        if (!file_stamp(snippet_file, file_size, mtime_ns)) {
+            return false;
+        }
+        if (open_table(snippet_file, file_size, mtime_ns)) {
+            return true;
+        }
+
+        if (!source_.open(snippet_file)) {
+            return false;
+        }
+        if (pack_.open(source_)) {
+            kind_ = PACK;
+            return true;
+        }
+
+        // Sort the live names, then cache them next to the snippet file for later queries
+        {
+            PhaseTimer timer(PHASE_LOOKUP);
+            SnippetLog log(source_.view());
+            for (const ResolvedTemplate& resolved : log.templates()) {
+                if (resolved.live) {
+                    names_.push_back(resolved.name);
+                }
+            }
+            std::sort(names_.begin(), names_.end());
+            names_.erase(std::unique(names_.begin(), names_.end()), names_.end());
+            for (const std::string_view& name : names_) {
+                characters_.push_back(name_characters(name));
+            }
+        }
+        kind_ = SORTED;
+        write_table(snippet_file, file_size, mtime_ns);
+        return true;
+    }
+
+    // Adds up to limit best completions of a query to results
+    void complete(std::string_view query, size_t limit, std::vector<Completion>& results) const {
+        if (kind_ == TABLE) {
+            complete_sorted_names(header_.count, [this](size_t position) { return table_name(position); },
+                                  [this](size_t position) { return table_characters(position); }, query, limit,
+                                  results);
+        } else if (kind_ == PACK) {
+            complete_sorted_names(pack_.size(), [this](size_t position) {
+                PackRecord record;
+                return pack_.record(position, record) ? pack_.name(record) : std::string_view();
+            }, [](size_t) { return ~0ULL; }, query, limit, results);
+        } else {
+            complete_sorted_names(names_.size(), [this](size_t position) { return names_[position]; },
+                                  [this](size_t position) { return characters_[position]; }, query, limit, results);
+        }
+    }
+
+private:
+    // Maps the sidecar table if it exists, is well formed and matches the snippet file
+    bool open_table(const std::string& snippet_file, uint64_t file_size, int64_t mtime_ns) {
+        if (!table_.open(snippet_file + ".names") || table_.size() < sizeof(NamesHeader)) {
+            return false;
+        }
+        std::memcpy(&header_, table_.data(), sizeof(header_));
+        characters_offset_ = sizeof(NamesHeader) + (header_.count + 1) * sizeof(uint64_t);
+        names_offset_ = characters_offset_ + header_.count * sizeof(uint64_t);
+        if (std::memcmp(header_.magic, NAMES_MAGIC, sizeof(NAMES_MAGIC)) != 0 || header_.file_size != file_size ||
+            header_.mtime_ns != mtime_ns || header_.count > table_.size() / (2 * sizeof(uint64_t)) ||
+            names_offset_ + header_.names_size != table_.size()) {
+            table_.close();
+            return false;
+        }
+        kind_ = TABLE;
+        return true;
+    }
+
+    // Returns a name of the sidecar table; out-of-range offsets yield an empty name
+    std::string_view table_name(size_t position) const {
+        uint64_t bounds[2];
+        std::memcpy(bounds, table_.data() + sizeof(NamesHeader) + position * sizeof(uint64_t), sizeof(bounds));
+        if (bounds[0] > bounds[1] || bounds[1] > header_.names_size) {
+            return std::string_view();
+        }
+        return std::string_view(table_.data() + names_offset_ + bounds[0], bounds[1] - bounds[0]);
+    }
+
+    uint64_t table_characters(size_t position) const {
+        uint64_t characters;
+        std::memcpy(&characters, table_.data() + characters_offset_ + position * sizeof(uint64_t), sizeof(characters));
+        return characters;
+    }
+
+    void write_table(const std::string& snippet_file, uint64_t file_size, int64_t mtime_ns) const {
+        write_names_table(snippet_file, names_, characters_, file_size, mtime_ns);
+    }
+
+    enum Kind { TABLE, PACK, SORTED } kind_ = SORTED;
+    MappedFile table_;
+    NamesHeader header_{};
+    size_t characters_offset_ = 0;
+    size_t names_offset_ = 0;
+    MappedFile source_;
+    SnippetPack pack_;
+    std::vector<std::string_view> names_;  // Sorted names when the table could not be mapped
+    std::vector<uint64_t> characters_;     // name_characters() of each of names_
+};
+
+// Sorts completions gathered from several tables, drops repeated names and keeps the best limit
+void finish_completions(std::vector<Completion>& completions, size_t limit) {
+    std::stable_sort(completions.begin(), completions.end(), completion_before);
+    std::set<std::string_view> seen;
+    std::vector<Completion> kept;
+    for (const Completion& completion : completions) {
+        if (kept.size() < limit && seen.insert(completion.name).second) {
+            kept.push_back(completion);
+        }
+    }
+    completions.swap(kept);
+}
+
+// Prints completions one per line in a single write
+void print_completions(const std::vector<Completion>& completions) {
+    PhaseTimer timer(PHASE_WRITE);
+    std::string output;
+    for (const Completion& completion : completions) {
+        output.append(completion.name.data(), completion.name.size());
+        output += '\n';
+    }
+    std::cout.write(output.data(), output.size());
+    std::cout.flush();
+}
+
+/**
+ * @brief Prints the template names that best complete a query, best first.
+ *
+ * Names that start with the query come first, in byte order; if there are fewer than the limit, the
+ * best fuzzy matches follow (see fuzzy_score()). A directory or glob is completed file by file in
+ * parallel, and a name defined by several files is listed once. Nothing is printed if no name matches.
+ *
+ * @param query The text typed so far; an empty query lists the first names.
+ * @param snippet_source Path to the snippet file, pack, directory or glob.
+ * @param limit Maximum number of names to print.
+ * @return False if a snippet file could not be read; finding no match is not an error.
+ */
+
+bool complete_names(const std::string& query, const std::string& snippet_source, size_t limit) {
+    std::vector<std::string> snippet_files;
+    if (is_snippet_collection(snippet_source)) {
+        if (!expand_snippet_source(snippet_source, snippet_files)) {
+            std::cerr << "No snippet files found for: " << snippet_source << std::endl;
+            return false;
+        }
+    } else {
+        snippet_files.push_back(snippet_source);
+    }
+
+    // Complete in each file as a separate task
+    std::vector<NameTable> tables(snippet_files.size());
+    std::vector<std::vector<Completion>> found(snippet_files.size());
+    std::vector<char> opened(snippet_files.size(), 0);
+    WorkStealingPool pool;
+    pool.run(snippet_files.size(), [&](size_t i) {
+        if (tables[i].open(snippet_files[i])) {
+            opened[i] = 1;
+            tables[i].complete(query, limit, found[i]);
+        }
+    });
+
+    std::vector<Completion> completions;
+    bool all_opened = true;
+    for (size_t i = 0; i < snippet_files.size(); ++i) {
+        if (!opened[i]) {
+            std::cerr << "Error opening snippet file: " << snippet_files[i] << std::endl;
+            all_opened = false;
+        }
+        completions.insert(completions.end(), found[i].begin(), found[i].end());
+    }
+    if (snippet_files.size() > 1) {
+        finish_completions(completions, limit);
+    }
+    print_completions(completions);
+    return all_opened;
+}
+
+/**
+ * @brief Compiles snippet files into a binary pack that can be used without parsing.
+ *
+ * The pack holds a name table sorted for binary search, every body back to back, the offset of every
+ * body line and a hash of each body. Inputs may be text files, directories, globs or other packs; when
+ * several inputs define a name, the first one wins, as with snippet directories. A compressed pack
+ * stores the bodies as independently compressed blocks instead, which are compressed in parallel.
+ *
+ * @param pack_file Path of the pack to write.
+ * @param snippet_sources Snippet files, directories or globs to compile, in precedence order.
+ * @param compress Whether to write a compressed pack.
+ * @return True if the pack was written.
+ */
+
+bool compile_pack(const std::string& pack_file, const std::vector<std::string>& snippet_sources, bool compress) {
+    std::vector<std::string> snippet_files;
+    for (const std::string& source : snippet_sources) {
+        std::vector<std::string> expanded;
+        if (!is_snippet_collection(source)) {
+            expanded.push_back(source);
+        } else if (!expand_snippet_source(source, expanded)) {
+            std::cerr << "No snippet files found for: " << source << std::endl;
+            return false;
+        }
+        snippet_files.insert(snippet_files.end(), expanded.begin(), expanded.end());
+    }
+
+    // Gather every template in source order, keeping the first definition of each name
+    std::deque<MappedFile> mappings;
+    std::vector<std::pair<std::string_view, std::string_view>> templates;
+    std::set<std::string_view> seen;
+    for (const std::string& snippet_file : snippet_files) {
+        mappings.emplace_back();
+        if (!mappings.back().open(snippet_file)) {
+            std::cerr << "Error opening snippet file: " << snippet_file << std::endl;
+            return false;
+        }
+
+        SnippetPack pack;
+        if (pack.open(mappings.back())) {
+            PackRecord record;
+            for (size_t position = 0; position < pack.size(); ++position) {
+                if (!pack.record(pack.ordered(position), record) || !seen.insert(pack.name(record)).second) {
+                    continue;
+                }
+                if (!pack.verify(record)) {
+                    std::cerr << "Snippet pack is corrupt: " << snippet_file << std::endl;
+                    return false;
+                }
+                templates.emplace_back(pack.name(record), pack.body(record));
+            }
+            continue;
+        }
+
+        SnippetLog log(mappings.back().view());
+        for (const ResolvedTemplate& resolved : log.templates()) {
+            if (resolved.live && seen.insert(resolved.name).second) {
+                templates.emplace_back(resolved.name, resolved.tmpl.body);
+            }
+        }
+    }
+
+    // Sort the name table; the order table maps source order back to it
+    std::vector<uint32_t> sorted(templates.size());
+    for (uint32_t i = 0; i < sorted.size(); ++i) {
+        sorted[i] = i;
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [&](uint32_t a, uint32_t b) { return templates[a].first < templates[b].first; });
+
+    std::vector<PackRecord> records(templates.size());
+    std::vector<uint32_t> order(templates.size());
+    std::string names;
+    for (uint32_t position = 0; position < sorted.size(); ++position) {
+        uint32_t source = sorted[position];
+        order[source] = position;
+        records[position].name_offset = names.size();
+        records[position].name_length = (uint32_t)templates[source].first.size();
+        records[position].reserved = 0;
+        names.append(templates[source].first.data(), templates[source].first.size());
+    }
+
+    // Lay out the bodies in source order and record where every line starts; a compressed pack only
+    // counts the lines
+    uint64_t bodies_size = 0;
+    std::vector<uint64_t> line_offsets;
+    for (uint32_t source = 0; source < templates.size(); ++source) {
+        std::string_view body = templates[source].second;
+        PackRecord& record = records[order[source]];
+        record.body_offset = bodies_size;
+        record.body_length = body.size();
+        record.first_line = compress ? 0 : line_offsets.size();
+        record.hash = fnv1a(body.data(), body.size());
+
+        uint64_t line_count = 0;
+        size_t pos = 0;
+        while (pos < body.size()) {
+            if (!compress) {
+                line_offsets.push_back(bodies_size + pos);
+            }
+            next_line(body, pos);
+            ++line_count;
+        }
+        record.line_count = line_count;
+        bodies_size += body.size();
+    }
+
+    // Cut the bodies into blocks and compress each one on its own; a block that does not shrink is stored
+    std::vector<std::string> blocks;
+    std::vector<PackBlock> block_table;
+    uint64_t section_start = sizeof(PackHeader) + records.size() * sizeof(PackRecord) + order.size() * sizeof(uint32_t) +
+                             names.size();
+    uint64_t file_size = section_start + bodies_size + line_offsets.size() * sizeof(uint64_t);
+    if (compress) {
+        std::string bodies;
+        bodies.reserve(bodies_size);
+        for (const auto& tmpl : templates) {
+            bodies.append(tmpl.second.data(), tmpl.second.size());
+        }
+        blocks.resize(bodies_size / PACK_BLOCK_SIZE + (bodies_size % PACK_BLOCK_SIZE != 0));
+        WorkStealingPool pool;
+        pool.run(blocks.size(), [&](size_t number) {
+            const char* raw = bodies.data() + number * PACK_BLOCK_SIZE;
+            size_t raw_size = std::min(PACK_BLOCK_SIZE, bodies_size - number * PACK_BLOCK_SIZE);
+            compress_block(raw, raw_size, blocks[number]);
+            if (blocks[number].size() >= raw_size) {
+                blocks[number].assign(raw, raw_size);
+            }
+        });
+
+        file_size = section_start + blocks.size() * sizeof(PackBlock);
+        for (size_t number = 0; number < blocks.size(); ++number) {
+            PackBlock entry;
+            entry.offset = file_size;
+            entry.stored_size = (uint32_t)blocks[number].size();
+            entry.raw_size = (uint32_t)std::min(PACK_BLOCK_SIZE, bodies_size - number * PACK_BLOCK_SIZE);
+            block_table.push_back(entry);
+            file_size += blocks[number].size();
+        }
+    }
+
+    PackHeader header;
+    std::memcpy(header.magic, compress ? COMPRESSED_PACK_MAGIC : PACK_MAGIC, sizeof(PACK_MAGIC));
+    header.template_count = templates.size();
+    header.names_size = names.size();
+    header.bodies_size = bodies_size;
+    header.line_count = line_offsets.size();
+    header.file_size = file_size;
+
+    std::string temp_file = temp_path(resolve_target(pack_file));
+    std::ofstream pack_output(temp_file, std::ios::binary | std::ios::trunc);
+    if (!pack_output.is_open()) {
+        std::cerr << "Error writing to target file: " << pack_file << std::endl;
+        return false;
+    }
+
+    pack_output.write((const char*)&header, sizeof(header));
+    pack_output.write((const char*)records.data(), records.size() * sizeof(PackRecord));
+    pack_output.write((const char*)order.data(), order.size() * sizeof(uint32_t));
+    pack_output.write(names.data(), names.size());
+    if (compress) {
+        pack_output.write((const char*)block_table.data(), block_table.size() * sizeof(PackBlock));
+        for (const std::string& block : blocks) {
+            pack_output.write(block.data(), block.size());
+        }
+    } else {
+        for (const auto& tmpl : templates) {
+            pack_output.write(tmpl.second.data(), tmpl.second.size());
+        }
+        pack_output.write((const char*)line_offsets.data(), line_offsets.size() * sizeof(uint64_t));
+    }
+    pack_output.close();
+
+    if (!pack_output || !replace_with_temp_file(temp_file, pack_file)) {
+        std::cerr << "Error writing to target file: " << pack_file << std::endl;
+        if (!pack_output) {
+            std::remove(temp_file.c_str());
+        }
+        return false;
+    }
+
+    std::cout << "Compiled " << templates.size() << " templates from " << snippet_files.size()
+              << " snippet files into " << pack_file;
+    if (compress) {
+        std::cout << " (" << bodies_size << " body bytes compressed to " << file_size - section_start << ")";
+    }
+    std::cout << "." << std::endl;
+    return true;
+}
+
+/**
+ * @brief Writes the templates of a compiled pack back out as a text snippet file.
+ *
+ * Templates are written in their original order, separated by empty lines.
+ *
+ * @param pack_file Path to the pack to read.
+ * @param snippet_file Path of the text snippet file to write.
+ * @return True if the snippet file was written.
+ */
+
+bool decompile_pack(const std::string& pack_file, const std::string& snippet_file) {
+    MappedFile mapping;
+    SnippetPack pack;
+    if (!mapping.open(pack_file) || !pack.open(mapping)) {
+        std::cerr << "Error opening snippet pack: " << pack_file << std::endl;
+        return false;
+    }
+
+    std::string temp_file = temp_path(resolve_target(snippet_file));
+    std::ofstream snippet_output(temp_file, std::ios::binary | std::ios::trunc);
+    if (!snippet_output.is_open()) {
+        std::cerr << "Error writing to target file: " << snippet_file << std::endl;
+        return false;
+    }
+
+    // Emit the blocks in source order, flushing the text buffer as it grows
+    std::string text;
+    PackRecord record;
+    for (size_t position = 0; position < pack.size(); ++position) {
+        if (!pack.record(pack.ordered(position), record) || !pack.verify(record)) {
+            std::cerr << "Snippet pack is corrupt: " << pack_file << std::endl;
+            snippet_output.close();
+            std::remove(temp_file.c_str());
+            return false;
+        }
+
+        std::string_view name = pack.name(record);
+        std::string_view body = pack.body(record);
+        if (position > 0) {
+            text += '\n';
+        }
+        text += NAME_PREFIX;
+        text.append(name.data(), name.size());
+        text += '\n';
+        text.append(body.data(), body.size());
+        if (!body.empty() && body.back() != '\n') {
+            text += '\n';
+        }
+        text += END_MARKER;
+        text += '\n';
+
+        if (text.size() >= COPY_BLOCK_SIZE) {
+            snippet_output.write(text.data(), text.size());
+            text.clear();
+        }
+    }
+    snippet_output.write(text.data(), text.size());
+    snippet_output.close();
+
+    if (!snippet_output || !replace_with_temp_file(temp_file, snippet_file)) {
+        std::cerr << "Error writing to target file: " << snippet_file << std::endl;
+        if (!snippet_output) {
+            std::remove(temp_file.c_str());
+        }
+        return false;
+    }
+
+    std::cout << "Decompiled " << pack.size() << " templates from " << pack_file
+              << " into " << snippet_file << "." << std::endl;
+    return true;
+}
+
+// In-memory copy of a snippet library, used by batch runs and the daemon
+struct LoadedLibrary {
+    std::string content;
+    bool dirty = false;
+    bool read_only = false;                                            // Loaded from a compiled pack
+    std::unordered_map<std::string, std::pair<size_t, size_t>> bodies; // Name -> body offset and length
+    std::vector<std::string> names;                                    // Every template name, in file order
+    std::unordered_map<std::string, CompiledTemplate> compiled;        // Parameterized forms, built on first use
+    std::vector<std::string_view> sorted_names;                        // Distinct names in byte order, built on first completion
+    std::vector<uint64_t> sorted_characters;                           // name_characters() of each sorted name
+    uint64_t file_size = 0;
+    int64_t mtime_ns = 0;
+};
+
+// Rebuilds the lookup tables of a loaded library; the first definition of a name wins
+void index_library(LoadedLibrary& library) {
+    library.bodies.clear();
+    library.names.clear();
+    library.compiled.clear();
+    library.sorted_names.clear();
+    library.sorted_characters.clear();
+    SnippetLog log(library.content);
+    for (const ResolvedTemplate& resolved : log.templates()) {
+        if (!resolved.live) {
+            continue;
+        }
+        std::string_view body = resolved.tmpl.body;
+        library.bodies.emplace(std::string(resolved.name),
+            std::make_pair((size_t)(body.data() - library.content.data()), body.size()));
+        library.names.emplace_back(resolved.name);
+    }
+}
+
+// Reads a snippet file into memory and indexes it; returns false if it cannot be opened
+bool load_library(const std::string& snippet_file, LoadedLibrary& library) {
+    MappedFile snippets;
+    if (!file_stamp(snippet_file, library.file_size, library.mtime_ns) || !snippets.open(snippet_file)) {
+        return false;
+    }
+
+    library.dirty = false;
+    library.read_only = false;
+
+    // Unpack a compiled pack into the text layout so the rest of the code can treat both alike
+    SnippetPack pack;
+    if (pack.open(snippets)) {
+        library.content.clear();
+        PackRecord record;
+        for (size_t position = 0; position < pack.size(); ++position) {
+            if (pack.record(pack.ordered(position), record)) {
+                append_template_block(library.content, pack.name(record), pack.body(record));
+            }
+        }
+        library.read_only = true;
+    } else {
+        library.content.assign(snippets.data(), snippets.size());
+    }
+
+    index_library(library);
+    return true;
+}
+
+// Returns the body of a template in a loaded library, or false if it does not exist
+bool library_find(const LoadedLibrary& library, const std::string& template_name, std::string_view& body) {
+    auto found = library.bodies.find(template_name);
+    if (found == library.bodies.end()) {
+        return false;
+    }
+    body = std::string_view(library.content).substr(found->second.first, found->second.second);
+    return true;
+}
+
+/**
+ * @brief Splits a template of a loaded library into lines, expanding its ${name} placeholders.
+ *
+ * The compiled form of the template is kept in the library, so a daemon or batch run that expands the
+ * same template many times parses it only once.
+ *
+ * @param library The loaded library.
+ * @param template_name The template, which must exist in the library.
+ * @param variables Values for the placeholders; if empty, the body is split as is.
+ * @param lines Receives the lines.
+ * @return False, after printing an error, if a placeholder has no value.
+ */
+
+bool library_template_lines(LoadedLibrary& library, const std::string& template_name,
+const TemplateVariables& variables, std::vector<std::string>& lines) {
+    std::string_view body;
+    library_find(library, template_name, body);
+    if (variables.empty()) {
+        lines = split_lines(body);
+        return true;
+    }
+
+    auto cached = library.compiled.find(template_name);
+    if (cached == library.compiled.end()) {
+        cached = library.compiled.emplace(template_name, CompiledTemplate()).first;
+        cached->second.compile(body);
+    }
+    std::vector<std::string_view> values;
+    std::string expanded;
+    if (!cached->second.bind(variables, values)) {
+        return false;
+    }
+    cached->second.expand(values, expanded);
+    lines = split_lines(expanded);
+    return true;
+}
+
+// Returns the leading spaces and tabs of a line
+std::string leading_whitespace(const std::string& line) {
+    size_t length = 0;
+    while (length < line.size() && (line[length] == ' ' || line[length] == '\t')) {
+        length++;
+    }
+    return line.substr(0, length);
+}
+
+// Splits a manifest line into whitespace-separated arguments; double quotes anywhere in an argument
+// group the spaces between them into it, as in a shell, so both "name=a b" and name="a b" are one argument
+std::vector<std::string> split_manifest_line(const std::string& line) {
+    std::vector<std::string> args;
+    size_t i = 0;
+    while (i < line.size()) {
+        while (i < line.size() && (line[i] == ' ' || line[i] == '\t' || line[i] == '\r')) {
+            i++;
+        }
+        if (i == line.size()) {
+            break;
+        }
+
+        std::string arg;
+        while (i < line.size() && line[i] != ' ' && line[i] != '\t' && line[i] != '\r') {
+            if (line[i] == '"') {
+                size_t close = line.find('"', i + 1);
+                if (close == std::string::npos) {
+                    close = line.size();
+                }
+                arg.append(line, i + 1, close - i - 1);
+                i = std::min(close + 1, line.size());
+            } else {
+                arg += line[i++];
+            }
+        }
+        args.push_back(arg);
+    }
+    return args;
+}
+
+// Parses a positive line number; returns false if the text is not one
+bool parse_line_number(const std::string& text, int& value) {
+    char* end = nullptr;
+    long parsed = std::strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || parsed < 1 || parsed > 2147483647L) {
+        return false;
+    }
+    value = (int)parsed;
+    return true;
+}
+
+/**
+ * @brief Separates the anchor options of insert and apply from their positional arguments.
+ *
+ * "--at-marker <text>" or "--at-regex <pattern>" may appear anywhere among the arguments, optionally
+ * together with "--all" to replace every matching line.
+ *
+ * @param args The arguments to scan.
+ * @param positional Receives the remaining arguments, in order.
+ * @param anchor Receives the marker or regex, if one is given.
+ * @return False if an anchor lacks its value, two anchors are given, or --all is given without one.
+ */
+
+bool split_anchor_args(const std::vector<std::string>& args, std::vector<std::string>& positional,
+InsertAnchor& anchor) {
+    bool malformed = false;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "--at-marker" || args[i] == "--at-regex") {
+            malformed = malformed || i + 1 == args.size() || anchor.kind != InsertAnchor::LINE;
+            anchor.kind = args[i] == "--at-marker" ? InsertAnchor::MARKER : InsertAnchor::REGEX;
+            anchor.pattern = i + 1 < args.size() ? args[++i] : "";
+        } else if (args[i] == "--all") {
+            anchor.every_match = true;
+        } else {
+            positional.push_back(args[i]);
+        }
+    }
+    return !malformed && !(anchor.every_match && anchor.kind == InsertAnchor::LINE);
+}
+
+/**
+ * @brief Parses the arguments of an insert operation.
+ *
+ * The line number may be replaced by an anchor; see split_anchor_args().
+ *
+ * @param args The arguments following the command name.
+ * @param template_name Receives the name of the template to insert.
+ * @param target_file Receives the path of the file to insert into.
+ * @param snippet_file Receives the path of the snippet file.
+ * @param anchor Receives the line number or anchor.
+ * @param variables Receives the values given with "--var name=value".
+ * @return False, after printing an error, if the arguments are malformed.
+ */
+
+bool parse_insert_args(std::vector<std::string> args, std::string& template_name, std::string& target_file,
+std::string& snippet_file, InsertAnchor& anchor, TemplateVariables& variables) {
+    if (!take_variable_args(args, variables)) {
+        return false;
+    }
+    std::vector<std::string> positional;
+    bool well_formed = split_anchor_args(args, positional, anchor);
+
+    // Positional arguments: <template_name> <target_file> [<line_number>] <snippet_file>
+    size_t expected = anchor.kind == InsertAnchor::LINE ? 4 : 3;
+    if (!well_formed || positional.size() < expected) {
+        std::cerr << "Usage: codesnip insert <template_name> <target_file> <line_number> <snippet_file>\n"
+                  << "       codesnip insert <template_name> <target_file> <snippet_file> "
+                  << "(--at-marker <text> | --at-regex <pattern>) [--all]\n"
+                  << "Either form accepts --var <name>=<value> to fill ${name} placeholders." << std::endl;
+        return false;
+    }
+    template_name = positional[0];
+    target_file = positional[1];
+    snippet_file = positional[expected - 1];
+    if (anchor.kind == InsertAnchor::LINE && !parse_line_number(positional[2], anchor.line_number)) {
+        std::cerr << "Invalid line number: " << positional[2] << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Parses the arguments of a complete command.
+ *
+ * @param args The arguments following the command name.
+ * @param query Receives the text to complete.
+ * @param snippet_source Receives the path of the snippet source.
+ * @param limit Receives the maximum number of names, given with "--limit <count>" (default 20).
+ * @return False, after printing an error, if the arguments are malformed.
+ */
+
+bool parse_complete_args(const std::vector<std::string>& args, std::string& query, std::string& snippet_source,
+size_t& limit) {
+    std::vector<std::string> positional;
+    int count = 20;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "--limit" && i + 1 < args.size()) {
+            const std::string& value = args[++i];
+            if (!parse_line_number(value, count)) {
+                std::cerr << "Invalid limit: " << value << std::endl;
+                return false;
+            }
+        } else {
+            positional.push_back(args[i]);
+        }
+    }
+    if (positional.size() < 2) {
+        std::cerr << "Usage: codesnip complete <prefix> <snippet_file> [--limit <count>]" << std::endl;
+        return false;
+    }
+    query = positional[0];
+    snippet_source = positional[1];
+    limit = (size_t)count;
+    return true;
+}
+
+/**
+ * @brief Writes expansions of a parameterized template, one per set of variables.
+ *
+ * The template is looked up and compiled once. Without a variables file a single instance is written
+ * using the given variables. With one, each non-empty line that does not start with '#' describes an
+ * instance as "name=value" assignments (quoted like batch manifest arguments), and the given variables
+ * supply defaults. All instances are expanded into one output buffer, which is reused and flushed in
+ * large writes, so the cost per instance is the copying of its text.
+ *
+ * @param template_name The template to expand.
+ * @param snippet_file Path to the snippet source holding the template.
+ * @param defaults Values used for every instance unless a line overrides them.
+ * @param vars_file Path of the variables file, "-" for standard input, or empty for a single instance.
+ * @param output_file Path to write the instances to, or empty for standard output.
+ * @return False, after printing an error, if the template or a variable is missing or a write fails.
+ */
+
+bool expand_instances(const std::string& template_name, const std::string& snippet_file,
+const TemplateVariables& defaults, const std::string& vars_file, const std::string& output_file) {
+    // Look up the template body and compile it
+    std::string body;
+    if (is_snippet_collection(snippet_file)) {
+        if (!find_in_collection(snippet_file, template_name, body)) {
+            return false;
+        }
+    } else {
+        MappedFile snippets;
+        if (!snippets.open(snippet_file)) {
+            std::cerr << "Error opening snippet file: " << snippet_file << std::endl;
+            return false;
+        }
+        std::string_view found;
+        if (!find_template(snippet_file, snippets, template_name, found)) {
+            std::cerr << "Template '" << template_name << "' not found in snippet file." << std::endl;
+            return false;
+        }
+        body.assign(found.data(), found.size());
+    }
+    CompiledTemplate compiled;
+    compiled.compile(body);
+
+    // Open the variables file and the output
+    std::ifstream vars_input;
+    if (!vars_file.empty() && vars_file != "-") {
+        vars_input.open(vars_file);
+        if (!vars_input.is_open()) {
+            std::cerr << "Error opening variables file: " << vars_file << std::endl;
+            return false;
+        }
+    }
+    std::istream& input = vars_file == "-" ? std::cin : vars_input;
+    int output_fd = output_file.empty() ? STDOUT_FILENO
+                                        : ::open(output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
+        std::cerr << "Error writing to target file: " << output_file << std::endl;
+        return false;
+    }
+
+    std::string output;
+    output.reserve(2 * COPY_BLOCK_SIZE);
+    TemplateVariables variables = defaults;
+    std::vector<std::string_view> values;
+    std::string line;
+    bool ok = true;
+    bool written = true;
+    uint64_t instances = 0;
+    int line_number = 0;
+
+    // Expand each instance into the shared buffer, writing it out whenever it fills up
+    while (ok && written) {
+        if (!vars_file.empty()) {
+            if (!std::getline(input, line)) {
+                break;
+            }
+            line_number++;
+            std::vector<std::string> assignments = split_manifest_line(line);
+            if (assignments.empty() || assignments[0][0] == '#') {
+                continue;
+            }
+            variables = defaults;
+            for (const std::string& assignment : assignments) {
+                ok = ok && parse_variable_assignment(assignment, variables);
+            }
+        }
+        if (!ok || !compiled.bind(variables, values)) {
+            if (!vars_file.empty()) {
+                std::cerr << "Variables file line " << line_number << " failed." << std::endl;
+            }
+            ok = false;
+            break;
+        }
+
+        compiled.expand(values, output);
+        if (!output.empty() && output.back() != '\n') {
+            output += '\n';
+        }
+        instances++;
+        if (output.size() >= COPY_BLOCK_SIZE) {
+            written = write_all(output_fd, output.data(), output.size());
+            output.clear();
+        }
+        if (vars_file.empty()) {
+            break;
+        }
+    }
+
+    // Write the instances expanded so far, even if a later one failed
+    written = written && write_all(output_fd, output.data(), output.size());
+    if (output_fd != STDOUT_FILENO && ::close(output_fd) != 0) {
+        written = false;
+    }
+    if (!written) {
+        std::cerr << "Error writing to target file: " << (output_file.empty() ? "standard output" : output_file)
+                  << std::endl;
+    } else if (!ok) {
+        std::cerr << "Error expanding template '" << template_name << "' after " << instances << " instances."
+                  << std::endl;
+    }
+    return ok && written;
+}
+
+/**
+ * @brief Applies a manifest of insert/extract/delete/rename operations with one read and one write per file.
+ *
+ * Operations behave as if the corresponding commands were run one after another, but snippet libraries
+ * are loaded once and edited in memory, and insertions are queued per target file and applied in a
+ * single streaming pass when the run finishes. Line numbers of queued insertions are translated back to
+ * the unmodified target, so an insertion may even land inside a snippet inserted earlier in the run.
+ * When a later operation needs to read a file with pending changes, those changes are written first.
+ */
+
+class BatchRunner {
+public:
+    // Runs every operation in the manifest; returns false if any of them failed
+    bool run(std::istream& manifest) {
+        std::string line;
+        int manifest_line = 0;
+        bool ok = true;
+
+        while (std::getline(manifest, line)) {
+            manifest_line++;
+            std::vector<std::string> args = split_manifest_line(line);
+            if (args.empty() || args[0][0] == '#') {
+                continue;
+            }
+
+            if (!run_operation(args)) {
+                std::cerr << "Batch manifest line " << manifest_line << " failed: " << line << std::endl;
+                ok = false;
+            }
+        }
+
+        // Write every file that still has pending changes
+        while (!targets_.empty()) {
+            ok = flush_target(targets_.begin()->first) && ok;
+        }
+        for (auto& library : libraries_) {
+            ok = flush_library(library.first) && ok;
+        }
+        for (auto& writer_lock : writer_locks_) {
+            ::close(writer_lock.second);
+        }
+        writer_locks_.clear();
+        std::cout.flush();
+        return ok;
+    }
+
+private:
+    bool run_operation(const std::vector<std::string>& args) {
+        const std::string& command = args[0];
+        if (command == "insert") {
+            std::string template_name, target_file, snippet_file;
+            InsertAnchor anchor;
+            TemplateVariables variables;
+            if (!parse_insert_args(std::vector<std::string>(args.begin() + 1, args.end()), template_name,
+                                   target_file, snippet_file, anchor, variables)) {
+                return false;
+            }
+            return run_insert(template_name, target_file, anchor, variables, snippet_file);
+        }
+
+        if (command == "extract" && args.size() == 6) {
+            int start_line, end_line;
+            if (!parse_line_number(args[2], start_line) || !parse_line_number(args[3], end_line) ||
+                end_line < start_line) {
+                std::cerr << "Invalid line range." << std::endl;
+                return false;
+            }
+            if (args[4].empty()) {
+                std::cerr << "New template name cannot be empty." << std::endl;
+                return false;
+            }
+            return run_extract(args[1], start_line, end_line, args[4], args[5]);
+        }
+
+        if (command == "delete" && args.size() == 3) {
+            return run_delete(args[1], args[2]);
+        }
+
+        if (command == "rename" && args.size() == 4) {
+            return run_rename(args[1], args[2], args[3]);
+        }
+
+        std::cerr << "Unknown or malformed batch operation: " << command << std::endl;
+        return false;
+    }
+
+    bool run_insert(const std::string& template_name, const std::string& target_file, const InsertAnchor& anchor,
+    const TemplateVariables& variables, const std::string& snippet_file) {
+        LoadedLibrary* library = open_library(snippet_file);
+        if (library == nullptr) {
+            return false;
+        }
+
+        // Copy the template body out of the library, since the library may change later in the run
+        std::string_view body;
+        if (!library_find(*library, template_name, body)) {
+            std::cerr << "Template '" << template_name << "' not found in snippet file." << std::endl;
+            return false;
+        }
+        std::vector<std::string> lines;
+        if (!library_template_lines(*library, template_name, variables, lines)) {
+            return false;
+        }
+        if (lines.empty()) {
+            std::cerr << "No lines found for template '" << template_name << "'." << std::endl;
+            return false;
+        }
+
+        // The target must not be rewritten behind the back of a loaded library
+        if (libraries_.count(target_file) && !flush_library(target_file)) {
+            return false;
+        }
+        libraries_.erase(target_file);
+
+        // Anchors are found while the target is rewritten, so pending insertions are written first
+        if (anchor.kind != InsertAnchor::LINE) {
+            std::string location;
+            if ((targets_.count(target_file) && !flush_target(target_file)) ||
+                insert_at_anchor(target_file, lines, anchor, location) != StoreStatus::OK) {
+                return false;
+            }
+            std::cout << "Inserted snippet '" << template_name << "' into "
+                      << target_file << " at " << location << ".\n";
+            return true;
+        }
+
+        if (!targets_.count(target_file) && access(target_file.c_str(), F_OK) != 0) {
+            std::cerr << "Error opening target file: " << target_file << std::endl;
+            return false;
+        }
+        queue_insertion(targets_[target_file], anchor.line_number, lines);
+
+        std::cout << "Inserted snippet '" << template_name << "' into "
+                  << target_file << " at line " << anchor.line_number << ".\n";
+        return true;
+    }
+
+    bool run_extract(const std::string& source_file, int start_line, int end_line,
+    const std::string& new_template_name, const std::string& snippet_file) {
+        if (targets_.count(source_file) && !flush_target(source_file)) {
+            return false;
+        }
+
+        std::vector<std::string> range_lines;
+        if (!read_line_range(source_file, start_line, end_line, range_lines)) {
+            return false;
+        }
+
+        LoadedLibrary* library = open_library_for_writing(snippet_file);
+        if (library == nullptr) {
+            return false;
+        }
+        if (library->read_only) {
+            std::cerr << "Snippet packs are read-only; edit the text source and recompile: " << snippet_file << std::endl;
+            return false;
+        }
+        if (library->bodies.count(new_template_name)) {
+            std::cerr << "Template '" << new_template_name << "' already exists in snippet file." << std::endl;
+            return false;
+        }
+
+        // Append the new block after an empty line, as extract does
+        std::string body;
+        for (int i = 0; i < (int)range_lines.size(); ++i) {
+            body += range_lines[i];
+            body += '\n';
+        }
+        size_t body_offset = append_template_block(library->content, new_template_name, body);
+        library->bodies[new_template_name] = std::make_pair(body_offset, body.size());
+        library->names.push_back(new_template_name);
+        library->dirty = true;
+
+        std::cout << "Extracted lines from " << source_file
+                  << " and saved as template '" << new_template_name
+                  << "' in snippet file " << snippet_file << ".\n";
+        return true;
+    }
+
+    bool run_delete(const std::string& template_name, const std::string& snippet_file) {
+        LoadedLibrary* library = open_library_for_writing(snippet_file);
+        if (library == nullptr) {
+            return false;
+        }
+        if (library->read_only) {
+            std::cerr << "Snippet packs are read-only; edit the text source and recompile: " << snippet_file << std::endl;
+            return false;
+        }
+        if (!library->bodies.count(template_name)) {
+            std::cerr << "Template '" << template_name << "' not found in snippet file." << std::endl;
+            return false;
+        }
+
+        std::deque<std::string> headers;
+        replace_content(*library, delete_pieces(SnippetLog(library->content), template_name, headers));
+        std::cout << "Deleted template '" << template_name << "' from " << snippet_file << ".\n";
+        return true;
+    }
+
+    bool run_rename(const std::string& old_template_name, const std::string& new_template_name,
+    const std::string& snippet_file) {
+        LoadedLibrary* library = open_library_for_writing(snippet_file);
+        if (library == nullptr) {
+            return false;
+        }
+        if (library->read_only) {
+            std::cerr << "Snippet packs are read-only; edit the text source and recompile: " << snippet_file << std::endl;
+            return false;
+        }
+        if (!library->bodies.count(old_template_name)) {
+            std::cerr << "Template '" << old_template_name << "' not found in snippet file." << std::endl;
+            return false;
+        }
+
+        const std::string new_header = NAME_PREFIX + new_template_name;
+        std::deque<std::string> headers;
+        replace_content(*library, rename_pieces(SnippetLog(library->content), old_template_name, new_header, headers));
+        std::cout << "Renamed template '" << old_template_name << "' to '" << new_template_name
+                  << "' in " << snippet_file << ".\n";
+        return true;
+    }
+
+    /**
+     * @brief Queues an insertion given in the coordinates of the file as modified so far.
+     *
+     * Walks the earlier insertions in line order, shifting the line number back by the lines each
+     * one added. If the line falls inside an earlier insertion, that group is edited in place.
+     */
+    void queue_insertion(LineInsertions& insertions, int line_number, const std::vector<std::string>& lines) {
+        int delta = 0;
+        for (auto& insertion : insertions) {
+            int start = insertion.first + delta;
+            if (line_number < start) {
+                break;
+            }
+
+            std::vector<std::string>& group = insertion.second;
+            if (line_number < start + (int)group.size()) {
+                size_t position = line_number - start;
+                std::string indent = leading_whitespace(group[position]);
+                std::vector<std::string> indented;
+                for (int i = 0; i < (int)lines.size(); ++i) {
+                    indented.push_back(indent + lines[i]);
+                }
+                group.erase(group.begin() + position);
+                group.insert(group.begin() + position, indented.begin(), indented.end());
+                return;
+            }
+            delta += (int)group.size() - 1;
+        }
+        insertions[line_number - delta] = lines;
+    }
+
+    // Loads a snippet library to change it, taking its writer lock until the run ends; a copy loaded
+    // before the lock was taken is loaded again if another process has changed the file since
+    LoadedLibrary* open_library_for_writing(const std::string& snippet_file) {
+        if (!writer_locks_.count(snippet_file)) {
+            int writer_lock = lock_snippet_file(snippet_file);
+            if (writer_lock < 0) {
+                std::cerr << "Error opening snippet file: " << snippet_file << std::endl;
+                return nullptr;
+            }
+            writer_locks_[snippet_file] = writer_lock;
+
+            auto loaded = libraries_.find(snippet_file);
+            uint64_t file_size = 0;
+            int64_t mtime_ns = 0;
+            if (loaded != libraries_.end() &&
+                (!file_stamp(snippet_file, file_size, mtime_ns) || file_size != loaded->second.file_size ||
+                 mtime_ns != loaded->second.mtime_ns)) {
+                libraries_.erase(loaded);
+            }
+        }
+        return open_library(snippet_file);
+    }
+
+    // Loads a snippet library on first use; later calls return the in-memory copy
+    LoadedLibrary* open_library(const std::string& snippet_file) {
+        auto loaded = libraries_.find(snippet_file);
+        if (loaded != libraries_.end()) {
+            return &loaded->second;
+        }
+
+        if (targets_.count(snippet_file) && !flush_target(snippet_file)) {
+            return nullptr;
+        }
+
+        LoadedLibrary library;
+        if (!load_library(snippet_file, library)) {
+            std::cerr << "Error opening snippet file: " << snippet_file << std::endl;
+            return nullptr;
+        }
+        return &(libraries_[snippet_file] = std::move(library));
+    }
+
+    void replace_content(LoadedLibrary& library, const std::vector<std::string_view>& pieces) {
+        std::string content;
+        for (const std::string_view& piece : pieces) {
+            content.append(piece.data(), piece.size());
+        }
+        if (!content.empty() && content.back() != '\n') {
+            content += '\n';
+        }
+        library.content.swap(content);
+        library.dirty = true;
+        index_library(library);
+    }
+
+    bool flush_target(const std::string& target_file) {
+        LineInsertions insertions = std::move(targets_[target_file]);
+        targets_.erase(target_file);
+        return file_splice(target_file, insertions);
+    }
+
+    bool flush_library(const std::string& snippet_file) {
+        LoadedLibrary& library = libraries_[snippet_file];
+        if (!library.dirty) {
+            return true;
+        }
+        library.dirty = false;
+        if (!write_file_pieces(snippet_file, {library.content})) {
+            std::cerr << "Error writing to target file: " << snippet_file << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    std::map<std::string, LoadedLibrary> libraries_;
+    std::map<std::string, LineInsertions> targets_;
+    std::map<std::string, int> writer_locks_;  // Writer locks of the libraries changed by the run
+};
+
+/**
+ * @brief Runs a batch manifest read from a file, or from standard input when the path is "-".
+ *
+ * Each manifest line holds one operation with the same arguments as the command line, for example
+ * `insert for_loop main.cpp 12 cpp_snippets.txt`. Blank lines and lines starting with '#' are ignored.
+ *
+ * @param manifest_file Path to the manifest, or "-" for standard input.
+ * @return True if every operation succeeded.
+ */
+
+bool batch(const std::string& manifest_file) {
+    if (manifest_file == "-") {
+        BatchRunner runner;
+        return runner.run(std::cin);
+    }
+
+    std::ifstream manifest_input(manifest_file);
+    if (!manifest_input.is_open()) {
+        std::cerr << "Error opening manifest file: " << manifest_file << std::endl;
+        return false;
+    }
+
+    BatchRunner runner;
+    return runner.run(manifest_input);
+}
+
+// Returns the daemon socket path: $CODESNIP_SOCKET, else one in $XDG_RUNTIME_DIR, else one in a
+// private per-user directory under /tmp
+std::string daemon_socket_path() {
+    const char* configured = std::getenv("CODESNIP_SOCKET");
+    if (configured != nullptr && *configured != '\0') {
+        return configured;
+    }
+    const char* runtime_dir = std::getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir != nullptr && *runtime_dir == '/') {
+        return std::string(runtime_dir) + "/codesnip.sock";
+    }
+    return "/tmp/codesnip-" + std::to_string(getuid()) + "/daemon.sock";
+}
+
+// Returns the directory that holds a socket
+std::string socket_directory(const std::string& socket_path) {
+    size_t slash = socket_path.rfind('/');
+    if (slash == std::string::npos) {
+        return ".";
+    }
+    return slash == 0 ? "/" : socket_path.substr(0, slash);
+}
+
+// Returns true if only this user, or root, can replace entries in a directory: it must be owned by
+// one of them and either be writable by nobody else or have the sticky bit set, as /tmp does
+bool directory_trusted(const std::string& directory) {
+    struct stat st;
+    return lstat(directory.c_str(), &st) == 0 && S_ISDIR(st.st_mode) &&
+           (st.st_uid == getuid() || st.st_uid == 0) && ((st.st_mode & 022) == 0 || (st.st_mode & S_ISVTX) != 0);
+}
+
+// Returns true if a path is a socket created by this user in a directory other users cannot tamper with
+bool socket_trusted(const std::string& socket_path) {
+    struct stat st;
+    return lstat(socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode) && st.st_uid == getuid() &&
+           (st.st_mode & 077) == 0 && directory_trusted(socket_directory(socket_path));
+}
+
+// Returns true if the process at the other end of a connected Unix socket runs as this user
+bool peer_is_same_user(int fd) {
+#ifdef __linux__
+    ucred credentials;
+    socklen_t length = sizeof(credentials);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0 && credentials.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+// Reads exactly size bytes from a file descriptor
+bool read_exact(int fd, void* data, size_t size) {
+    char* cursor = (char*)data;
+    while (size > 0) {
+        ssize_t received = ::read(fd, cursor, size);
+        if (received <= 0) {
+            return false;
+        }
+        cursor += received;
+        size -= (size_t)received;
+    }
+    return true;
+}
+
+// Sends a length-prefixed string
+bool send_string(int fd, const std::string& value) {
+    uint32_t length = (uint32_t)value.size();
+    return write_all(fd, (const char*)&length, sizeof(length)) && write_all(fd, value.data(), value.size());
+}
+
+// Receives a length-prefixed string
+bool receive_string(int fd, std::string& value) {
+    uint32_t length;
+    if (!read_exact(fd, &length, sizeof(length)) || length > (1u << 30)) {
+        return false;
+    }
+    value.resize(length);
+    return read_exact(fd, &value[0], length);
+}
+
+// Connects to a daemon's Unix domain socket; returns -1 if nothing is listening on it, or if the socket
+// or the process serving it belongs to another user
+int connect_socket(const std::string& socket_path) {
+    sockaddr_un address;
+    if (socket_path.size() >= sizeof(address.sun_path) || !socket_trusted(socket_path)) {
+        return -1;
+    }
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (sockaddr*)&address, sizeof(address)) != 0 || !peer_is_same_user(fd)) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Resolves a path given relative to the client's working directory
+std::string resolve_path(const std::string& cwd, const std::string& path) {
+    if (path.empty() || path[0] == '/') {
+        return path;
+    }
+    return cwd + "/" + path;
+}
+
+volatile sig_atomic_t daemon_stop_requested = 0;
+
+void request_daemon_stop(int) {
+    daemon_stop_requested = 1;
+}
+
+/**
+ * @brief Long-running server that keeps snippet libraries parsed in memory.
+ *
+ * Clients send a command as a list of arguments prefixed with their working directory, and receive the
+ * exit code together with everything the command wrote to stdout and stderr. Requests are handled one
+ * at a time on a single thread, so no locking is needed around the resident libraries. On Linux the
+ * directories of resident libraries are watched with inotify and a library is reloaded as soon as its
+ * file is rewritten; on every platform a library is also reloaded if its size or modification time no
+ * longer match when a request arrives.
+ */
+
+class SnippetDaemon {
+public:
+    // Serves requests until interrupted; returns false if the socket cannot be set up
+    bool run(const std::string& socket_path) {
+        int existing = connect_socket(socket_path);
+        if (existing >= 0) {
+            ::close(existing);
+            std::cerr << "A daemon is already listening on " << socket_path << "." << std::endl;
+            return false;
+        }
+
+        sockaddr_un address;
+        if (socket_path.size() >= sizeof(address.sun_path)) {
+            std::cerr << "Socket path is too long: " << socket_path << std::endl;
+            return false;
+        }
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+        // Only serve from a directory other users cannot swap the socket in; the default one is private
+        std::string directory = socket_directory(socket_path);
+        if (socket_path == daemon_socket_path() && mkdir(directory.c_str(), 0700) != 0 && errno != EEXIST) {
+            std::cerr << "Error creating socket directory: " << directory << std::endl;
+            return false;
+        }
+        if (!directory_trusted(directory)) {
+            std::cerr << "Socket directory can be changed by other users: " << directory << std::endl;
+            return false;
+        }
+
+        // Remove a socket left behind by a daemon that did not shut down cleanly
+        ::unlink(socket_path.c_str());
+        int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        mode_t old_mask = umask(0077);
+        bool bound = listen_fd >= 0 && bind(listen_fd, (sockaddr*)&address, sizeof(address)) == 0;
+        umask(old_mask);
+        if (!bound || listen(listen_fd, 64) != 0) {
+            std::cerr << "Error listening on socket: " << socket_path << std::endl;
+            if (listen_fd >= 0) {
+                ::close(listen_fd);
+            }
+            return false;
+        }
+
+#ifdef __linux__
+        inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+        signal(SIGINT, request_daemon_stop);
+        signal(SIGTERM, request_daemon_stop);
+        signal(SIGPIPE, SIG_IGN);
+        std::cout << "Serving snippet libraries on " << socket_path << "." << std::endl;
+
+        // Wait for clients and file change notifications
+        while (!daemon_stop_requested) {
+            pollfd fds[2] = {{listen_fd, POLLIN, 0}, {inotify_fd_, POLLIN, 0}};
+            int ready = poll(fds, inotify_fd_ >= 0 ? 2 : 1, -1);
+            if (ready < 0) {
+                continue;
+            }
+            if (inotify_fd_ >= 0 && (fds[1].revents & POLLIN)) {
+                process_notifications();
+            }
+            if (fds[0].revents & POLLIN) {
+                int client_fd = accept(listen_fd, nullptr, nullptr);
+                if (client_fd >= 0) {
+                    // Answer only this user's processes, whatever the socket's permissions
+                    if (peer_is_same_user(client_fd)) {
+                        handle_client(client_fd);
+                    }
+                    ::close(client_fd);
+                }
+            }
+        }
+
+        ::close(listen_fd);
+        if (inotify_fd_ >= 0) {
+            ::close(inotify_fd_);
+        }
+        ::unlink(socket_path.c_str());
+        std::cout << "Daemon stopped." << std::endl;
+        return true;
+    }
+
+private:
+    void handle_client(int client_fd) {
+        // Do not let a stalled client, one that stops sending or stops reading, hold up every other request
+        timeval timeout = {2, 0};
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        uint32_t count;
+        if (!read_exact(client_fd, &count, sizeof(count)) || count == 0 || count > 64) {
+            return;
+        }
+        std::vector<std::string> args(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!receive_string(client_fd, args[i])) {
+                return;
+            }
+        }
+
+        // Run the command with its output captured for the client
+        std::ostringstream out, err;
+        std::streambuf* old_out = std::cout.rdbuf(out.rdbuf());
+        std::streambuf* old_err = std::cerr.rdbuf(err.rdbuf());
+        int32_t exit_code = execute(args);
+        std::cout.rdbuf(old_out);
+        std::cerr.rdbuf(old_err);
+
+        write_all(client_fd, (const char*)&exit_code, sizeof(exit_code));
+        send_string(client_fd, out.str());
+        send_string(client_fd, err.str());
+    }
+
+    // Runs one request; args[0] is the client's working directory and args[1] the command
+    int execute(const std::vector<std::string>& args) {
+        const std::string& cwd = args[0];
+        const std::string command = args.size() > 1 ? args[1] : "";
+
+        if (command == "list" && args.size() >= 3) {
+            std::string snippet_file = args[2];
+            LoadedLibrary* library = resident(resolve_path(cwd, snippet_file));
+            if (library == nullptr) {
+                std::cerr << "Error opening snippet file: " << snippet_file << std::endl;
+                return 1;
+            }
+            for (const std::string& name : library->names) {
+                std::cout << name << '\n';
+            }
+            if (library->names.empty()) {
+                std::cout << "No templates found in " << snippet_file << "." << std::endl;
+            }
+            return 0;
+        }
+
+        if (command == "show" && args.size() >= 4) {
+            std::string template_name = args[2];
+            std::string snippet_file = args[3];
+            LoadedLibrary* library = resident(resolve_path(cwd, snippet_file));
+            std::string_view body;
+            if (library == nullptr) {
+                std::cerr << "Error opening snippet file: " << snippet_file << std::endl;
+                return 1;
+            }
+            if (!library_find(*library, template_name, body)) {
+                std::cerr << "Template '" << template_name << "' not found in snippet file." << std::endl;
+                return 1;
+            }
+            std::cout << NAME_PREFIX << template_name << '\n';
+            std::cout.write(body.data(), body.size());
+            if (!body.empty() && body.back() != '\n') {
+                std::cout.put('\n');
+            }
+            return 0;
+        }
+
+        if (command == "insert") {
+            std::string template_name, target_file, snippet_file;
+            InsertAnchor anchor;
+            TemplateVariables variables;
+            if (!parse_insert_args(std::vector<std::string>(args.begin() + 2, args.end()), template_name,
+                                   target_file, snippet_file, anchor, variables)) {
+                return 1;
+            }
+            LoadedLibrary* library = resident(resolve_path(cwd, snippet_file));
+            std::string_view body;
+            if (library == nullptr) {
+                std::cerr << "Error opening snippet file: " << snippet_file << std::endl;
+                return 1;
+            }
+            if (!library_find(*library, template_name, body)) {
+                std::cerr << "Template '" << template_name << "' not found in snippet file." << std::endl;
+                return 1;
+            }
+
+            std::vector<std::string> snippet_lines;
+            if (!library_template_lines(*library, template_name, variables, snippet_lines)) {
+                return 1;
+            }
+            if (snippet_lines.empty()) {
+                std::cerr << "No lines found for template '" << template_name << "'." << std::endl;
+                return 1;
+            }
+            // Write from the client's directory, so errors name the target as the client gave it; requests
+            // are served one at a time, so nothing else sees the daemon's directory change
+            std::string location;
+            StoreStatus status;
+            int daemon_dir = ::open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (daemon_dir >= 0 && chdir(cwd.c_str()) == 0) {
+                status = insert_at_anchor(target_file, snippet_lines, anchor, location);
+                if (fchdir(daemon_dir) != 0) {
+                    std::cerr << "Error returning to the daemon's directory." << std::endl;
+                }
+            } else {
+                status = insert_at_anchor(resolve_path(cwd, target_file), snippet_lines, anchor, location);
+            }
+            if (daemon_dir >= 0) {
+                ::close(daemon_dir);
+            }
+            if (status != StoreStatus::OK) {
+                return 1;
+            }
+            std::cout << "Inserted snippet '" << template_name << "' into "
+                      << target_file << " at " << location << "." << std::endl;
+            return 0;
+        }
+
+        if (command == "complete") {
+            std::string query, snippet_file;
+            size_t limit = 0;
+            if (!parse_complete_args(std::vector<std::string>(args.begin() + 2, args.end()), query, snippet_file,
+                                     limit)) {
+                return 1;
+            }
+            LoadedLibrary* library = resident(resolve_path(cwd, snippet_file));
+            if (library == nullptr) {
+                std::cerr << "Error opening snippet file: " << snippet_file << std::endl;
+                return 1;
+            }
+            if (library->sorted_names.empty()) {
+                library->sorted_names.assign(library->names.begin(), library->names.end());
+                std::sort(library->sorted_names.begin(), library->sorted_names.end());
+                library->sorted_names.erase(std::unique(library->sorted_names.begin(), library->sorted_names.end()),
+                                            library->sorted_names.end());
+                for (const std::string_view& name : library->sorted_names) {
+                    library->sorted_characters.push_back(name_characters(name));
+                }
+            }
+            const std::vector<std::string_view>& names = library->sorted_names;
+            const std::vector<uint64_t>& characters = library->sorted_characters;
+            std::vector<Completion> completions;
+            complete_sorted_names(names.size(), [&names](size_t position) { return names[position]; },
+                                  [&characters](size_t position) { return characters[position]; }, query, limit,
+                                  completions);
+            print_completions(completions);
+            return 0;
+        }
+
+        std::cerr << "Unsupported daemon request: " << command << std::endl;
+        return 1;
+    }
+
+    // Returns the resident copy of a library, loading or reloading it if needed
+    LoadedLibrary* resident(const std::string& snippet_file) {
+        uint64_t file_size = 0;
+        int64_t mtime_ns = 0;
+        if (!file_stamp(snippet_file, file_size, mtime_ns)) {
+            libraries_.erase(snippet_file);
+            return nullptr;
+        }
+
+        auto loaded = libraries_.find(snippet_file);
+        if (loaded != libraries_.end() && loaded->second.file_size == file_size &&
+            loaded->second.mtime_ns == mtime_ns) {
+            return &loaded->second;
+        }
+
+        LoadedLibrary library;
+        if (!load_library(snippet_file, library)) {
+            libraries_.erase(snippet_file);
+            return nullptr;
+        }
+        watch(snippet_file);
+        return &(libraries_[snippet_file] = std::move(library));
+    }
+
+    // Starts watching the directory that holds a library
+    void watch(const std::string& snippet_file) {
+#ifdef __linux__
+        size_t slash = snippet_file.find_last_of('/');
+        std::string directory = slash == std::string::npos ? "." : snippet_file.substr(0, slash);
+        if (inotify_fd_ < 0 || watched_.count(directory)) {
+            return;
+        }
+        int wd = inotify_add_watch(inotify_fd_, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE);
+        if (wd >= 0) {
+            watched_.insert(directory);
+            watch_dirs_[wd] = directory;
+        }
+#else
+        (void)snippet_file;
+#endif
+    }
+
+    // Reloads resident libraries whose files were rewritten, and drops deleted ones
+    void process_notifications() {
+#ifdef __linux__
+        alignas(inotify_event) char buffer[16384];
+        std::set<std::string> changed;
+        ssize_t length;
+        while ((length = ::read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+            for (char* cursor = buffer; cursor < buffer + length;) {
+                inotify_event* event = (inotify_event*)cursor;
+                auto directory = watch_dirs_.find(event->wd);
+                if (event->len > 0 && directory != watch_dirs_.end()) {
+                    changed.insert(directory->second + "/" + event->name);
+                }
+                cursor += sizeof(inotify_event) + event->len;
+            }
+        }
+
+        for (const std::string& path : changed) {
+            if (libraries_.count(path)) {
+                libraries_.erase(path);
+                resident(path);
+            }
+        }
+#endif
+    }
+
+    std::map<std::string, LoadedLibrary> libraries_;
+    std::map<int, std::string> watch_dirs_;
+    std::set<std::string> watched_;
+    int inotify_fd_ = -1;
+};
+
+// Every sidecar file starts with its magic, then the size and mtime of the snippet file it describes
+struct SidecarStamp {
+    char magic[8];
+    uint64_t file_size;
+    int64_t mtime_ns;
+};
+
+// Returns true if a sidecar file describes its snippet file at the given size and mtime
+bool sidecar_current(const std::string& sidecar_file, const char magic[8], uint64_t file_size, int64_t mtime_ns) {
+    int fd = ::open(sidecar_file.c_str(), O_RDONLY | O_CLOEXEC);
+    SidecarStamp stamp;
+    bool current = fd >= 0 && pread(fd, &stamp, sizeof(stamp), 0) == (ssize_t)sizeof(stamp) &&
+                   std::memcmp(stamp.magic, magic, sizeof(stamp.magic)) == 0 && stamp.file_size == file_size &&
+                   stamp.mtime_ns == mtime_ns;
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    return current;
+}
+
+// Moves the stamp of a sidecar file from one state of its snippet file to a later one that it describes
+// equally well; returns true if the sidecar carries the later stamp
+bool restamp_sidecar(const std::string& sidecar_file, const char magic[8], uint64_t old_size, int64_t old_mtime_ns,
+                     uint64_t file_size, int64_t mtime_ns) {
+    int fd = ::open(sidecar_file.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    SidecarStamp stamp;
+    bool restamped = false;
+    if (pread(fd, &stamp, sizeof(stamp), 0) == (ssize_t)sizeof(stamp) &&
+        std::memcmp(stamp.magic, magic, sizeof(stamp.magic)) == 0) {
+        if (stamp.file_size == file_size && stamp.mtime_ns == mtime_ns) {
+            restamped = true;
+        } else if (stamp.file_size == old_size && stamp.mtime_ns == old_mtime_ns) {
+            stamp.file_size = file_size;
+            stamp.mtime_ns = mtime_ns;
+            restamped = pwrite(fd, &stamp, sizeof(stamp), 0) == (ssize_t)sizeof(stamp);
+        }
+    }
+    ::close(fd);
+    return restamped;
+}
+
+// Time a watched file must stay unchanged before its sidecars are brought up to date
+const int WATCH_SETTLE_MS = 50;
+
+/**
+ * @brief Keeps the sidecar files of snippet libraries current while the libraries are being edited.
+ *
+ * Every block of a watched library is held in memory together with a hash of its segment, the bytes
+ * from the end of the previous block to its own end marker. When the file changes, segments are
+ * compared with the new contents from the front at their old offsets, and from the back at the offsets
+ * the change in size moves them to. What lies between the unchanged segments is the edited range, and
+ * only it is parsed again. The index is then patched in place (see IndexUpdate), the search index is
+ * updated in memory and written out, and the name table is only rewritten if a name appeared or
+ * disappeared. Files with delete, rename or alias records, and edits that the kept state cannot follow
+ * (for example a block that now runs on past the edited range), get fresh sidecars from a full parse.
+ *
+ * A sync holds the library's writer lock, so it never sees a codesnip write half done; if the file
+ * changes while it is being synced, the sync is dropped and redone on the next notification. On Linux
+ * the directories of the libraries are watched with inotify, and a library is synced once its
+ * directory has been quiet for WATCH_SETTLE_MS. Elsewhere, the libraries are checked once a second.
  */
 
-void delete_template(std::string& template_name, std::string& snippet_file) {
-    // Open the snippet file for reading
-    std::ifstream snippet_input(snippet_file);
-    if (!snippet_input.is_open()) {
-        std::cerr << "Error opening snippet file: " << snippet_file << std::endl;
-        return;
+class SnippetWatcher {
+public:
+    // Watches a snippet file, directory or glob until interrupted; returns false if there is nothing to watch
+    bool run(const std::string& snippet_source) {
+        source_ = snippet_source;
+        collection_ = is_snippet_collection(snippet_source);
+        if (collection_ && !refresh_files()) {
+            std::cerr << "No snippet files found for: " << snippet_source << std::endl;
+            return false;
+        }
+        if (!collection_) {
+            uint64_t file_size = 0;
+            int64_t mtime_ns = 0;
+            if (!file_stamp(snippet_source, file_size, mtime_ns)) {
+                std::cerr << "Error opening snippet file: " << snippet_source << std::endl;
+                return false;
+            }
+            add_library(watch_key(snippet_source));
+        }
+
+#ifdef __linux__
+        inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+        for (const auto& library : libraries_) {
+            watch_directory(directory_of(library.first));
+        }
+        signal(SIGINT, request_daemon_stop);
+        signal(SIGTERM, request_daemon_stop);
+
+        for (auto& library : libraries_) {
+            sync(library.first, library.second, false);
+        }
+        std::cout << "Watching " << libraries_.size() << (libraries_.size() == 1 ? " snippet file" : " snippet files")
+                  << (collection_ ? " under " + snippet_source : "") << "." << std::endl;
+
+        // Wait for changes, letting a burst of writes settle before reading the files
+        while (!daemon_stop_requested) {
+            std::set<std::string> changed;
+            if (inotify_fd_ >= 0) {
+                pollfd fd = {inotify_fd_, POLLIN, 0};
+                if (poll(&fd, 1, -1) <= 0) {
+                    continue;
+                }
+                do {
+                    read_notifications(changed);
+                } while (!daemon_stop_requested && poll(&fd, 1, WATCH_SETTLE_MS) > 0);
+            } else {
+                poll(nullptr, 0, 1000);
+                for (const auto& library : libraries_) {
+                    changed.insert(library.first);
+                }
+            }
+            if (daemon_stop_requested) {
+                break;
+            }
+
+            if (collection_ && (inotify_fd_ < 0 || !changed.empty())) {
+                refresh_files();
+            }
+            for (auto& library : libraries_) {
+                if (changed.count(library.first) || !library.second.synced) {
+                    sync(library.first, library.second, true);
+                }
+            }
+        }
+
+        if (inotify_fd_ >= 0) {
+            ::close(inotify_fd_);
+        }
+        std::cout << "Watch stopped." << std::endl;
+        return true;
+    }
+
+private:
+    // A block of a watched library, next to its entry in the library's search index
+    struct WatchedBlock {
+        uint64_t end_offset = 0;    // Byte offset just past the "#-- end" line
+        uint64_t segment_hash = 0;  // hash_body() of the bytes from the previous block's end to end_offset
+        uint64_t body_hash = 0;     // hash_body() of the body
+    };
+
+    // What is known about a watched library as of its last sync
+    struct WatchedLibrary {
+        bool synced = false;       // False until the sidecars were brought up to date with the file
+        bool incremental = false;  // False for packs and files with records, which are not followed block by block
+        uint64_t file_size = 0;
+        int64_t mtime_ns = 0;
+        SearchIndex search;                           // Every block, in file order
+        std::vector<WatchedBlock> blocks;             // Parallel to search.entries
+        uint64_t tail_hash = 0;                       // hash_body() of the text after the last block
+        std::map<std::string, uint32_t> name_counts;  // Number of blocks with each name
+    };
+
+    // The blocks parsed from the edited range of a library, and the blocks they replace
+    struct LibraryEdit {
+        size_t first = 0;             // Id of the first replaced block
+        size_t removed = 0;           // Number of replaced blocks
+        uint64_t range_start = 0;     // Offset of the edited range
+        uint64_t old_range_end = 0;   // End of the edited range before the edit
+        int64_t delta = 0;            // Change in size of the file, and of the edited range
+        std::vector<std::pair<SearchEntry, std::string_view>> added;
+        std::vector<WatchedBlock> added_blocks;
+    };
+
+    // Returns the form of a path that notifications for it are recognized by
+    static std::string watch_key(const std::string& path) {
+        return std::filesystem::path(path).lexically_normal().string();
+    }
+
+    static std::string directory_of(const std::string& path) {
+        std::string directory = std::filesystem::path(path).parent_path().string();
+        return directory.empty() ? "." : directory;
+    }
+
+    void add_library(const std::string& snippet_file) {
+        if (libraries_.emplace(snippet_file, WatchedLibrary()).second) {
+            watch_directory(directory_of(snippet_file));
+        }
+    }
+
+    // Picks up the files that appeared in a watched directory or glob and forgets those that are gone
+    bool refresh_files() {
+        std::vector<std::string> snippet_files;
+        bool found = expand_snippet_source(source_, snippet_files);
+        std::set<std::string> current;
+        for (const std::string& snippet_file : snippet_files) {
+            current.insert(watch_key(snippet_file));
+        }
+        for (auto library = libraries_.begin(); library != libraries_.end();) {
+            if (current.count(library->first)) {
+                ++library;
+                continue;
+            }
+            std::cout << library->first << " was removed." << std::endl;
+            library = libraries_.erase(library);
+        }
+        for (const std::string& snippet_file : current) {
+            add_library(snippet_file);
+        }
+
+        // Watch every directory below a watched directory, so new files anywhere in it are seen
+        std::error_code error;
+        if (std::filesystem::is_directory(source_, error)) {
+            watch_directory(watch_key(source_));
+            for (std::filesystem::recursive_directory_iterator it(source_, error), end; !error && it != end;
+                 it.increment(error)) {
+                if (it->is_directory(error)) {
+                    watch_directory(watch_key(it->path().string()));
+                }
+            }
+        } else if (std::filesystem::is_directory(directory_of(source_), error)) {
+            watch_directory(watch_key(directory_of(source_)));
+        }
+        return found;
+    }
+
+    void watch_directory(const std::string& directory) {
+#ifdef __linux__
+        if (inotify_fd_ < 0 || watched_.count(directory)) {
+            return;
+        }
+        int wd = inotify_add_watch(inotify_fd_, directory.c_str(),
+                                   IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM |
+                                   IN_DELETE);
+        if (wd >= 0) {
+            watched_.insert(directory);
+            watch_dirs_[wd] = directory;
+        }
+#else
+        (void)directory;
+#endif
+    }
+
+    // Collects the watched libraries, and for a directory or glob the possible new ones, that changed
+    void read_notifications(std::set<std::string>& changed) {
+#ifdef __linux__
+        alignas(inotify_event) char buffer[16384];
+        ssize_t length;
+        while ((length = ::read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+            for (char* cursor = buffer; cursor < buffer + length;) {
+                inotify_event* event = (inotify_event*)cursor;
+                cursor += sizeof(inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    for (const auto& library : libraries_) {
+                        changed.insert(library.first);
+                    }
+                    changed.insert(source_);
+                    continue;
+                }
+                auto directory = watch_dirs_.find(event->wd);
+                if (event->len == 0 || directory == watch_dirs_.end()) {
+                    continue;
+                }
+                std::string path = watch_key(directory->second + "/" + event->name);
+                bool new_file = collection_ && ((event->mask & IN_ISDIR) ||
+                                                (std::filesystem::is_directory(source_)
+                                                     ? std::filesystem::path(path).extension() == ".txt"
+                                                     : fnmatch(watch_key(source_).c_str(), path.c_str(), 0) == 0));
+                if (libraries_.count(path) || new_file) {
+                    changed.insert(path);
+                }
+            }
+        }
+#else
+        (void)changed;
+#endif
+    }
+
+    /**
+     * @brief Brings the sidecars of a library up to date with its file.
+     *
+     * @param snippet_file Path of the library.
+     * @param library What is known about the library; updated to the file's current state.
+     * @param report Whether to print what was done.
+     */
+
+    void sync(const std::string& snippet_file, WatchedLibrary& library, bool report) {
+        auto started = std::chrono::steady_clock::now();
+        uint64_t file_size = 0;
+        int64_t mtime_ns = 0;
+        if (!file_stamp(snippet_file, file_size, mtime_ns)) {
+            if (library.synced) {
+                std::cout << snippet_file << " was removed." << std::endl;
+            }
+            library = WatchedLibrary();
+            return;
+        }
+        if (library.synced && library.file_size == file_size && library.mtime_ns == mtime_ns) {
+            return;
+        }
+
+        // Wait for writers to finish, then look at the file as they left it
+        int lock_fd = lock_snippet_file(snippet_file);
+        MappedFile snippets;
+        if (!file_stamp(snippet_file, file_size, mtime_ns) || !snippets.open(snippet_file)) {
+            if (lock_fd >= 0) {
+                ::close(lock_fd);
+            }
+            return;
+        }
+
+        std::string summary;
+        LibraryEdit edit;
+        if (library.synced && library.incremental && find_edit(library, snippets.view(), edit)) {
+            if (unchanged_since(snippet_file, file_size, mtime_ns)) {
+                apply_edit(snippet_file, library, snippets.view(), edit, file_size, mtime_ns);
+                summary = "re-parsed " + std::to_string(edit.old_range_end + edit.delta - edit.range_start) +
+                          " bytes, " + std::to_string(edit.removed) + " templates replaced by " +
+                          std::to_string(edit.added.size());
+            }
+        } else if (full_sync(snippet_file, library, snippets.view(), file_size, mtime_ns)) {
+            summary = std::to_string(library.incremental ? library.search.entries.size() : count_blocks(snippets.view())) +
+                      " templates indexed";
+        }
+        if (lock_fd >= 0) {
+            ::close(lock_fd);
+        }
+
+        if (report && !summary.empty()) {
+            double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+            char timing[32];
+            std::snprintf(timing, sizeof(timing), "%.1f ms", elapsed);
+            std::cout << "Updated " << snippet_file << ": " << summary << " (" << timing << ")." << std::endl;
+        }
+    }
+
+    // Returns true if a file still has the size and mtime it had when it was mapped
+    static bool unchanged_since(const std::string& snippet_file, uint64_t file_size, int64_t mtime_ns) {
+        uint64_t current_size = 0;
+        int64_t current_mtime_ns = 0;
+        return file_stamp(snippet_file, current_size, current_mtime_ns) && current_size == file_size &&
+               current_mtime_ns == mtime_ns;
+    }
+
+    static size_t count_blocks(std::string_view data) {
+        SnippetParser parser(data);
+        TemplateView tmpl;
+        size_t count = 0;
+        while (parser.next(tmpl)) {
+            count++;
+        }
+        return count;
+    }
+
+    // Parses a whole library into the kept state and makes sure every sidecar describes it
+    bool full_sync(const std::string& snippet_file, WatchedLibrary& library, std::string_view data,
+                   uint64_t file_size, int64_t mtime_ns) {
+        library = WatchedLibrary();
+        if (is_snippet_pack(data)) {
+            // Packs are only ever written whole by compile and keep no sidecars
+            library.synced = unchanged_since(snippet_file, file_size, mtime_ns);
+            library.file_size = file_size;
+            library.mtime_ns = mtime_ns;
+            return false;
+        }
+
+        SnippetParser parser(data);
+        TemplateView tmpl;
+        std::vector<std::pair<SearchEntry, std::string_view>> parsed;
+        uint64_t previous_end = 0;
+        while (parser.next(tmpl)) {
+            SearchEntry entry;
+            entry.header_offset = tmpl.header_offset;
+            entry.body_offset = tmpl.body.data() - data.data();
+            entry.body_length = tmpl.body.size();
+            entry.name = std::string(tmpl.name);
+            WatchedBlock block;
+            block.end_offset = tmpl.end_offset;
+            block.segment_hash = hash_body(data.data() + previous_end, tmpl.end_offset - previous_end);
+            block.body_hash = hash_body(tmpl.body.data(), tmpl.body.size());
+            previous_end = tmpl.end_offset;
+            library.blocks.push_back(block);
+            library.name_counts[entry.name]++;
+            parsed.emplace_back(std::move(entry), tmpl.body);
+        }
+        library.tail_hash = hash_body(data.data() + previous_end, data.size() - previous_end);
+        library.incremental = parser.records().empty();
+        if (!unchanged_since(snippet_file, file_size, mtime_ns)) {
+            library = WatchedLibrary();
+            return false;
+        }
+
+        // Records make later blocks depend on earlier ones; such files get their sidecars rebuilt
+        if (!library.incremental) {
+            library.blocks.clear();
+            library.name_counts.clear();
+            if (!sidecar_current(snippet_file + ".idx", INDEX_MAGIC, file_size, mtime_ns)) {
+                build_index(snippet_file);
+            }
+            if (!sidecar_current(snippet_file + ".tri", SEARCH_MAGIC, file_size, mtime_ns)) {
+                SearchIndex index;
+                if (build_search_index(snippet_file, index)) {
+                    write_search_index(snippet_file, index, file_size, mtime_ns);
+                }
+            }
+            if (!sidecar_current(snippet_file + ".names", NAMES_MAGIC, file_size, mtime_ns)) {
+                NameTable names;
+                names.open(snippet_file);
+            }
+        } else {
+            // Take the search index from its file if it is current, else index every block
+            if (!sidecar_current(snippet_file + ".tri", SEARCH_MAGIC, file_size, mtime_ns) ||
+                !load_search_index(snippet_file, library.search) ||
+                library.search.entries.size() != parsed.size()) {
+                library.search = SearchIndex();
+                for (auto& block : parsed) {
+                    search_index_add(library.search, std::move(block.first), block.second);
+                }
+                search_index_mark_visible(library.search);
+                write_search_index(snippet_file, library.search, file_size, mtime_ns);
+            }
+            if (!sidecar_current(snippet_file + ".idx", INDEX_MAGIC, file_size, mtime_ns)) {
+                build_index(snippet_file);
+            }
+            if (!sidecar_current(snippet_file + ".names", NAMES_MAGIC, file_size, mtime_ns)) {
+                write_names(snippet_file, library, file_size, mtime_ns);
+            }
+        }
+        library.synced = true;
+        library.file_size = file_size;
+        library.mtime_ns = mtime_ns;
+        return true;
+    }
+
+    static void write_names(const std::string& snippet_file, const WatchedLibrary& library, uint64_t file_size,
+                     int64_t mtime_ns) {
+        std::vector<std::string_view> names;
+        std::vector<uint64_t> characters;
+        names.reserve(library.name_counts.size());
+        characters.reserve(library.name_counts.size());
+        for (const auto& name : library.name_counts) {
+            names.push_back(name.first);
+            characters.push_back(name_characters(name.first));
+        }
+        write_names_table(snippet_file, names, characters, file_size, mtime_ns);
+    }
+
+    /**
+     * @brief Finds the range of a library that an edit changed and parses the blocks in it.
+     *
+     * @param library The library as of its last sync.
+     * @param data The file's new contents.
+     * @param edit Receives the replaced blocks and the blocks parsed in their place.
+     * @return False if the new blocks cannot be told apart from the rest of the file without a full parse.
+     */
+
+    static bool find_edit(const WatchedLibrary& library, std::string_view data, LibraryEdit& edit) {
+        const std::vector<SearchEntry>& entries = library.search.entries;
+        const std::vector<WatchedBlock>& blocks = library.blocks;
+        const size_t count = blocks.size();
+        const int64_t delta = (int64_t)data.size() - (int64_t)library.file_size;
+        auto segment_start = [&](size_t k) { return k > 0 ? blocks[k - 1].end_offset : 0; };
+        auto segment_end = [&](size_t k) { return k < count ? blocks[k].end_offset : library.file_size; };
+
+        // Skip the leading blocks that are unchanged in place; a block that does not end with a newline
+        // after its end marker could run on into text added behind it
+        size_t first = 0;
+        while (first < count && blocks[first].end_offset <= data.size() &&
+               entries[first].body_offset + entries[first].body_length < blocks[first].end_offset &&
+               data[blocks[first].end_offset - 1] == '\n' &&
+               hash_body(data.data() + segment_start(first), blocks[first].end_offset - segment_start(first)) ==
+                   blocks[first].segment_hash) {
+            first++;
+        }
+        const uint64_t range_start = segment_start(first);
+
+        // Skip the trailing segments, the text after the last block first, that are unchanged but moved
+        size_t last = count + 1;
+        while (last > first) {
+            size_t k = last - 1;
+            int64_t start = (int64_t)segment_start(k) + delta;
+            int64_t end = (int64_t)segment_end(k) + delta;
+            if (start < (int64_t)range_start || end > (int64_t)data.size() ||
+                (start > 0 && start < (int64_t)data.size() && data[start - 1] != '\n') ||
+                hash_body(data.data() + start, end - start) != (k < count ? blocks[k].segment_hash : library.tail_hash)) {
+                break;
+            }
+            last = k;
+        }
+        const uint64_t old_range_end = last <= count ? segment_start(last) : library.file_size;
+        const uint64_t range_end = old_range_end + delta;
+
+        // Parse the edited range; it must end between blocks, as a parse of the whole file would
+        std::string_view range = data.substr(range_start, range_end - range_start);
+        SnippetParser parser(range);
+        TemplateView tmpl;
+        uint64_t previous_end = range_start;
+        edit.added.clear();
+        edit.added_blocks.clear();
+        while (parser.next(tmpl)) {
+            SearchEntry entry;
+            entry.header_offset = range_start + tmpl.header_offset;
+            entry.body_offset = tmpl.body.data() - data.data();
+            entry.body_length = tmpl.body.size();
+            entry.visible = false;
+            entry.name = std::string(tmpl.name);
+            WatchedBlock block;
+            block.end_offset = range_start + tmpl.end_offset;
+            block.segment_hash = hash_body(data.data() + previous_end, block.end_offset - previous_end);
+            block.body_hash = hash_body(tmpl.body.data(), tmpl.body.size());
+            previous_end = block.end_offset;
+            if (range_end < data.size() && entry.body_offset + entry.body_length == block.end_offset) {
+                return false;  // No end marker before the end of the range
+            }
+            edit.added.emplace_back(std::move(entry), tmpl.body);
+            edit.added_blocks.push_back(block);
+        }
+        if (!parser.records().empty() || (range_end < data.size() && range_end > 0 && data[range_end - 1] != '\n')) {
+            return false;
+        }
+
+        edit.first = first;
+        edit.removed = std::min(last, count) - first;
+        edit.range_start = range_start;
+        edit.old_range_end = old_range_end;
+        edit.delta = delta;
+        return true;
     }
 
-    std::vector<std::string> lines;
-    std::string line;
-    bool found = false;
+    /**
+     * @brief Applies an edit to the kept state of a library and to its sidecar files.
+     *
+     * The index is patched in place if it still describes the file as it was before the edit. Otherwise
+     * another writer has already brought it, and usually the other sidecars, up to date, or it is gone;
+     * then it is only rebuilt if it is not current.
+     *
+     * @param snippet_file Path of the library.
+     * @param library The library as of its last sync; updated to the file's current state.
+     * @param data The file's new contents.
+     * @param edit The edit found by find_edit().
+     * @param file_size Size of the file with the edit.
+     * @param mtime_ns Modification time of the file with the edit.
+     */
 
-    // Read the file line by line
-    while (std::getline(snippet_input, line)) {
-        if (line == "#-- name: " + template_name) {
-            found = true; // Template found, skip it
-            while (std::getline(snippet_input, line) && line != "#-- end") {
-                // Skip lines until we reach the end marker
+    static void apply_edit(const std::string& snippet_file, WatchedLibrary& library, std::string_view data,
+                           LibraryEdit& edit, uint64_t file_size, int64_t mtime_ns) {
+        std::vector<SearchEntry>& entries = library.search.entries;
+        std::vector<WatchedBlock>& blocks = library.blocks;
+        const size_t removed_end = edit.first + edit.removed;
+        const size_t added_end = edit.first + edit.added.size();
+        // Bodies at or past this offset (before the edit) belong to the unchanged blocks after the range
+        const uint64_t suffix_start = removed_end < blocks.size() ? edit.old_range_end : UINT64_MAX;
+
+        // Count names in before out, so that a name both removed and added does not change the name table
+        std::set<std::string> touched;
+        bool names_changed = false;
+        for (const auto& block : edit.added) {
+            touched.insert(block.first.name);
+            names_changed = library.name_counts[block.first.name]++ == 0 || names_changed;
+        }
+        for (size_t id = edit.first; id < removed_end; ++id) {
+            touched.insert(entries[id].name);
+            auto name_count = library.name_counts.find(entries[id].name);
+            if (--name_count->second == 0) {
+                library.name_counts.erase(name_count);
+                names_changed = true;
             }
-            continue; // Skip the end marker as well
         }
-        lines.push_back(line); // Keep other lines
-    }
 
-    snippet_input.close();
+        // Before anything moves, find where each touched name was defined first, and forget stored
+        // bodies that the edit removed
+        IndexUpdate update;
+        bool patch_index = update.open(snippet_file, library.file_size, library.mtime_ns);
+        std::map<std::string, uint64_t> previous_offsets;
+        for (const std::string& name : touched) {
+            IndexEntry entry;
+            if (patch_index && update.find(name, entry)) {
+                previous_offsets[name] = entry.offset;
+            }
+        }
+        for (size_t id = edit.first; patch_index && id < removed_end; ++id) {
+            IndexEntry entry;
+            if (update.find_body(blocks[id].body_hash, entry) && entry.offset >= edit.range_start &&
+                entry.offset < suffix_start) {
+                update.remove_body(blocks[id].body_hash);
+            }
+        }
 
-    // If the template was not found, print an error message
-    if (!found) {
-        std::cerr << "Template '" << template_name << "' not found in snippet file." << std::endl;
-        return;
+        // Splice the kept state; the segment after the new blocks may now start elsewhere
+        search_index_replace(library.search, edit.first, edit.removed, edit.added, edit.delta);
+        for (size_t id = removed_end; id < blocks.size(); ++id) {
+            blocks[id].end_offset += edit.delta;
+        }
+        blocks.erase(blocks.begin() + edit.first, blocks.begin() + removed_end);
+        blocks.insert(blocks.begin() + edit.first, edit.added_blocks.begin(), edit.added_blocks.end());
+        uint64_t segment_start = added_end > 0 ? blocks[added_end - 1].end_offset : 0;
+        if (added_end < blocks.size()) {
+            blocks[added_end].segment_hash =
+                hash_body(data.data() + segment_start, blocks[added_end].end_offset - segment_start);
+        } else {
+            library.tail_hash = hash_body(data.data() + segment_start, data.size() - segment_start);
+        }
+
+        // Relink every touched name whose first definition was in the range, or is now
+        auto index_entry = [&](size_t id) {
+            IndexEntry entry;
+            entry.offset = entries[id].body_offset;
+            entry.length = entries[id].body_length;
+            entry.line_count = count_lines(data.substr(entry.offset, entry.length));
+            entry.hash = blocks[id].body_hash;
+            return entry;
+        };
+        std::vector<std::pair<std::string, IndexEntry>> relinked;
+        std::vector<std::string> unlinked;
+        for (const std::string& name : touched) {
+            auto previous = previous_offsets.find(name);
+            bool was_before = previous != previous_offsets.end() && previous->second < edit.range_start;
+            bool was_after = previous != previous_offsets.end() && previous->second >= suffix_start;
+            if (!patch_index || was_before) {
+                continue;
+            }
+
+            size_t id = edit.first;
+            while (id < added_end && entries[id].name != name) {
+                id++;
+            }
+            if (id < added_end && was_after) {
+                // The range now defines a name that a later block used to
+                auto moved = std::lower_bound(entries.begin() + added_end, entries.end(), previous->second + edit.delta,
+                                              [](const SearchEntry& entry, uint64_t offset) {
+                                                  return entry.body_offset < offset;
+                                              });
+                if (moved != entries.end() && moved->body_offset == previous->second + edit.delta) {
+                    moved->visible = false;
+                }
+            } else if (id == added_end && was_after) {
+                continue;
+            } else if (id == added_end) {
+                // The definition in the range is gone; a later block may define the name too
+                while (id < entries.size() && entries[id].name != name) {
+                    id++;
+                }
+                if (id == entries.size()) {
+                    unlinked.push_back(name);
+                    continue;
+                }
+            }
+            entries[id].visible = true;
+            relinked.emplace_back(name, index_entry(id));
+        }
+
+        if (patch_index) {
+            if (edit.delta != 0 && suffix_start != UINT64_MAX) {
+                update.shift(suffix_start, edit.delta);
+            }
+            for (const auto& name : relinked) {
+                update.put(name.first, name.second);
+            }
+            for (const std::string& name : unlinked) {
+                update.remove(name);
+            }
+            patch_index = update.commit(true, file_size, mtime_ns);
+        } else {
+            search_index_mark_visible(library.search);
+        }
+        if (!patch_index && !sidecar_current(snippet_file + ".idx", INDEX_MAGIC, file_size, mtime_ns)) {
+            build_index(snippet_file);
+        }
+        bool search_changed = edit.removed > 0 || !edit.added.empty() || edit.delta != 0;
+        if (!sidecar_current(snippet_file + ".tri", SEARCH_MAGIC, file_size, mtime_ns) &&
+            (search_changed || !restamp_sidecar(snippet_file + ".tri", SEARCH_MAGIC, library.file_size,
+                                                library.mtime_ns, file_size, mtime_ns))) {
+            write_search_index(snippet_file, library.search, file_size, mtime_ns);
+        }
+        if (!sidecar_current(snippet_file + ".names", NAMES_MAGIC, file_size, mtime_ns) &&
+            (names_changed || !restamp_sidecar(snippet_file + ".names", NAMES_MAGIC, library.file_size,
+                                               library.mtime_ns, file_size, mtime_ns))) {
+            write_names(snippet_file, library, file_size, mtime_ns);
+        }
+        library.file_size = file_size;
+        library.mtime_ns = mtime_ns;
     }
 
-    file_overwrite(snippet_file, lines, 1, true); // Overwrite the snippet file with the remaining lines
-    
-    // Output a success message
-    std::cout << "Deleted template '" << template_name << "' from " << snippet_file << "." << std::endl;
-}
+    std::string source_;
+    bool collection_ = false;
+    std::map<std::string, WatchedLibrary> libraries_;
+    std::map<int, std::string> watch_dirs_;
+    std::set<std::string> watched_;
+    int inotify_fd_ = -1;
+};
 
 /**
- * @brief Renames a template within a snippet file.
+ * @brief Forwards a command to a running daemon and relays its output.
  *
- * Searches for a template with the specified old name in the snippet file and replaces
- * its `#-- name:` header with a new name. The rest of the template's content remains unchanged.
- * If the original template name is not found, an error message is displayed. The file is then
- * overwritten with the updated lines.
+ * Only `show`, `list`, `insert` and `complete` are forwarded. Setting CODESNIP_NO_DAEMON disables forwarding.
  *
- * @param old_template_name The current name of the template to rename.
- * @param new_template_name The new name to assign to the template.
- * @param snippet_file Path to the snippet file containing the template.
+ * @param argc Argument count from main().
+ * @param argv Argument vector from main().
+ * @param exit_code Receives the exit code reported by the daemon.
+ * @return False if no daemon is reachable, in which case the command should be run directly.
  */
 
-void rename(std::string& old_template_name, std::string& new_template_name, std::string& snippet_file) {
-    // Open the snippet file for reading
-    std::ifstream snippet_input(snippet_file);
-    if (!snippet_input.is_open()) {
-        std::cerr << "Error opening snippet file: " << snippet_file << std::endl;
-        return;
+bool forward_to_daemon(int argc, char* argv[], int& exit_code) {
+    if (std::getenv("CODESNIP_NO_DAEMON") != nullptr) {
+        return false;
     }
 
-    std::vector<std::string> lines;
-    std::string line;
-    bool found = false;
-
-    // Read the file line by line
-    while (std::getline(snippet_input, line)) {
-        if (line == "#-- name: " + old_template_name) {
-            found = true; // Template found, rename it
-            lines.push_back("#-- name: " + new_template_name);
-            continue; // Skip the old name line
-        }
-        lines.push_back(line); // Keep other lines
+    int fd = connect_socket(daemon_socket_path());
+    if (fd < 0) {
+        return false;
     }
 
-    snippet_input.close();
+    // Send the working directory followed by the command and its arguments
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+        ::close(fd);
+        return false;
+    }
+    uint32_t count = (uint32_t)argc;
+    bool ok = write_all(fd, (const char*)&count, sizeof(count)) && send_string(fd, cwd);
+    for (int i = 1; ok && i < argc; ++i) {
+        ok = send_string(fd, argv[i]);
+    }
 
-    // If the template was not found, print an error message
-    if (!found) {
-        std::cerr << "Template '" << old_template_name << "' not found in snippet file." << std::endl;
-        return;
+    int32_t code;
+    std::string out, err;
+    ok = ok && read_exact(fd, &code, sizeof(code)) && receive_string(fd, out) && receive_string(fd, err);
+    ::close(fd);
+    if (!ok) {
+        std::cerr << "Lost connection to the codesnip daemon." << std::endl;
+        exit_code = 1;
+        return true;
     }
 
-    file_overwrite(snippet_file, lines, 1, true); // Overwrite the snippet file with the modified lines
-    
-    // Output a success message
-    std::cout << "Renamed template '" << old_template_name << "' to '" << new_template_name 
-              << "' in " << snippet_file << "." << std::endl;
+    std::cout.write(out.data(), out.size());
+    std::cout.flush();
+    std::cerr.write(err.data(), err.size());
+    exit_code = code;
+    return true;
 }
 
 // Displays a help menu with an overview of commands and detailed usage info including parameter descriptions.
@@ -439,12 +8316,26 @@ void show_help() {
     // Print all available commands
     std::cout << "Available commands:\n";
     std::cout << "  insert    - Insert a snippet into a file\n";
+    std::cout << "  apply     - Insert a snippet into many files in parallel\n";
+    std::cout << "  expand    - Print a parameterized template with its ${name} placeholders filled in\n";
     std::cout << "  extract   - Extract code from a file and save as a snippet\n";
     std::cout << "  list      - List all templates in a snippet file\n";
     std::cout << "  show      - Show the contents of a template\n";
+    std::cout << "  export    - Write many templates, or all of them, in one pass\n";
     std::cout << "  delete    - Delete a template by name\n";
     std::cout << "  rename    - Rename a template\n";
+    std::cout << "  compact   - Remove the records left by log-structured deletes and renames\n";
+    std::cout << "  dedupe    - Store every distinct template body only once\n";
+    std::cout << "  merge     - Merge snippet libraries into one, resolving repeated names\n";
+    std::cout << "  search    - Find templates whose contents match a query\n";
+    std::cout << "  complete  - Suggest template names that start with or fuzzily match a prefix\n";
+    std::cout << "  compile   - Compile snippet files into a binary pack\n";
+    std::cout << "  decompile - Convert a binary pack back into a snippet file\n";
+    std::cout << "  batch     - Apply a manifest of operations in one pass per file\n";
+    std::cout << "  serve     - Keep snippet libraries in memory and answer requests\n";
+    std::cout << "  watch     - Keep the indexes of snippet libraries up to date while they are edited\n";
     std::cout << "  help      - Show this help message\n";
+    std::cout << "Add --stats (or --stats=<file> for JSON) to any command to report where its time went.\n";
 
     std::string cmd;
 
@@ -456,16 +8347,52 @@ void show_help() {
         if (cmd == "insert") {
             std::cout << "\nUsage:\n"
                       << "  ./codesnip.exe insert <template_name> <target_file> <line_number> <snippet_file> [--dry-run]\n"
+                      << "  ./codesnip.exe insert <template_name> <target_file> <snippet_file> --at-marker <text> [--all]\n"
+                      << "  ./codesnip.exe insert <template_name> <target_file> <snippet_file> --at-regex <pattern> [--all]\n"
                       << "Description:\n"
-                      << "  Inserts the specified snippet template into the target file at the given line.\n"
+                      << "  Inserts the specified snippet template into the target file at the given line, or in place of\n"
+                      << "  the first line containing the marker or matching the regular expression.\n"
                       << "Parameters:\n"
                       << "  <template_name>   - Name of the snippet template to insert\n"
                       << "  <target_file>     - File where the snippet will be inserted\n"
                       << "  <line_number>     - Line number in the target file where the snippet should be inserted\n"
-                      << "  <snippet_file>    - File containing all the saved snippets\n";
+                      << "  <snippet_file>    - File containing all the saved snippets\n"
+                      << "  --at-marker       - Replace the first line containing this text instead of a numbered line\n"
+                      << "  --at-regex        - Replace the first line matching this ECMAScript regular expression\n"
+                      << "  --all             - Replace every matching line, not only the first\n"
+                      << "  --var <n>=<value> - Fill ${n} placeholders in the template (repeatable)\n";
+        } else if (cmd == "apply") {
+            std::cout << "\nUsage:\n"
+                      << "  ./codesnip.exe apply <template_name> <snippet_file> <line_number> <target>...\n"
+                      << "  ./codesnip.exe apply <template_name> <snippet_file> --at-marker <text> [--all] <target>...\n"
+                      << "  ./codesnip.exe apply <template_name> <snippet_file> --at-regex <pattern> [--all] <target>...\n"
+                      << "Description:\n"
+                      << "  Inserts the template into every target file, like insert, processing several files at once.\n"
+                      << "  A file that fails is reported and the others are still processed.\n"
+                      << "Parameters:\n"
+                      << "  <template_name>   - Name of the snippet template to insert\n"
+                      << "  <snippet_file>    - File containing all the saved snippets\n"
+                      << "  <line_number>     - Line to replace in each target (or use --at-marker / --at-regex)\n"
+                      << "  <target>...       - Target files or quoted glob patterns\n"
+                      << "  --files <list>    - Also read target paths from a file, one per line ('-' for stdin)\n"
+                      << "  --jobs <count>    - Maximum files processed at once (default: one per CPU)\n"
+                      << "  --var <n>=<value> - Fill ${n} placeholders in the template (repeatable)\n";
+        } else if (cmd == "expand") {
+            std::cout << "\nUsage:\n"
+                      << "  ./codesnip.exe expand <template_name> <snippet_file> [--var <name>=<value>]... "
+                      << "[--vars-file <file>] [--output <file>]\n"
+                      << "Description:\n"
+                      << "  Writes the template with each ${name} placeholder replaced by its value. With a variables\n"
+                      << "  file, writes one instance per line of name=value assignments.\n"
+                      << "Parameters:\n"
+                      << "  <template_name>   - Name of the template to expand\n"
+                      << "  <snippet_file>    - File containing all the saved snippets\n"
+                      << "  --var             - Value for a placeholder; a default when a variables file is given\n"
+                      << "  --vars-file       - File with one instance per line ('-' for stdin)\n"
+                      << "  --output          - File to write to instead of standard output\n";
         } else if (cmd == "extract") {
             std::cout << "\nUsage:\n"
-                      << "  ./codesnip.exe extract <source_file> <start_line> <end_line> <new_template_name> <snippet_file>\n"
+                      << "  ./codesnip.exe extract <source_file> <start_line> <end_line> <new_template_name> <snippet_file> [--dedupe]\n"
                       << "Description:\n"
                       << "  Extracts a block of code from the source file and saves it as a named template.\n"
                       << "Parameters:\n"
@@ -473,7 +8400,8 @@ void show_help() {
                       << "  <start_line>          - Starting line number of the code block\n"
                       << "  <end_line>            - Ending line number of the code block\n"
                       << "  <new_template_name>   - Name to assign to the new snippet\n"
-                      << "  <snippet_file>        - File to save the new snippet into\n";
+                      << "  <snippet_file>        - File to save the new snippet into\n"
+                      << "  --dedupe              - If the same body is already stored, only add a reference to it\n";
         } else if (cmd == "list") {
             std::cout << "\nUsage:\n"
                       << "  ./codesnip.exe list <snippet_file>\n"
@@ -489,23 +8417,134 @@ void show_help() {
                       << "Parameters:\n"
                       << "  <template_name>  - Name of the snippet to display\n"
                       << "  <snippet_file>   - File containing the snippet\n";
+        } else if (cmd == "export") {
+            std::cout << "\nUsage:\n"
+                      << "  ./codesnip.exe export <snippet_file> (<name>... | --all) [--names-file <file>] "
+                      << "[--format text|jsonl|nul] [--output <file>]\n"
+                      << "Description:\n"
+                      << "  Writes the selected templates in library order, reading the library only once.\n"
+                      << "  Text output is a snippet file; jsonl writes {\"name\", \"body\"} objects, one per line;\n"
+                      << "  nul writes each name and body followed by a NUL byte.\n"
+                      << "Parameters:\n"
+                      << "  <snippet_file>   - Snippet file, pack, directory or glob to export from\n"
+                      << "  <name>...        - Template names, or quoted glob patterns such as 'http_*'\n"
+                      << "  --all            - Export every template\n"
+                      << "  --names-file     - Also read names or patterns from a file, one per line ('-' for stdin)\n"
+                      << "  --format         - Output format: text (default), jsonl or nul\n"
+                      << "  --output         - File to write to instead of standard output\n";
         } else if (cmd == "delete") {
             std::cout << "\nUsage:\n"
-                      << "  ./codesnip.exe delete <template_name> <snippet_file>\n"
+                      << "  ./codesnip.exe delete <template_name> <snippet_file> [--log]\n"
                       << "Description:\n"
                       << "  Deletes the specified snippet template from the file.\n"
                       << "Parameters:\n"
                       << "  <template_name>  - Name of the snippet to delete\n"
-                      << "  <snippet_file>   - File containing the snippet\n";
+                      << "  <snippet_file>   - File containing the snippet\n"
+                      << "  --log            - Append a delete record instead of rewriting the file\n";
         } else if (cmd == "rename") {
             std::cout << "\nUsage:\n"
-                      << "  ./codesnip.exe rename <old_name> <new_name> <snippet_file>\n"
+                      << "  ./codesnip.exe rename <old_name> <new_name> <snippet_file> [--log]\n"
                       << "Description:\n"
                       << "  Renames a snippet template in the snippet file.\n"
                       << "Parameters:\n"
                       << "  <old_name>       - Current name of the snippet\n"
                       << "  <new_name>       - New name to assign to the snippet\n"
-                      << "  <snippet_file>   - File containing the snippet\n";
+                      << "  <snippet_file>   - File containing the snippet\n"
+                      << "  --log            - Append a rename record instead of rewriting the file\n";
+        } else if (cmd == "compact") {
+            std::cout << "\nUsage:\n"
+                      << "  ./codesnip.exe compact <snippet_file>\n"
+                      << "Description:\n"
+                      << "  Rewrites the snippet file without the records left by delete --log and\n"
+                      << "  rename --log, dropping the deleted templates.\n"
+                      << "Parameters:\n"
+                      << "  <snippet_file>   - File to compact\n";
+        } else if (cmd == "dedupe") {
+            std::cout << "\nUsage:\n"
+                      << "  ./codesnip.exe dedupe <snippet_file>\n"
+                      << "Description:\n"
+                      << "  Rewrites the snippet file so that templates with identical bodies share one stored\n"
+                      << "  copy, and drops the records left by delete --log and rename --log.\n"
+                      << "Parameters:\n"
+                      << "  <snippet_file>   - File to deduplicate\n";
+        } else if (cmd == "merge") {
+            std::cout << "\nUsage:\n"
+                      << "  ./codesnip.exe merge <output_file> <snippet_file>... "
+                      << "[--on-conflict keep-first|keep-last|rename|fail]\n"
+                      << "Description:\n"
+                      << "  Writes the templates of every input, in input order, into one snippet file. A name\n"
+                      << "  defined by more than one input is resolved by the conflict policy.\n"
+                      << "Parameters:\n"
+                      << "  <output_file>    - Snippet file to write; it may also be one of the inputs\n"
+                      << "  <snippet_file>   - Snippet files, packs, directories or globs to merge\n"
+                      << "  --on-conflict    - keep-first (default) or keep-last keeps one definition, rename\n"
+                      << "                     writes later ones as <name>_2, <name>_3..., and fail writes nothing\n";
+        } else if (cmd == "search") {
+            std::cout << "\nUsage:\n"
+                      << "  ./codesnip.exe search <query> <snippet_file> [--regex]\n"
+                      << "Description:\n"
+                      << "  Lists the templates whose contents contain the query text, or match it as a\n"
+                      << "  regular expression when --regex is given.\n"
+                      << "Parameters:\n"
+                      << "  <query>          - Text or regular expression to look for\n"
+                      << "  <snippet_file>   - Snippet file, directory or glob to search\n";
+        } else if (cmd == "complete") {
+            std::cout << "\nUsage:\n"
+                      << "  ./codesnip.exe complete <prefix> <snippet_file> [--limit <count>]\n"
+                      << "Description:\n"
+                      << "  Prints template names that start with the prefix, in name order. If there are fewer\n"
+                      << "  than the limit, names that contain the prefix's characters in order follow, best first.\n"
+                      << "Parameters:\n"
+                      << "  <prefix>         - Beginning of a template name; fuzzy matches ignore letter case\n"
+                      << "  <snippet_file>   - Snippet file, pack, directory or glob to complete from\n"
+                      << "  --limit          - Maximum number of names to print (default: 20)\n";
+        } else if (cmd == "compile") {
+            std::cout << "\nUsage:\n"
+                      << "  ./codesnip.exe compile <pack_file> <snippet_file>... [--compress]\n"
+                      << "Description:\n"
+                      << "  Compiles one or more snippet files into a binary pack that insert, show and list\n"
+                      << "  can use directly without parsing. The first file defining a name wins.\n"
+                      << "Parameters:\n"
+                      << "  <pack_file>      - Pack file to write\n"
+                      << "  <snippet_file>   - Snippet files, directories or globs to compile\n"
+                      << "  --compress       - Store bodies in compressed 64 KiB blocks that are read on demand\n";
+        } else if (cmd == "decompile") {
+            std::cout << "\nUsage:\n"
+                      << "  ./codesnip.exe decompile <pack_file> <snippet_file>\n"
+                      << "Description:\n"
+                      << "  Writes the templates of a binary pack back out as a text snippet file.\n"
+                      << "Parameters:\n"
+                      << "  <pack_file>      - Pack file to read\n"
+                      << "  <snippet_file>   - Snippet file to write\n";
+        } else if (cmd == "batch") {
+            std::cout << "\nUsage:\n"
+                      << "  ./codesnip.exe batch [manifest_file]\n"
+                      << "Description:\n"
+                      << "  Applies insert, extract, delete and rename operations listed one per line in the\n"
+                      << "  manifest, with the same arguments as the commands themselves. Each file is read\n"
+                      << "  and written once. The manifest is read from standard input if omitted or '-'.\n"
+                      << "Parameters:\n"
+                      << "  [manifest_file]  - File listing the operations to apply\n";
+        } else if (cmd == "serve") {
+            std::cout << "\nUsage:\n"
+                      << "  ./codesnip.exe serve [socket_path]\n"
+                      << "Description:\n"
+                      << "  Runs a daemon that keeps snippet libraries parsed in memory and answers show, list,\n"
+                      << "  insert and complete commands over a Unix domain socket. While it runs, those\n"
+                      << "  commands are forwarded to it automatically; without it they run directly.\n"
+                      << "  Only processes of the same user are served.\n"
+                      << "Parameters:\n"
+                      << "  [socket_path]  - Socket to listen on (default: $CODESNIP_SOCKET, else\n"
+                      << "                   $XDG_RUNTIME_DIR/codesnip.sock, else /tmp/codesnip-<uid>/daemon.sock)\n";
+        } else if (cmd == "watch") {
+            std::cout << "\nUsage:\n"
+                      << "  ./codesnip.exe watch <snippet_file>\n"
+                      << "Description:\n"
+                      << "  Watches snippet files and keeps their index, search index and name table current\n"
+                      << "  as they change. Only the templates around each edit are parsed again, so other\n"
+                      << "  commands never have to rebuild the indexes of a file that is being edited.\n"
+                      << "Parameters:\n"
+                      << "  <snippet_file>   - Snippet file, directory or glob to watch\n";
         } else if (cmd == "help") {
             std::cout << "You're already in help mode.\n";
         } else if (cmd == "exit") {
@@ -516,61 +8555,311 @@ void show_help() {
     }
 }
 
+}  // namespace
+
+#ifndef CODESNIP_NO_MAIN
+// The counting allocator is part of the command-line build only, so programs that link the library
+// keep their own operator new and delete
+void* operator new(size_t size) {
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* pointer = std::malloc(size ? size : 1)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+// GCC cannot see that the replaced operator new uses malloc() and warns about the free() below
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wunknown-warning-option"
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+    std::free(pointer);
+}
+#pragma GCC diagnostic pop
+
 int main(int argc, char* argv[]) {
     // Check if at least one argument (the command) is provided
     if (argc == 1) {
         return 1; // Exit early if no command is given
     }
 
+    // Strip --stats[=<file>] from the arguments; CODESNIP_STATS enables it for every call
+    const char* stats_env = std::getenv("CODESNIP_STATS");
+    bool stats = stats_env != nullptr && std::string(stats_env) != "0";
+    std::string stats_destination = stats ? stats_env : "";
+    int kept = 1;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--stats" || arg.compare(0, 8, "--stats=") == 0) {
+            stats = true;
+            stats_destination = arg.size() > 8 ? arg.substr(8) : "";
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argc = kept;
+    argv[argc] = nullptr;
+    if (argc == 1) {
+        return 1;
+    }
+
     std::string command(argv[1]);
+    if (stats) {
+        enable_stats(command, stats_destination);
+    }
+
+    // Parse insert arguments up front, since where the snippet file appears depends on the anchor form
+    std::string insert_template, insert_target, insert_source;
+    InsertAnchor insert_anchor;
+    TemplateVariables insert_variables;
+    if (command == "insert" && !parse_insert_args(std::vector<std::string>(argv + 2, argv + argc), insert_template,
+                                                  insert_target, insert_source, insert_anchor, insert_variables)) {
+        return 1;
+    }
+
+    std::string complete_query, complete_source;
+    size_t complete_limit = 0;
+    if (command == "complete" && !parse_complete_args(std::vector<std::string>(argv + 2, argv + argc), complete_query,
+                                                      complete_source, complete_limit)) {
+        return 1;
+    }
+
+    // Let a running daemon answer lookups from its resident libraries; measured runs stay in-process
+    std::string snippet_source = command == "insert" ? insert_source
+                                 : command == "complete" ? complete_source
+                                 : command == "show" && argc >= 4 ? argv[3]
+                                 : command == "list" && argc >= 3 ? argv[2] : "";
+    if (!snippet_source.empty() && !stats && !is_snippet_collection(snippet_source)) {
+        int exit_code;
+        if (forward_to_daemon(argc, argv, exit_code)) {
+            return exit_code;
+        }
+    }
 
     // Handle 'insert' command
     if (command == "insert") {
-        if (argc < 6) {
-            // Print usage instructions if arguments are missing
-            std::cerr << "Usage: " << argv[0] << " insert <template_name> <target_file> <line_number> <snippet_file>" << std::endl;
+        if (!insert(insert_source, insert_target, insert_template, insert_anchor, insert_variables)) {
             return 1;
         }
+    }
 
-        // Parse arguments
-        std::string snippet_file = argv[5];
-        std::string target_file = argv[3];
-        std::string template_name = argv[2];
-        int line_number = std::stoi(argv[4]);
+    // Handle 'apply' command
+    else if (command == "apply") {
+        std::vector<std::string> args;
+        std::string list_file;
+        size_t jobs = 0;
+        bool well_formed = true;
+        for (int i = 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            if ((arg == "--files" || arg == "--jobs") && i + 1 < argc) {
+                std::string value = argv[++i];
+                int parsed_jobs = 0;
+                if (arg == "--files") {
+                    list_file = value;
+                } else if (parse_line_number(value, parsed_jobs)) {
+                    jobs = (size_t)parsed_jobs;
+                } else {
+                    well_formed = false;
+                }
+            } else {
+                args.push_back(arg);
+            }
+        }
+
+        // Positional arguments: <template_name> <snippet_file> [<line_number>] <target>...
+        std::vector<std::string> positional;
+        InsertAnchor anchor;
+        TemplateVariables variables;
+        if (!take_variable_args(args, variables)) {
+            return 1;
+        }
+        well_formed = split_anchor_args(args, positional, anchor) && well_formed;
+        size_t first_target = anchor.kind == InsertAnchor::LINE ? 3 : 2;
+        if (!well_formed || positional.size() < first_target ||
+            (positional.size() == first_target && list_file.empty())) {
+            std::cerr << "Usage: " << argv[0] << " apply <template_name> <snippet_file> "
+                      << "(<line_number> | --at-marker <text> | --at-regex <pattern> [--all]) "
+                      << "[--var <name>=<value>]... [--jobs <count>] [--files <list_file>] <target>..." << std::endl;
+            return 1;
+        }
+        if (anchor.kind == InsertAnchor::LINE && !parse_line_number(positional[2], anchor.line_number)) {
+            std::cerr << "Invalid line number: " << positional[2] << std::endl;
+            return 1;
+        }
+
+        std::vector<std::string> target_files;
+        if (!expand_target_files(std::vector<std::string>(positional.begin() + first_target, positional.end()),
+                                 list_file, target_files) ||
+            !apply_template(positional[0], positional[1], anchor, variables, target_files, jobs)) {
+            return 1;
+        }
+    }
+
+    // Handle 'export' command
+    else if (command == "export") {
+        std::vector<std::string> positional;
+        std::string names_file, output_file, format_name = "text";
+        bool all = false;
+        bool well_formed = true;
+        for (int i = 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            if ((arg == "--names-file" || arg == "--output" || arg == "--format") && i + 1 < argc) {
+                std::string& destination = arg == "--names-file" ? names_file
+                                           : arg == "--output"   ? output_file
+                                                                 : format_name;
+                destination = argv[++i];
+            } else if (arg == "--names-file" || arg == "--output" || arg == "--format") {
+                well_formed = false;
+            } else if (arg == "--all") {
+                all = true;
+            } else {
+                positional.push_back(arg);
+            }
+        }
+        if (!well_formed || positional.empty() || (positional.size() == 1 && names_file.empty() && !all)) {
+            std::cerr << "Usage: " << argv[0] << " export <snippet_file> (<name>... | --all) [--names-file <file>] "
+                      << "[--format text|jsonl|nul] [--output <file>]" << std::endl;
+            return 1;
+        }
+        ExportFormat format;
+        if (format_name == "text") {
+            format = ExportFormat::TEXT;
+        } else if (format_name == "jsonl") {
+            format = ExportFormat::JSON_LINES;
+        } else if (format_name == "nul") {
+            format = ExportFormat::NUL_DELIMITED;
+        } else {
+            std::cerr << "Invalid format: " << format_name << std::endl;
+            return 1;
+        }
+
+        if (!export_templates(positional[0], std::vector<std::string>(positional.begin() + 1, positional.end()),
+                              names_file, all, format, output_file)) {
+            return 1;
+        }
+    }
+
+    // Handle 'merge' command
+    else if (command == "merge") {
+        std::vector<std::string> positional;
+        std::string policy_name = "keep-first";
+        bool well_formed = true;
+        for (int i = 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--on-conflict" && i + 1 < argc) {
+                policy_name = argv[++i];
+            } else if (arg == "--on-conflict") {
+                well_formed = false;
+            } else {
+                positional.push_back(arg);
+            }
+        }
+        if (!well_formed || positional.size() < 2) {
+            std::cerr << "Usage: " << argv[0] << " merge <output_file> <snippet_file>... "
+                      << "[--on-conflict keep-first|keep-last|rename|fail]" << std::endl;
+            return 1;
+        }
+        MergePolicy policy;
+        if (policy_name == "keep-first") {
+            policy = MergePolicy::KEEP_FIRST;
+        } else if (policy_name == "keep-last") {
+            policy = MergePolicy::KEEP_LAST;
+        } else if (policy_name == "rename") {
+            policy = MergePolicy::RENAME;
+        } else if (policy_name == "fail") {
+            policy = MergePolicy::FAIL;
+        } else {
+            std::cerr << "Invalid conflict policy: " << policy_name << std::endl;
+            return 1;
+        }
+
+        if (!merge_libraries(positional[0], std::vector<std::string>(positional.begin() + 1, positional.end()),
+                             policy)) {
+            return 1;
+        }
+    }
+
+    // Handle 'expand' command
+    else if (command == "expand") {
+        std::vector<std::string> args(argv + 2, argv + argc);
+        TemplateVariables variables;
+        if (!take_variable_args(args, variables)) {
+            return 1;
+        }
+        std::vector<std::string> positional;
+        std::string vars_file, output_file;
+        bool well_formed = true;
+        for (size_t i = 0; i < args.size(); ++i) {
+            if ((args[i] == "--vars-file" || args[i] == "--output") && i + 1 < args.size()) {
+                std::string& destination = args[i] == "--vars-file" ? vars_file : output_file;
+                destination = args[++i];
+            } else if (args[i] == "--vars-file" || args[i] == "--output") {
+                well_formed = false;
+            } else {
+                positional.push_back(args[i]);
+            }
+        }
+        if (!well_formed || positional.size() < 2) {
+            std::cerr << "Usage: " << argv[0] << " expand <template_name> <snippet_file> [--var <name>=<value>]... "
+                      << "[--vars-file <file>] [--output <file>]" << std::endl;
+            return 1;
+        }
 
-        insert(snippet_file, target_file, template_name, line_number);
+        if (!expand_instances(positional[0], positional[1], variables, vars_file, output_file)) {
+            return 1;
+        }
     }
 
-    // Handle 'extract' command
+    // Handle 'extract' command; --dedupe or CODESNIP_DEDUPE stores repeated bodies as references
     else if (command == "extract") {
-        if (argc < 7) {
-            std::cerr << "Usage: " << argv[0] << " extract <source_file> <start_line> <end_line> <new_template_name> <snippet_file>" << std::endl;
+        const char* dedupe_env = std::getenv("CODESNIP_DEDUPE");
+        bool dedupe_bodies = dedupe_env != nullptr && std::string(dedupe_env) != "0";
+        std::vector<std::string> args;
+        for (int i = 2; i < argc; ++i) {
+            if (std::string(argv[i]) == "--dedupe") {
+                dedupe_bodies = true;
+            } else {
+                args.push_back(argv[i]);
+            }
+        }
+        if (args.size() < 5) {
+            std::cerr << "Usage: " << argv[0] << " extract <source_file> <start_line> <end_line> <new_template_name> <snippet_file> [--dedupe]" << std::endl;
             return 1;
         }
 
         // Parse and validate line numbers
-        std::string source_file = argv[2];
+        std::string source_file = args[0];
         if (source_file.empty()) {
             std::cerr << "Source file cannot be empty." << std::endl;
             return 1;
         }
 
-        int start_line = std::stoi(argv[3]);
-        int end_line = std::stoi(argv[4]);
+        int start_line = std::stoi(args[1]);
+        int end_line = std::stoi(args[2]);
         if (start_line < 1 || end_line < start_line || start_line > end_line) {
             std::cerr << "Invalid line range." << std::endl;
             return 1;
         }
 
-        std::string new_template_name = argv[5];
+        std::string new_template_name = args[3];
         if (new_template_name.empty()) {
             std::cerr << "New template name cannot be empty." << std::endl;
             return 1;
         }
 
-        std::string snippet_file = argv[6];
-
-        extract(source_file, start_line, end_line, new_template_name, snippet_file);
+        SnippetStore store;
+        StoreResult result = store.open(args[4]);
+        if (result) {
+            result = store.extract(source_file, start_line, end_line, new_template_name, dedupe_bodies);
+        }
+        if (!report(result)) {
+            return 1;
+        }
     }
 
     // Handle 'list' command
@@ -581,7 +8870,9 @@ int main(int argc, char* argv[]) {
         }
 
         std::string snippet_file = argv[2];
-        list_templates(snippet_file);
+        if (!list_templates(snippet_file)) {
+            return 1;
+        }
     }
 
     // Handle 'show' command
@@ -593,32 +8884,167 @@ int main(int argc, char* argv[]) {
 
         std::string template_name = argv[2];
         std::string snippet_file = argv[3];
-        show(template_name, snippet_file);
+        if (!show(template_name, snippet_file)) {
+            return 1;
+        }
+    }
+
+    // Handle 'delete' and 'rename' commands; --log or CODESNIP_LOG_STRUCTURED appends records instead
+    else if (command == "delete" || command == "rename") {
+        const char* log_env = std::getenv("CODESNIP_LOG_STRUCTURED");
+        bool log_structured = log_env != nullptr && std::string(log_env) != "0";
+        std::vector<std::string> args;
+        for (int i = 2; i < argc; ++i) {
+            if (std::string(argv[i]) == "--log") {
+                log_structured = true;
+            } else {
+                args.push_back(argv[i]);
+            }
+        }
+
+        if (command == "delete") {
+            if (args.size() < 2) {
+                std::cerr << "Usage: " << argv[0] << " delete <template_name> <snippet_file> [--log]" << std::endl;
+                return 1;
+            }
+            SnippetStore store;
+            StoreResult result = store.open(args[1]);
+            if (result) {
+                result = store.remove(args[0], log_structured);
+            }
+            if (!report(result)) {
+                return 1;
+            }
+        } else {
+            if (args.size() < 3) {
+                std::cerr << "Usage: " << argv[0] << " rename <old_template_name> <new_template_name> <snippet_file> [--log]" << std::endl;
+                return 1;
+            }
+            SnippetStore store;
+            StoreResult result = store.open(args[2]);
+            if (result) {
+                result = store.rename(args[0], args[1], log_structured);
+            }
+            if (!report(result)) {
+                return 1;
+            }
+        }
+    }
+
+    // Handle 'compact' command
+    else if (command == "compact") {
+        if (argc < 3) {
+            std::cerr << "Usage: " << argv[0] << " compact <snippet_file>" << std::endl;
+            return 1;
+        }
+
+        if (!compact(argv[2])) {
+            return 1;
+        }
+    }
+
+    // Handle 'dedupe' command
+    else if (command == "dedupe") {
+        if (argc < 3) {
+            std::cerr << "Usage: " << argv[0] << " dedupe <snippet_file>" << std::endl;
+            return 1;
+        }
+
+        if (!dedupe(argv[2])) {
+            return 1;
+        }
+    }
+
+    // Handle 'search' command
+    else if (command == "search") {
+        std::vector<std::string> args;
+        bool is_regex = false;
+        for (int i = 2; i < argc; ++i) {
+            if (std::string(argv[i]) == "--regex") {
+                is_regex = true;
+            } else {
+                args.push_back(argv[i]);
+            }
+        }
+        if (args.size() < 2) {
+            std::cerr << "Usage: " << argv[0] << " search <query> <snippet_file> [--regex]" << std::endl;
+            return 1;
+        }
+
+        if (!search_templates(args[0], args[1], is_regex)) {
+            return 1;
+        }
+    }
+
+    // Handle 'complete' command
+    else if (command == "complete") {
+        if (!complete_names(complete_query, complete_source, complete_limit)) {
+            return 1;
+        }
+    }
+
+    // Handle 'compile' command
+    else if (command == "compile") {
+        std::vector<std::string> positional;
+        bool compress = false;
+        for (int i = 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--compress") {
+                compress = true;
+            } else {
+                positional.push_back(arg);
+            }
+        }
+        if (positional.size() < 2) {
+            std::cerr << "Usage: " << argv[0] << " compile <pack_file> <snippet_file>... [--compress]" << std::endl;
+            return 1;
+        }
+
+        std::vector<std::string> snippet_sources(positional.begin() + 1, positional.end());
+        if (!compile_pack(positional[0], snippet_sources, compress)) {
+            return 1;
+        }
     }
 
-    // Handle 'delete' command
-    else if (command == "delete") {
+    // Handle 'decompile' command
+    else if (command == "decompile") {
         if (argc < 4) {
-            std::cerr << "Usage: " << argv[0] << " delete <template_name> <snippet_file>" << std::endl;
+            std::cerr << "Usage: " << argv[0] << " decompile <pack_file> <snippet_file>" << std::endl;
             return 1;
         }
 
-        std::string template_name = argv[2];
-        std::string snippet_file = argv[3];
-        delete_template(template_name, snippet_file);
+        if (!decompile_pack(argv[2], argv[3])) {
+            return 1;
+        }
+    }
+
+    // Handle 'batch' command
+    else if (command == "batch") {
+        std::string manifest_file = argc >= 3 ? argv[2] : "-";
+        if (!batch(manifest_file)) {
+            return 1;
+        }
     }
 
-    // Handle 'rename' command
-    else if (command == "rename") {
-        if (argc < 5) {
-            std::cerr << "Usage: " << argv[0] << " rename <old_template_name> <new_template_name> <snippet_file>" << std::endl;
+    // Handle 'serve' command
+    else if (command == "serve") {
+        SnippetDaemon daemon;
+        if (!daemon.run(argc >= 3 ? argv[2] : daemon_socket_path())) {
+            return 1;
+        }
+    }
+
+    // Handle 'watch' command
+    else if (command == "watch") {
+        if (argc < 3) {
+            std::cerr << "Usage: " << argv[0] << " watch <snippet_file>" << std::endl;
             return 1;
         }
 
-        std::string old_template_name = argv[2];
-        std::string new_template_name = argv[3];
-        std::string snippet_file = argv[4];
-        rename(old_template_name, new_template_name, snippet_file);
+        SnippetWatcher watcher;
+        if (!watcher.run(argv[2])) {
+            return 1;
+        }
     }
 
     // Handle 'help' command
@@ -633,4 +9059,5 @@ int main(int argc, char* argv[]) {
     }
 
     return 0; // Program executed successfully
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,110 @@
+#ifndef CODESNIP_H
+#define CODESNIP_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace codesnip {
+
+// Values for the ${name} placeholders of a parameterized template
+using TemplateVariables = std::map<std::string, std::string>;
+
+// Where insert places a template: at a line number, or at the lines that contain a marker or match a regex
+struct InsertAnchor {
+    enum Kind { LINE, MARKER, REGEX } kind = LINE;
+    int line_number = 0;
+    std::string pattern;
+    bool every_match = false;
+};
+
+// Outcome of a SnippetStore operation
+enum class StoreStatus {
+    OK,
+    NOT_FOUND,         // The template, snippet file or anchor does not exist
+    ALREADY_EXISTS,    // A template with the new name is already stored
+    INVALID_ARGUMENT,  // A line range, anchor or template variable is not usable
+    READ_ONLY,         // The snippet file is a compiled pack
+    IO_ERROR           // A file could not be read or written
+};
+
+// Status of a SnippetStore operation with a message for people: what went wrong, or what was done
+struct StoreResult {
+    StoreStatus status = StoreStatus::OK;
+    std::string message;
+
+    bool ok() const { return status == StoreStatus::OK; }
+    explicit operator bool() const { return ok(); }
+};
+
+// A template as seen through a SnippetStore; the views stay valid until the store reloads the file
+struct StoredTemplate {
+    std::string_view name;
+    std::string_view body;
+};
+
+/**
+ * @brief In-process access to one snippet file or compiled pack.
+ *
+ * The file is mapped on first use and kept mapped. Lookups go through the sidecar index, and
+ * templates() parses the file once and caches the result. Every call first checks the file's size and
+ * modification time and reloads it if another process changed it. Changes made through the store
+ * reload it too. Bodies are returned as views into the mapping, so they stay valid until the next call
+ * that reloads.
+ *
+ * Operations return a StoreResult instead of printing. Its message holds the error, or a description
+ * of a change that succeeded. A store is move-only.
+ *
+ * Build the library by compiling codesnip.cpp with CODESNIP_NO_MAIN defined.
+ */
+
+class SnippetStore {
+public:
+    SnippetStore();
+    ~SnippetStore();
+    SnippetStore(SnippetStore&& other) noexcept;
+    SnippetStore& operator=(SnippetStore&& other) noexcept;
+    SnippetStore(const SnippetStore&) = delete;
+    SnippetStore& operator=(const SnippetStore&) = delete;
+
+    // Attaches the store to a snippet file or pack, which must exist
+    StoreResult open(const std::string& snippet_file);
+
+    // Path of the attached snippet file
+    const std::string& path() const;
+
+    // Finds the first live template with a name
+    StoreResult lookup(const std::string& template_name, std::string_view& body);
+
+    // Lists the live templates in file order, including later definitions of a name
+    StoreResult templates(std::vector<StoredTemplate>& templates);
+
+    // Lists the names of the live templates in file order; a pack is listed from its name table alone
+    StoreResult names(std::vector<std::string_view>& names);
+
+    // Replaces the line at an anchor of a target file with the template, indented like that line
+    StoreResult insert(const std::string& template_name, const std::string& target_file, const InsertAnchor& anchor,
+                       const TemplateVariables& variables = TemplateVariables());
+
+    // Appends lines start_line to end_line of a source file as a new template; with dedupe, a body that
+    // is already stored is added as a reference to it
+    StoreResult extract(const std::string& source_file, int start_line, int end_line,
+                        const std::string& new_template_name, bool dedupe = false);
+
+    // Deletes every template with a name, by rewriting the file or by appending a delete record
+    StoreResult remove(const std::string& template_name, bool log_structured = false);
+
+    // Renames every template with a name, by rewriting the file or by appending a rename record
+    StoreResult rename(const std::string& old_template_name, const std::string& new_template_name,
+                       bool log_structured = false);
+
+private:
+    struct State;
+    std::unique_ptr<State> state_;
+};
+
+}  // namespace codesnip
+
+#endif
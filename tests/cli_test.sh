@@ -0,0 +1,254 @@
+#!/bin/bash
+# Runs command-line regression tests against a codesnip binary.
+# Usage: tests/cli_test.sh <codesnip_binary>
+
+if [ $# -ne 1 ]; then
+    echo "Usage: $0 <codesnip_binary>" >&2
+    exit 2
+fi
+
+CODESNIP=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+cd "$WORK_DIR" || exit 2
+export CODESNIP_NO_DAEMON=1
+
+failures=0
+
+# Compares the output of a command with the expected text
+expect_output() {
+    local description=$1 expected=$2
+    shift 2
+    local actual
+    actual=$("$@" 2>&1)
+    if [ "$actual" != "$expected" ]; then
+        echo "FAIL: $description"
+        echo "  expected: $(printf '%q' "$expected")"
+        echo "  actual:   $(printf '%q' "$actual")"
+        failures=$((failures + 1))
+    else
+        echo "ok: $description"
+    fi
+}
+
+# Writes a snippet file with one block per name, each with a one-line body; "name:label" names the
+# body after the label instead, to tell blocks of the same name apart
+write_snippets() {
+    local file=$1 block
+    shift
+    : > "$file"
+    for block in "$@"; do
+        printf '#-- name: %s\nbody of %s\n#-- end\n\n' "${block%%:*}" "${block#*:}" >> "$file"
+    done
+}
+
+mkdir -p library
+write_snippets library/a.txt first shared first
+write_snippets library/b.txt shared second
+expect_output "list shows each name of a directory once, even if the first file repeats it" \
+    "$(printf 'first\nshared\nsecond')" "$CODESNIP" list library
+
+printf '#-- name: decl\n${type} ${field};\n#-- end\n' > vars.txt
+printf 'type="unsigned int" field=count\n"type=long long" field=total\n' > fields.txt
+expect_output "expand reads quoted values after name= and quoted assignments from a variables file" \
+    "$(printf 'unsigned int count;\nlong long total;')" "$CODESNIP" expand decl vars.txt --vars-file fields.txt
+
+printf '#-- name: one\nx\n#-- end\n#-- name: two\nx\n#-- end\n#-- name: three\nx\n#-- end\n' > short.txt
+cp short.txt short.expected
+expect_output "dedupe keeps duplicate blocks that are shorter than an alias to them" \
+    "Nothing to deduplicate in short.txt." "$CODESNIP" dedupe short.txt
+expect_output "dedupe leaves a file of short duplicate blocks unchanged" "" cmp short.txt short.expected
+
+write_snippets linked.txt keep drop
+ln -s linked.txt link.txt
+"$CODESNIP" delete drop link.txt > /dev/null 2>&1
+expect_output "delete through a symlinked library rewrites the file it points to" \
+    "$(printf 'linked.txt\nkeep')" sh -c 'readlink link.txt; "$1" list linked.txt' sh "$CODESNIP"
+
+# Prints the exit status of each command, one per line
+exit_codes() {
+    local command
+    for command in "$@"; do
+        eval "\"\$CODESNIP\" $command" > /dev/null 2>&1
+        echo $?
+    done
+}
+
+write_snippets status.txt present
+printf 'one\n' > status.c
+expect_output "failed commands exit with a non-zero status" "$(printf '1\n1\n1\n1\n1\n1\n0\n0')" exit_codes \
+    "show absent status.txt" "list absent.txt" "delete absent status.txt" "rename absent other status.txt" \
+    "extract status.c 1 1 present status.txt" "insert absent status.c 1 status.txt" \
+    "show present status.txt" "insert present status.c 1 status.txt"
+
+long_body=$(printf 'line %s of a body long enough to be worth compacting away\n' 1 2 3 4 5 6)
+printf '#-- name: big\n%s\n#-- end\n\n#-- name: copy\n%s\n#-- end\n\n#-- name: keep\nk\n#-- end\n' \
+    "$long_body" "$long_body" > aliased.txt
+"$CODESNIP" dedupe aliased.txt > /dev/null
+"$CODESNIP" delete copy aliased.txt --log > /dev/null
+expect_output "a logged delete of an alias only counts its record as dead, so it does not compact" \
+    "#-- delete: copy" tail -n 1 aliased.txt
+expect_output "compact then drops the alias and its delete record" \
+    "$(printf 'big\nkeep\nno records')" sh -c '"$1" compact aliased.txt > /dev/null; "$1" list aliased.txt;
+        grep -q "^#-- [ad]" aliased.txt || echo "no records"' sh "$CODESNIP"
+
+printf '#-- name: keep\nk\n#-- end\n' > repeated.txt
+for copy in 1 2 3; do
+    printf '#-- name: dup\n%s %s\n#-- end\n' "$long_body" "$copy" >> repeated.txt
+done
+"$CODESNIP" delete dup repeated.txt --log > /dev/null
+expect_output "a logged delete counts every block of the name as dead, so it compacts" "0" grep -c "dup" repeated.txt
+
+write_snippets renamed.txt first second
+"$CODESNIP" rename first third renamed.txt --log > /dev/null
+"$CODESNIP" compact renamed.txt > /dev/null
+expect_output "compact applies a logged rename" "$(printf '#-- name: third\nbody of first\n#-- end\n0')" \
+    sh -c 'grep -A2 "^#-- name: third" renamed.txt; grep -c "^#-- rename" renamed.txt' sh
+
+# Overwrites bytes of a search index with 0xff, keeping its stamp; a negative offset counts from the end
+corrupt_search_index() {
+    local file=$1 offset=$2 count=$3
+    [ "$offset" -lt 0 ] && offset=$(($(stat -c %s "$file") + offset))
+    head -c "$count" /dev/zero | tr '\0' '\377' | dd of="$file" bs=1 seek="$offset" conv=notrunc 2> /dev/null
+}
+
+# The header is 56 bytes; the first record's body length is at 72 and its name length at 88
+for corruption in "72 8 a body length" "88 4 a name length" "-4 4 a posting id"; do
+    read -r offset count field <<< "$corruption"
+    write_snippets indexed.txt first second third
+    "$CODESNIP" search "body of" indexed.txt > /dev/null
+    corrupt_search_index indexed.txt.tri "$offset" "$count"
+    expect_output "search rebuilds a search index with $field out of bounds" "$(printf 'first\nsecond\nthird')" \
+        "$CODESNIP" search "body of" indexed.txt
+    rm -f indexed.txt*
+done
+
+# Runs a command through the daemon listening on daemon.sock, printing its output and exit status
+through_daemon() {
+    env -u CODESNIP_NO_DAEMON CODESNIP_SOCKET="$WORK_DIR/daemon.sock" "$CODESNIP" "$@" 2>&1
+    echo "exit $?"
+}
+
+write_snippets served.txt served
+CODESNIP_SOCKET="$WORK_DIR/daemon.sock" "$CODESNIP" serve > serve.out 2>&1 &
+daemon=$!
+tries=0
+while [ ! -S daemon.sock ] && [ $tries -lt 200 ]; do
+    sleep 0.05
+    tries=$((tries + 1))
+done
+for command in "insert served missing/target.c 1 served.txt" "show absent served.txt" "list absent.txt"; do
+    read -r -a words <<< "$command"
+    expect_output "$command through the daemon reports what it does directly" \
+        "$("$CODESNIP" "${words[@]}" 2>&1; echo "exit $?")" through_daemon "${words[@]}"
+done
+kill $daemon 2> /dev/null
+wait $daemon 2> /dev/null
+
+printf '#-- name: three\nfirst\n    second\nthird\n#-- end\n#-- name: two\nalpha\n  beta\n#-- end\n' > batch.txt
+printf '#-- name: one\nsingle\n#-- end\n' >> batch.txt
+printf 'line 1\n    line 2\nline 3\n  line 4\n        line 5\nline 6\nline 7\nline 8\n' > batched.c
+cp batched.c sequential.c
+# Later insertions land inside earlier ones, before them and past the end of the file
+inserts=("three 5" "two 2" "one 7" "three 3" "two 30" "one 1" "one 10")
+: > manifest.txt
+for insert in "${inserts[@]}"; do
+    read -r name line <<< "$insert"
+    printf 'insert %s batched.c %s batch.txt\n' "$name" "$line" >> manifest.txt
+    "$CODESNIP" insert "$name" sequential.c "$line" batch.txt > /dev/null
+done
+"$CODESNIP" batch manifest.txt > /dev/null
+expect_output "batch inserts, some inside earlier ones, match inserting one after another" "" \
+    cmp batched.c sequential.c
+
+# A compressed pack must answer exactly as its source: bodies span 64 KiB blocks, one is empty, and
+# one is random printable text that the codec cannot shrink
+{
+    printf '#-- name: small\nint x = 0;\n#-- end\n\n#-- name: empty\n#-- end\n\n#-- name: spanning\n'
+    seq 1 3000 | sed 's/.*/    value_& = compute(alpha, beta, gamma);/'
+    printf '#-- end\n\n#-- name: random\n'
+    awk 'BEGIN { srand(7); for (l = 0; l < 1200; l++) { s = ""; for (i = 0; i < 60; i++) s = s sprintf("%c", 36 + int(rand() * 91)); print s } }'
+    printf '#-- end\n\n#-- name: last\nreturn x;\n#-- end\n'
+} > packed.txt
+"$CODESNIP" compile plain.pack packed.txt > /dev/null
+"$CODESNIP" compile compressed.pack packed.txt --compress > /dev/null
+expect_output "a compressed pack is smaller than a plain one" "smaller" \
+    sh -c '[ $(stat -c %s compressed.pack) -lt $(stat -c %s plain.pack) ] && echo smaller'
+expect_output "list of a compressed pack matches its source" "$("$CODESNIP" list packed.txt)" \
+    "$CODESNIP" list compressed.pack
+for name in small empty spanning random last; do
+    expect_output "show $name from a compressed pack matches its source" "$("$CODESNIP" show $name packed.txt)" \
+        "$CODESNIP" show $name compressed.pack
+done
+"$CODESNIP" decompile compressed.pack unpacked.txt > /dev/null
+expect_output "decompile of a compressed pack gives back its source" "" cmp packed.txt unpacked.txt
+
+# Prints every answer of list, show, search and complete for a library
+library_answers() {
+    local file=$1 name
+    "$CODESNIP" list "$file"
+    for name in $("$CODESNIP" list "$file"); do
+        "$CODESNIP" show "$name" "$file"
+    done
+    "$CODESNIP" search "body of" "$file"
+    "$CODESNIP" search "second" "$file"
+    "$CODESNIP" complete "" "$file"
+    "$CODESNIP" complete "a" "$file"
+}
+
+# Waits until the watcher has reported a given number of lines, then answers for the library and a
+# fresh copy of it must agree, without the queries rebuilding the sidecars the watcher left
+expect_watched() {
+    local description=$1 lines=$2 tries=0
+    while [ "$(wc -l < watch.out)" -lt "$lines" ] && [ $tries -lt 200 ]; do
+        sleep 0.05
+        tries=$((tries + 1))
+    done
+    expect_output "watch patches the sidecars after $description" "re-parsed" \
+        sh -c 'sed -n "${1}p" watch.out | grep -o "re-parsed"' sh "$lines"
+    local sidecars fresh
+    sidecars=$(cksum watched.txt.idx watched.txt.tri watched.txt.names)
+    rm -f fresh.txt fresh.txt.*
+    cp watched.txt fresh.txt
+    fresh=$(library_answers fresh.txt 2>&1)
+    expect_output "show, search and complete after $description match a fresh rebuild" "$fresh" \
+        library_answers watched.txt
+    expect_output "queries after $description use the sidecars watch wrote" "$sidecars" \
+        cksum watched.txt.idx watched.txt.tri watched.txt.names
+}
+
+# Rewrites the watched library with one write, so the watcher never sees it half written
+rewrite_watched() {
+    write_snippets watched.tmp "$@"
+    cat watched.tmp > watched.txt
+}
+
+write_snippets watched.txt alpha beta:beta_first gamma beta:beta_second delta delta:delta_second
+"$CODESNIP" watch watched.txt > watch.out 2>&1 &
+watcher=$!
+tries=0
+while ! grep -q "^Watching" watch.out && [ $tries -lt 200 ]; do
+    sleep 0.05
+    tries=$((tries + 1))
+done
+
+rewrite_watched alpha beta:beta_first gamma:gamma_edited beta:beta_second delta delta:delta_second
+expect_watched "an edit in the middle of the file" 2
+
+rewrite_watched alpha beta:beta_first gamma:gamma_edited beta:beta_second delta delta:delta_second appended
+expect_watched "an append" 3
+
+rewrite_watched alpha gamma:gamma_edited beta:beta_second delta delta:delta_second appended
+expect_watched "deleting a block whose name is defined again later" 4
+
+rewrite_watched alpha gamma:gamma_edited beta:beta_second delta:delta_second delta appended
+expect_watched "moving a name before an earlier definition of it" 5
+
+kill $watcher 2> /dev/null
+wait $watcher 2> /dev/null
+
+if [ $failures -ne 0 ]; then
+    echo "$failures test(s) failed"
+    exit 1
+fi
+echo "All tests passed"